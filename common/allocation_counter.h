@@ -0,0 +1,59 @@
+#ifndef COMMON_ALLOCATION_COUNTER_H_
+#define COMMON_ALLOCATION_COUNTER_H_
+
+/*
+ * Allocation counter
+ *
+ * Replaces the global operator new and delete so that an example can read how
+ * many heap allocations, and how many bytes, a piece of code asked for:
+ *
+ *   std::size_t before = allocation_count;
+ *   ...
+ *   printf("%zu\n", allocation_count - before);
+ *
+ * heap_in_use and heap_peak follow the bytes malloc actually handed out,
+ * including its rounding, so resetting heap_peak to heap_in_use before a
+ * piece of code gives its peak heap usage.
+ *
+ * The replacements are definitions, not declarations, so only the one
+ * translation unit of an example may include this header. The counters are
+ * plain integers; count on a single thread or after the workers joined.
+ *
+ */
+
+#include <malloc.h>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+static std::size_t allocation_count = 0;
+static std::size_t allocated_bytes = 0;
+static std::size_t heap_in_use = 0;
+static std::size_t heap_peak = 0;
+
+// Kept out of line: once GCC inlines them into std::allocator it pairs
+// malloc with operator delete and reports -Wmismatched-new-delete.
+__attribute__((noinline)) void* operator new(std::size_t size) {
+  ++allocation_count;
+  allocated_bytes += size;
+  void* memory = std::malloc(size);
+  if (memory == nullptr) {
+    throw std::bad_alloc{};
+  }
+  heap_in_use += malloc_usable_size(memory);
+  heap_peak = heap_in_use > heap_peak ? heap_in_use : heap_peak;
+  return memory;
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+  if (memory != nullptr) {
+    heap_in_use -= malloc_usable_size(memory);
+    std::free(memory);
+  }
+}
+
+__attribute__((noinline)) void operator delete(void* memory, std::size_t) noexcept {
+  operator delete(memory);
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef COMMON_COPY_PROFILER_H_
+#define COMMON_COPY_PROFILER_H_
+
+/*
+ * Call-site copy profiler
+ *
+ * Put PROFILE_COPY(bytes) in a copy constructor or copy assignment operator and
+ * mark the operation with COPY_PROFILED. When compiled with -DCOPY_PROFILER,
+ * every copy records its call site and the number of bytes it copied. At exit
+ * the top call sites by count and by bytes are printed, symbolized. Without
+ * the define both macros expand to nothing.
+ *
+ * Call sites are the return address of the copy operation. COPY_PROFILED keeps
+ * it out of line, since an inlined copy would report its caller's caller.
+ * -DCOPY_PROFILER_DEPTH=N records a backtrace of N frames instead, which is
+ * slower but tells apart copies made by the same helper, like
+ * std::vector::push_back, on behalf of different callers.
+ *
+ * Records go to a lock-free sharded hash table. Each thread picks a shard once,
+ * so threads rarely touch the same cache lines. Inserting a new call site is
+ * one compare-and-swap, counting an existing one is two relaxed fetch_adds.
+ * Recording can also be switched off at runtime with SetEnabled(false), which
+ * leaves a single relaxed load on the copy path.
+ *
+ * Link with -rdynamic so that dladdr finds function names, and with -ldl on
+ * older glibc. File and line numbers come from addr2line when it is installed
+ * and the binary has debug info.
+ *
+ */
+
+#ifdef COPY_PROFILER
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#ifndef COPY_PROFILER_DEPTH
+#define COPY_PROFILER_DEPTH 1
+#endif
+
+#define COPY_PROFILED __attribute__((noinline))
+#define PROFILE_COPY(bytes) ::copy_profiler::Record(__builtin_return_address(0), (bytes))
+
+namespace copy_profiler {
+
+constexpr int kDepth = COPY_PROFILER_DEPTH;
+constexpr std::size_t kShards = 16;
+constexpr std::size_t kSlotsPerShard = 1024;
+constexpr std::size_t kTopSites = 10;
+
+struct CallSite {
+  void* frames[kDepth];
+};
+
+struct alignas(64) Slot {
+  // 0 marks an empty slot
+  std::atomic<std::uint64_t> key{0};
+  std::atomic<std::uint64_t> count{0};
+  std::atomic<std::uint64_t> bytes{0};
+  CallSite site;
+};
+
+struct Shard {
+  Slot slots[kSlotsPerShard];
+};
+
+struct Totals {
+  CallSite site;
+  std::uint64_t count;
+  std::uint64_t bytes;
+};
+
+void Report();
+
+class Profiler {
+public:
+  Profiler() : shards_{new Shard[kShards]} {}
+  ~Profiler() {
+    Report();
+    delete[] shards_;
+  }
+  Profiler(const Profiler&) = delete;
+  Profiler& operator=(const Profiler&) = delete;
+
+  Shard& ShardForThisThread() {
+    thread_local std::size_t shard = next_shard_.fetch_add(1, std::memory_order_relaxed) % kShards;
+    return shards_[shard];
+  }
+
+  Shard* begin() { return shards_; }
+  Shard* end() { return shards_ + kShards; }
+
+  std::atomic<bool> enabled{true};
+  std::atomic<std::uint64_t> dropped{0};
+
+private:
+  Shard* shards_;
+  std::atomic<std::size_t> next_shard_{0};
+};
+
+inline Profiler& GetProfiler() {
+  static Profiler profiler;
+  return profiler;
+}
+
+inline void SetEnabled(bool enabled) {
+  GetProfiler().enabled.store(enabled, std::memory_order_relaxed);
+}
+
+inline std::uint64_t HashSite(const CallSite& site) {
+  // FNV-1a over the frame addresses, 0 is reserved for empty slots
+  std::uint64_t hash = 14695981039346656037ull;
+  for (void* frame : site.frames) {
+    hash ^= reinterpret_cast<std::uintptr_t>(frame);
+    hash *= 1099511628211ull;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+/*
+ * Open addressing with linear probing. A slot is claimed by swapping its key
+ * from 0, so no lock is ever taken. The call site itself is written after the
+ * claim, which is fine since it is only read by Report() at exit.
+ */
+inline void Insert(Shard& shard, const CallSite& site, std::size_t bytes) {
+  const std::uint64_t key = HashSite(site);
+  for (std::size_t probe = 0; probe < kSlotsPerShard; ++probe) {
+    Slot& slot = shard.slots[(key + probe) % kSlotsPerShard];
+    std::uint64_t current = slot.key.load(std::memory_order_acquire);
+    if (current == 0) {
+      if (slot.key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+        slot.site = site;
+        current = key;
+      }
+    }
+    if (current == key) {
+      slot.count.fetch_add(1, std::memory_order_relaxed);
+      slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+      return;
+    }
+  }
+  GetProfiler().dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+__attribute__((noinline)) inline void Record(void* return_address, std::size_t bytes) {
+  Profiler& profiler = GetProfiler();
+  if (!profiler.enabled.load(std::memory_order_relaxed)) {
+    return;
+  }
+  CallSite site{};
+  if constexpr (kDepth == 1) {
+    site.frames[0] = return_address;
+  } else {
+    // Skips Record() and the copy operation itself
+    void* frames[kDepth + 2] = {};
+    int captured = backtrace(frames, kDepth + 2);
+    for (int idx = 2; idx < captured; ++idx) {
+      site.frames[idx - 2] = frames[idx];
+    }
+  }
+  Insert(profiler.ShardForThisThread(), site, bytes);
+}
+
+inline std::string Symbolize(void* address) {
+  char buffer[512];
+  Dl_info info;
+  if (dladdr(address, &info) == 0 || info.dli_fname == nullptr) {
+    snprintf(buffer, sizeof(buffer), "%p", address);
+    return buffer;
+  }
+
+  std::string function = "??";
+  if (info.dli_sname != nullptr) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    function = status == 0 ? demangled : info.dli_sname;
+    std::free(demangled);
+  }
+
+  // Return addresses point after the call, step back into the call instruction
+  std::uintptr_t offset = reinterpret_cast<std::uintptr_t>(address) -
+                          reinterpret_cast<std::uintptr_t>(info.dli_fbase) - 1;
+  std::string location;
+  snprintf(buffer, sizeof(buffer), "addr2line -e '%s' 0x%zx 2>/dev/null", info.dli_fname, (std::size_t)offset);
+  if (FILE* pipe = popen(buffer, "r")) {
+    if (fgets(buffer, sizeof(buffer), pipe) != nullptr && buffer[0] != '?') {
+      location = buffer;
+      location.erase(location.find_last_not_of('\n') + 1);
+    }
+    pclose(pipe);
+  }
+  if (location.empty()) {
+    snprintf(buffer, sizeof(buffer), "%s+0x%zx", info.dli_fname, (std::size_t)offset);
+    location = buffer;
+  }
+  return function + " at " + location;
+}
+
+inline void PrintTop(std::vector<Totals>& totals, const char* title, std::uint64_t Totals::*key) {
+  std::sort(totals.begin(), totals.end(),
+    [key](const Totals& lhs, const Totals& rhs) { return lhs.*key > rhs.*key; });
+  fprintf(stderr, "Top copy call sites by %s\n", title);
+  for (std::size_t idx = 0; idx < totals.size() && idx < kTopSites; ++idx) {
+    fprintf(stderr, "%10llu copies %12llu bytes  %s\n",
+      (unsigned long long)totals[idx].count, (unsigned long long)totals[idx].bytes,
+      Symbolize(totals[idx].site.frames[0]).c_str());
+    for (int frame = 1; frame < kDepth && totals[idx].site.frames[frame] != nullptr; ++frame) {
+      fprintf(stderr, "%*s%s\n", 38, "", Symbolize(totals[idx].site.frames[frame]).c_str());
+    }
+  }
+}
+
+/*
+ * Merges the shards, since threads on different shards can record the same
+ * call site, and prints the top call sites to stderr.
+ */
+inline void Report() {
+  std::vector<Totals> totals;
+  std::vector<std::uint64_t> keys;
+  for (Shard& shard : GetProfiler()) {
+    for (Slot& slot : shard.slots) {
+      std::uint64_t key = slot.key.load(std::memory_order_acquire);
+      if (key == 0) {
+        continue;
+      }
+      auto it = std::find(keys.begin(), keys.end(), key);
+      if (it == keys.end()) {
+        keys.push_back(key);
+        totals.push_back(Totals{slot.site, 0, 0});
+        it = keys.end() - 1;
+      }
+      Totals& site_totals = totals[static_cast<std::size_t>(it - keys.begin())];
+      site_totals.count += slot.count.load(std::memory_order_relaxed);
+      site_totals.bytes += slot.bytes.load(std::memory_order_relaxed);
+    }
+  }
+  fprintf(stderr, "\n%zu copy call sites, %llu copies dropped on full shards\n",
+    totals.size(), (unsigned long long)GetProfiler().dropped.load());
+  PrintTop(totals, "count", &Totals::count);
+  PrintTop(totals, "bytes", &Totals::bytes);
+}
+
+}  // namespace copy_profiler
+
+#else
+
+#define COPY_PROFILED
+#define PROFILE_COPY(bytes) ((void)0)
+
+#endif
+
+#endif
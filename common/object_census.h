@@ -0,0 +1,182 @@
+#ifndef COMMON_OBJECT_CENSUS_H_
+#define COMMON_OBJECT_CENSUS_H_
+
+/*
+ * Live-object census
+ *
+ * Deriving from Census<T> makes every constructor and destructor of T update
+ * T's counters: objects alive now and the most that were ever alive at once.
+ * Peak bytes are the peak count times sizeof(T), memory the object owns
+ * through pointers is not included.
+ *
+ *   class Person : public Census<Person> { ... };
+ *
+ * Counters are relaxed atomics, so a constructor and a destructor pay one
+ * atomic add each, plus a compare-and-swap when a constructor sets a new
+ * peak. Types register themselves on their first construction.
+ *
+ * PrintCensus() writes a table of all registered types. The first registration
+ * also schedules it at exit, and InstallCensusSignal(SIGUSR1) prints it when
+ * the process gets that signal. The signal path only uses write() and data
+ * prepared at registration, so it is async-signal-safe.
+ *
+ */
+
+#include <cxxabi.h>
+#include <signal.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <typeinfo>
+
+struct CensusCounters {
+  std::atomic<std::int64_t> live{0};
+  std::atomic<std::int64_t> peak{0};
+  std::size_t object_size = 0;
+  const char* type_name = nullptr;
+  CensusCounters* next = nullptr;
+};
+
+namespace census_detail {
+
+inline std::atomic<CensusCounters*> registry{nullptr};
+
+/*
+ * Formats without allocating or locking, for use from a signal handler.
+ */
+class LineWriter {
+public:
+  void Append(const char* text) {
+    while (*text != '\0' && size_ < sizeof(buffer_)) {
+      buffer_[size_++] = *text++;
+    }
+  }
+
+  void AppendPadded(const char* text, std::size_t width) {
+    std::size_t length = std::strlen(text);
+    Append(text);
+    for (; length < width; ++length) {
+      Append(" ");
+    }
+  }
+
+  void AppendNumber(std::uint64_t value, std::size_t width) {
+    char digits[24];
+    std::size_t count = 0;
+    do {
+      digits[count++] = static_cast<char>('0' + value % 10);
+      value /= 10;
+    } while (value != 0);
+    for (std::size_t pad = count; pad < width; ++pad) {
+      Append(" ");
+    }
+    while (count > 0 && size_ < sizeof(buffer_)) {
+      buffer_[size_++] = digits[--count];
+    }
+  }
+
+  void Flush(int fd) {
+    std::size_t written = 0;
+    while (written < size_) {
+      ssize_t result = write(fd, buffer_ + written, size_ - written);
+      if (result <= 0) {
+        break;
+      }
+      written += static_cast<std::size_t>(result);
+    }
+    size_ = 0;
+  }
+
+private:
+  char buffer_[256];
+  std::size_t size_ = 0;
+};
+
+inline void PrintTo(int fd) {
+  LineWriter line;
+  line.Append("\n");
+  line.AppendPadded("type", 40);
+  line.Append("        live        peak  peak bytes\n");
+  line.Flush(fd);
+  for (CensusCounters* counters = registry.load(std::memory_order_acquire);
+       counters != nullptr; counters = counters->next) {
+    std::int64_t live = counters->live.load(std::memory_order_relaxed);
+    std::int64_t peak = counters->peak.load(std::memory_order_relaxed);
+    line.AppendPadded(counters->type_name, 40);
+    line.AppendNumber(static_cast<std::uint64_t>(live < 0 ? 0 : live), 12);
+    line.AppendNumber(static_cast<std::uint64_t>(peak), 12);
+    line.AppendNumber(static_cast<std::uint64_t>(peak) * counters->object_size, 12);
+    line.Append("\n");
+    line.Flush(fd);
+  }
+}
+
+inline void PrintAtExit() { PrintTo(STDERR_FILENO); }
+
+inline void OnSignal(int) { PrintTo(STDERR_FILENO); }
+
+template<typename T>
+CensusCounters* Register() {
+  // Never freed, the report may run during static destruction
+  CensusCounters* counters = new CensusCounters;
+  counters->object_size = sizeof(T);
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(typeid(T).name(), nullptr, nullptr, &status);
+  counters->type_name = status == 0 ? demangled : typeid(T).name();
+
+  CensusCounters* head = registry.load(std::memory_order_relaxed);
+  do {
+    counters->next = head;
+  } while (!registry.compare_exchange_weak(head, counters, std::memory_order_release, std::memory_order_relaxed));
+  if (head == nullptr) {
+    std::atexit(PrintAtExit);
+  }
+  return counters;
+}
+
+}  // namespace census_detail
+
+template<typename Derived>
+class Census {
+public:
+  static const CensusCounters& Counters() { return GetCounters(); }
+
+protected:
+  Census() noexcept { OnCreate(); }
+  Census(const Census&) noexcept { OnCreate(); }
+  Census(Census&&) noexcept { OnCreate(); }
+  // Assignment does not change how many objects exist
+  Census& operator=(const Census&) = default;
+  Census& operator=(Census&&) = default;
+  ~Census() { GetCounters().live.fetch_sub(1, std::memory_order_relaxed); }
+
+private:
+  static CensusCounters& GetCounters() {
+    static CensusCounters* counters = census_detail::Register<Derived>();
+    return *counters;
+  }
+
+  static void OnCreate() {
+    CensusCounters& counters = GetCounters();
+    std::int64_t live = counters.live.fetch_add(1, std::memory_order_relaxed) + 1;
+    std::int64_t peak = counters.peak.load(std::memory_order_relaxed);
+    while (live > peak && !counters.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+  }
+};
+
+inline void PrintCensus() {
+  census_detail::PrintTo(STDERR_FILENO);
+}
+
+inline void InstallCensusSignal(int signal_number) {
+  struct sigaction action{};
+  action.sa_handler = census_detail::OnSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(signal_number, &action, nullptr);
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef COMMON_TIMER_H_
+#define COMMON_TIMER_H_
+
+#include <stdio.h>
+#include <chrono>
+#include <utility>
+
+/*
+ * Keeps the compiler from optimizing away a value that a benchmark loop
+ * computes but never uses otherwise.
+ */
+template<typename T>
+inline void DoNotOptimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/*
+ * Runs `func` once and returns the elapsed wall-clock time in milliseconds.
+ */
+template<typename Func>
+double MeasureMs(Func&& func) {
+  auto start = std::chrono::steady_clock::now();
+  std::forward<Func>(func)();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+/*
+ * Runs `func` `repeats` times and returns the fastest run in milliseconds,
+ * which filters out page faults and other one-off noise of the first run.
+ */
+template<typename Func>
+double MeasureBestMs(int repeats, Func&& func) {
+  double best = MeasureMs(func);
+  for (int run = 1; run < repeats; ++run) {
+    double elapsed = MeasureMs(func);
+    best = elapsed < best ? elapsed : best;
+  }
+  return best;
+}
+
+#define LOG_BENCH(label, ms, ops) \
+  printf("%-*s => %10.2f ms %10.2f Mops/s\n", 50, label, ms, (ops) / ((ms) * 1000.0))
+
+#endif
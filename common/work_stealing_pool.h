@@ -0,0 +1,130 @@
+#ifndef COMMON_WORK_STEALING_POOL_H_
+#define COMMON_WORK_STEALING_POOL_H_
+
+/*
+ * Work-stealing pool for fork-join style tasks
+ *
+ * Every worker has its own deque of tasks. It pushes the tasks it spawns and
+ * pops its next one at the back, so it keeps working on the data it just
+ * touched. A worker whose deque is empty steals from the front of another
+ * worker's deque, which is where the oldest, usually largest, tasks are.
+ *
+ * Run() starts the workers, the calling thread being worker 0, and returns
+ * when every task, including the ones spawned on the way, has finished.
+ * Tasks must not throw, an algorithm that may fail catches in its task and
+ * reports after Run() returns.
+ *
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+ * Runs tasks on a fixed number of threads. A task may spawn more tasks, Run()
+ * returns once every task has finished.
+ */
+template<typename Task>
+class WorkStealingPool {
+public:
+  class Spawner {
+  public:
+    void Spawn(Task task) { pool_.Push(self_, std::move(task)); }
+  private:
+    friend class WorkStealingPool;
+    Spawner(WorkStealingPool& pool, unsigned self) : pool_{pool}, self_{self} {}
+    WorkStealingPool& pool_;
+    unsigned self_;
+  };
+
+  explicit WorkStealingPool(unsigned workers) : workers_{workers == 0 ? 1 : workers} {}
+
+  unsigned Workers() const { return workers_; }
+  std::size_t Steals() const { return steals_.load(std::memory_order_relaxed); }
+
+  // Calls process(task, spawner) for the initial tasks and everything they spawn
+  template<typename Process>
+  void Run(std::vector<Task> tasks, Process process) {
+    queues_.clear();
+    for (unsigned idx = 0; idx < workers_; ++idx) {
+      queues_.push_back(std::make_unique<Queue>());
+    }
+    pending_.store(tasks.size(), std::memory_order_relaxed);
+    for (std::size_t idx = 0; idx < tasks.size(); ++idx) {
+      queues_[idx % workers_]->tasks.push_back(std::move(tasks[idx]));
+    }
+
+    std::vector<std::thread> threads;
+    for (unsigned self = 1; self < workers_; ++self) {
+      threads.emplace_back([this, self, &process] { Work(self, process); });
+    }
+    Work(0, process);
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void Push(unsigned self, Task task) {
+    // Counted before the parent finishes, so pending_ cannot reach 0 early
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock{queues_[self]->mutex};
+    queues_[self]->tasks.push_back(std::move(task));
+  }
+
+  bool PopLocal(unsigned self, Task& task) {
+    Queue& queue = *queues_[self];
+    std::lock_guard<std::mutex> lock{queue.mutex};
+    if (queue.tasks.empty()) {
+      return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    return true;
+  }
+
+  bool Steal(unsigned self, Task& task) {
+    for (unsigned offset = 1; offset < workers_; ++offset) {
+      Queue& queue = *queues_[(self + offset) % workers_];
+      std::lock_guard<std::mutex> lock{queue.mutex};
+      if (!queue.tasks.empty()) {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        steals_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template<typename Process>
+  void Work(unsigned self, Process& process) {
+    Spawner spawner{*this, self};
+    Task task;
+    while (pending_.load(std::memory_order_acquire) != 0) {
+      if (PopLocal(self, task) || Steal(self, task)) {
+        process(task, spawner);
+        pending_.fetch_sub(1, std::memory_order_release);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  unsigned workers_;
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::atomic<std::size_t> pending_{0};
+  std::atomic<std::size_t> steals_{0};
+};
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * A compile-time catalogue of persons with a perfect hash
+ *
+ * The examples spell out names like "Arthur Dayne" and "Jaime Lannister" and
+ * build PersonTraits from them at run time. A fixed catalogue of such records
+ * is usually loaded into a std::unordered_map when the program starts, which
+ * costs one allocation per name and per node before the first lookup.
+ *
+ * Here the whole catalogue is a constexpr object:
+ *
+ *  - kNameChars holds every name back to back, and each PersonRecord is an id
+ *    plus a string_view into it.
+ *  - PersonCatalogue builds a minimal perfect hash over the names while the
+ *    compiler evaluates it ("hash and displace"): names are hashed once, the
+ *    hash picks one of N / 2 buckets, and every bucket gets a seed such that mixing the
+ *    hash with it sends each name of the bucket to its own slot. Buckets are
+ *    placed largest first, when most slots are still free.
+ *  - Records are stored in slot order, so a lookup is one hash of the name,
+ *    one seed load, one record load and one compare. There is no probing and
+ *    no chain to follow.
+ *
+ * The result lives in read-only data of the executable, nothing runs at
+ * startup. FindId() is constexpr too, so lookups of names known at compile
+ * time are checked with static_assert. The price is paid by the compiler:
+ * the 1600 names here take a few seconds to place, a much larger catalogue
+ * needs -fconstexpr-ops-limit raised.
+ *
+ * The benchmark times building a std::unordered_map from the same records,
+ * which is the startup cost that goes away, and compares lookups of both.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o person_catalogue.out person_catalogue.cc
+ *
+ */
+
+#include <stdio.h>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "../common/timer.h"
+
+constexpr std::string_view kFirstNames[] = {
+  "Arthur", "Jaime", "Barristan", "Meryn", "Loras", "Boros", "Mandon", "Preston", "Arys", "Balon",
+  "Osmund", "Gerold", "Oswell", "Jonothor", "Lewyn", "Harlan", "Ryam", "Duncan", "Aemon", "Criston",
+  "Erryk", "Arryk", "Gwayne", "Lorent", "Lyonel", "Robert", "Eddard", "Brandon", "Benjen", "Catelyn",
+  "Cersei", "Tyrion", "Sansa", "Arya", "Jon", "Robb", "Bran", "Rickon", "Daenerys", "Viserys"};
+
+constexpr std::string_view kHouses[] = {
+  "Dayne", "Lannister", "Selmy", "Trant", "Tyrell", "Blount", "Moore", "Swann", "Oakheart", "Greyjoy",
+  "Kettleblack", "Hightower", "Whent", "Darry", "Martell", "Grandison", "Redwyne", "Cole", "Targaryen", "Cargyll",
+  "Baratheon", "Stark", "Tully", "Arryn", "Frey", "Bolton", "Mormont", "Karstark", "Umber", "Manderly",
+  "Reed", "Florent", "Tarly", "Estermont", "Velaryon", "Celtigar", "Massey", "Royce", "Corbray", "Waynwood"};
+
+constexpr std::size_t kPersonCount = std::size(kFirstNames) * std::size(kHouses);
+
+// Every name is "<first name> <house>"
+constexpr std::size_t NameCharsSize() {
+  std::size_t size = 0;
+  for (std::string_view first : kFirstNames) {
+    for (std::string_view house : kHouses) {
+      size += first.size() + 1 + house.size();
+    }
+  }
+  return size;
+}
+
+constexpr std::array<char, NameCharsSize()> MakeNameChars() {
+  std::array<char, NameCharsSize()> chars{};
+  std::size_t pos = 0;
+  for (std::string_view first : kFirstNames) {
+    for (std::string_view house : kHouses) {
+      for (char letter : first) {
+        chars[pos++] = letter;
+      }
+      chars[pos++] = ' ';
+      for (char letter : house) {
+        chars[pos++] = letter;
+      }
+    }
+  }
+  return chars;
+}
+
+inline constexpr std::array<char, NameCharsSize()> kNameChars = MakeNameChars();
+
+// The id and name of PersonTraits, with the name pointing into kNameChars
+struct PersonRecord {
+  int id;
+  std::string_view name;
+};
+
+constexpr std::array<PersonRecord, kPersonCount> MakeRecords() {
+  std::array<PersonRecord, kPersonCount> records{};
+  std::size_t pos = 0;
+  std::size_t idx = 0;
+  for (std::string_view first : kFirstNames) {
+    for (std::string_view house : kHouses) {
+      std::size_t size = first.size() + 1 + house.size();
+      records[idx] = PersonRecord{static_cast<int>(idx + 1), std::string_view{kNameChars.data() + pos, size}};
+      pos += size;
+      ++idx;
+    }
+  }
+  return records;
+}
+
+// FNV-1a
+constexpr std::uint64_t HashName(std::string_view name) {
+  std::uint64_t hash = 14695981039346656037ull;
+  for (char letter : name) {
+    hash ^= static_cast<unsigned char>(letter);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// splitmix64 finalizer, spreads the seed over all bits of the hash
+constexpr std::uint64_t Mix(std::uint64_t hash, std::uint32_t seed) {
+  hash ^= seed * 0x9E3779B97F4A7C15ull;
+  hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+  hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+  return hash ^ (hash >> 31);
+}
+
+template<std::size_t N>
+class PersonCatalogue {
+public:
+  static constexpr std::size_t kBuckets = (N + 1) / 2;
+
+  constexpr explicit PersonCatalogue(const std::array<PersonRecord, N>& records) : seeds_{}, slots_{} {
+    std::array<std::uint64_t, N> hashes{};
+    for (std::size_t idx = 0; idx < N; ++idx) {
+      hashes[idx] = HashName(records[idx].name);
+    }
+
+    // Group the record indices by bucket (counting sort)
+    std::array<std::size_t, kBuckets + 1> bucket_begin{};
+    for (std::size_t idx = 0; idx < N; ++idx) {
+      ++bucket_begin[hashes[idx] % kBuckets + 1];
+    }
+    std::size_t largest = 0;
+    for (std::size_t bucket = 0; bucket < kBuckets; ++bucket) {
+      largest = bucket_begin[bucket + 1] > largest ? bucket_begin[bucket + 1] : largest;
+      bucket_begin[bucket + 1] += bucket_begin[bucket];
+    }
+    std::array<std::size_t, N> by_bucket{};
+    std::array<std::size_t, kBuckets> fill{};
+    for (std::size_t idx = 0; idx < N; ++idx) {
+      std::size_t bucket = hashes[idx] % kBuckets;
+      by_bucket[bucket_begin[bucket] + fill[bucket]++] = idx;
+    }
+    if (largest > kMaxBucket) {
+      throw std::logic_error{"perfect hash bucket too large"};
+    }
+
+    std::array<bool, N> taken{};
+    for (std::size_t size = largest; size > 0; --size) {
+      for (std::size_t bucket = 0; bucket < kBuckets; ++bucket) {
+        if (bucket_begin[bucket + 1] - bucket_begin[bucket] == size) {
+          PlaceBucket(bucket, records, hashes, by_bucket, bucket_begin, taken);
+        }
+      }
+    }
+  }
+
+  constexpr const PersonRecord* Find(std::string_view name) const {
+    std::uint64_t hash = HashName(name);
+    const PersonRecord& record = slots_[Mix(hash, seeds_[hash % kBuckets]) % N];
+    return record.name == name ? &record : nullptr;
+  }
+
+  // 0 for names that are not in the catalogue
+  constexpr int FindId(std::string_view name) const {
+    const PersonRecord* record = Find(name);
+    return record != nullptr ? record->id : 0;
+  }
+
+  constexpr std::size_t Size() const { return N; }
+
+  // Seeds tried until a bucket fits, a compile error when no seed works
+  static constexpr std::uint32_t kMaxSeed = 1u << 16;
+  static constexpr std::size_t kMaxBucket = 16;
+
+private:
+  constexpr void PlaceBucket(std::size_t bucket, const std::array<PersonRecord, N>& records,
+                             const std::array<std::uint64_t, N>& hashes, const std::array<std::size_t, N>& by_bucket,
+                             const std::array<std::size_t, kBuckets + 1>& bucket_begin, std::array<bool, N>& taken) {
+    for (std::uint32_t seed = 1; seed < kMaxSeed; ++seed) {
+      std::array<std::size_t, kMaxBucket> slots{};
+      std::size_t placed = 0;
+      for (std::size_t pos = bucket_begin[bucket]; pos < bucket_begin[bucket + 1]; ++pos) {
+        std::size_t slot = Mix(hashes[by_bucket[pos]], seed) % N;
+        bool free = !taken[slot];
+        for (std::size_t other = 0; other < placed; ++other) {
+          free = free && slots[other] != slot;
+        }
+        if (!free) {
+          break;
+        }
+        slots[placed++] = slot;
+      }
+      if (placed == bucket_begin[bucket + 1] - bucket_begin[bucket]) {
+        seeds_[bucket] = seed;
+        for (std::size_t idx = 0; idx < placed; ++idx) {
+          taken[slots[idx]] = true;
+          slots_[slots[idx]] = records[by_bucket[bucket_begin[bucket] + idx]];
+        }
+        return;
+      }
+    }
+    throw std::logic_error{"no perfect hash seed found"};
+  }
+
+  std::array<std::uint32_t, kBuckets> seeds_;
+  std::array<PersonRecord, N> slots_;
+};
+
+inline constexpr std::array<PersonRecord, kPersonCount> kRecords = MakeRecords();
+inline constexpr PersonCatalogue<kPersonCount> kCatalogue{kRecords};
+
+static_assert(kCatalogue.FindId("Arthur Dayne") == 1);
+static_assert(kCatalogue.FindId("Jaime Lannister") == 42);
+static_assert(kCatalogue.FindId("Hodor") == 0);
+
+void ShowCatalogue() {
+  for (const char* name : {"Arthur Dayne", "Jaime Lannister", "Daenerys Targaryen", "Barristan Selmy", "Hodor"}) {
+    printf("%-*s => %d\n", 50, name, kCatalogue.FindId(name));
+  }
+  printf("%-*s => %zu\n", 50, "Persons in the catalogue", kCatalogue.Size());
+  printf("%-*s => %zu\n", 50, "Buckets", kCatalogue.kBuckets);
+  printf("%-*s => %zu bytes\n\n", 50, "Catalogue and names in read-only data", sizeof(kCatalogue) + sizeof(kNameChars));
+}
+
+std::unordered_map<std::string, int> BuildMap() {
+  std::unordered_map<std::string, int> map;
+  for (const PersonRecord& record : kRecords) {
+    map.emplace(std::string{record.name}, record.id);
+  }
+  return map;
+}
+
+void BenchmarkLookup(std::size_t count) {
+  std::unordered_map<std::string, int> map;
+  double build_ms = MeasureMs([&] { map = BuildMap(); });
+
+  // A quarter of the queries are names that are not in the catalogue
+  std::vector<std::string> queries;
+  std::mt19937 gen{42};
+  std::uniform_int_distribution<std::size_t> record_dist{0, kRecords.size() - 1};
+  for (std::size_t idx = 0; idx < 4096; ++idx) {
+    std::string name{kRecords[record_dist(gen)].name};
+    if (idx % 4 == 3) {
+      name += " the Younger";
+    }
+    queries.push_back(name);
+  }
+  std::vector<std::string_view> query_views(queries.begin(), queries.end());
+
+  long long map_total = 0;
+  double map_ms = MeasureBestMs(3, [&] {
+    map_total = 0;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      auto found = map.find(queries[idx % queries.size()]);
+      map_total += found != map.end() ? found->second : 0;
+    }
+    DoNotOptimize(map_total);
+  });
+
+  long long catalogue_total = 0;
+  double catalogue_ms = MeasureBestMs(3, [&] {
+    catalogue_total = 0;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      catalogue_total += kCatalogue.FindId(query_views[idx % query_views.size()]);
+    }
+    DoNotOptimize(catalogue_total);
+  });
+
+  if (map_total != catalogue_total) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu persons, %zu lookups\n", kRecords.size(), count);
+  LOG_BENCH("build std::unordered_map at startup", build_ms, kRecords.size());
+  LOG_BENCH("std::unordered_map::find", map_ms, count);
+  LOG_BENCH("constexpr perfect hash", catalogue_ms, count);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+  ShowCatalogue();
+  BenchmarkLookup(count);
+}
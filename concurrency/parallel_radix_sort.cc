@@ -0,0 +1,361 @@
+/*
+ * Parallel MSD radix sort and batched lookup of persons by name
+ *
+ * Sorting persons by name with std::sort compares whole names over and over:
+ * every strcmp starts again at the first character, even when all the names
+ * in the range are known to share their first few bytes. An MSD (most
+ * significant digit) radix sort looks at every byte of a name once per level:
+ *
+ *  - Count how many names have each value at byte `depth`, which gives the
+ *    position of 256 buckets.
+ *  - Permute the persons in place into their buckets (American flag sort).
+ *    Persons are only swapped, so each step is three moves of a pointer and no
+ *    name is ever copied.
+ *  - Sort every bucket at `depth + 1`. Bucket 0 holds the names that end at
+ *    `depth`, they are all equal and are done. Small ranges go to std::sort
+ *    with a comparator that skips the `depth` bytes known to be equal.
+ *
+ * The buckets are independent, so every bucket larger than kSpawnSize becomes
+ * a task of WorkStealingPool from common/work_stealing_pool.h. Each worker has
+ * its own deque, takes its newest task from the back and, when it runs dry,
+ * steals the oldest task from another worker's front. Old tasks are the large
+ * buckets of the upper levels, so one steal moves a lot of work. The first
+ * pass over the whole input is sequential, the 256 buckets it produces are
+ * what the workers share.
+ *
+ * FindAll() looks up a batch of names in the sorted persons. The batch is cut
+ * into chunks that are searched by the same pool. A chunk is put in name order
+ * first, so each search gallops forward from where the previous one ended and
+ * the searches walk the persons front to back instead of jumping at random.
+ *
+ * The benchmark sorts the same persons with std::sort, with
+ * std::sort(std::execution::par) and with ParallelRadixSort. libstdc++ runs
+ * the parallel algorithms on TBB, so it needs -ltbb. Without the TBB headers
+ * installed it compiles them to the sequential version.
+ *
+ * Usage: parallel_radix_sort.out [persons] [threads]
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -pthread -o parallel_radix_sort.out parallel_radix_sort.cc -ltbb
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <execution>
+#include <functional>
+#include <iterator>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+#include "../common/work_stealing_pool.h"
+
+/*
+ * The Person of move_semantics.cc without the prints.
+ */
+class Person{
+
+public:
+  Person(const char* name) : name_{new char[strlen(name) + 1]} {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+
+  ~Person(){
+    delete [] name_;
+  }
+
+  Person(const Person& rhs) : Person(rhs.name_) {}
+
+  Person& operator=(const Person& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = new char[name_size];
+    memcpy(new_name, rhs.name_, name_size);
+    delete [] name_;
+    name_ = new_name;
+    return *this;
+  }
+
+  Person(Person&& rhs) noexcept : name_{rhs.name_} {
+    rhs.name_ = nullptr;
+  }
+
+  Person& operator=(Person&& rhs) noexcept {
+    if (this != &rhs){
+      delete [] name_;
+      name_ = rhs.name_;
+      rhs.name_ = nullptr;
+    }
+    return *this;
+  }
+
+  const char* GetName() const {
+    return name_;
+  }
+
+private:
+  char* name_;
+};
+
+// Persons in [begin, end) share their first `depth` name bytes
+struct SortTask {
+  Person* begin = nullptr;
+  Person* end = nullptr;
+  std::size_t depth = 0;
+};
+
+constexpr std::size_t kSmallSort = 64;
+constexpr std::size_t kSpawnSize = 16 * 1024;
+
+inline unsigned char NameByte(const Person& person, std::size_t depth) {
+  return static_cast<unsigned char>(person.GetName()[depth]);
+}
+
+void RadixSortTask(SortTask task, WorkStealingPool<SortTask>::Spawner& spawner) {
+  std::size_t size = static_cast<std::size_t>(task.end - task.begin);
+  if (size < kSmallSort) {
+    std::size_t depth = task.depth;
+    std::sort(task.begin, task.end, [depth](const Person& lhs, const Person& rhs) {
+      return strcmp(lhs.GetName() + depth, rhs.GetName() + depth) < 0;
+    });
+    return;
+  }
+
+  // The bytes are read once into key_cache, the permutation swaps them along
+  // with the persons instead of following every name pointer again
+  thread_local std::vector<unsigned char> key_cache;
+  key_cache.resize(size);
+  unsigned char* keys = key_cache.data();
+  std::size_t counts[256] = {};
+  for (std::size_t idx = 0; idx < size; ++idx) {
+    keys[idx] = NameByte(task.begin[idx], task.depth);
+    ++counts[keys[idx]];
+  }
+
+  // A byte all names share, like the "Ser " in front of every knight
+  if (counts[keys[0]] == size) {
+    if (keys[0] != 0) {
+      RadixSortTask(SortTask{task.begin, task.end, task.depth + 1}, spawner);
+    }
+    return;
+  }
+
+  // American flag sort: heads[b] is the next unsorted slot of bucket b
+  std::size_t heads[256];
+  std::size_t tails[256];
+  std::size_t offset = 0;
+  for (int bucket = 0; bucket < 256; ++bucket) {
+    heads[bucket] = offset;
+    offset += counts[bucket];
+    tails[bucket] = offset;
+  }
+  for (int bucket = 0; bucket < 256; ++bucket) {
+    while (heads[bucket] < tails[bucket]) {
+      std::size_t slot = heads[bucket];
+      unsigned char value = keys[slot];
+      if (value == bucket) {
+        ++heads[bucket];
+      } else {
+        std::size_t target = heads[value]++;
+        std::swap(task.begin[slot], task.begin[target]);
+        std::swap(keys[slot], keys[target]);
+      }
+    }
+  }
+
+  // Bucket 0 holds the names that end here, they are equal
+  offset = counts[0];
+  for (int bucket = 1; bucket < 256; ++bucket) {
+    SortTask child{task.begin + offset, task.begin + offset + counts[bucket], task.depth + 1};
+    offset += counts[bucket];
+    if (counts[bucket] > kSpawnSize) {
+      spawner.Spawn(child);
+    } else if (counts[bucket] > 1) {
+      RadixSortTask(child, spawner);
+    }
+  }
+}
+
+void ParallelRadixSort(WorkStealingPool<SortTask>& pool, std::vector<Person>& persons) {
+  pool.Run({SortTask{persons.data(), persons.data() + persons.size(), 0}}, RadixSortTask);
+}
+
+struct LookupTask {
+  std::size_t first = 0;
+  std::size_t last = 0;
+};
+
+constexpr std::size_t kLookupChunk = 64 * 1024;
+
+/*
+ * Index of every query in the sorted persons, or -1 when the name is missing.
+ */
+std::vector<std::ptrdiff_t> FindAll(WorkStealingPool<LookupTask>& pool, const std::vector<Person>& sorted,
+                                    const std::vector<const char*>& queries) {
+  std::vector<std::ptrdiff_t> result(queries.size());
+  std::vector<LookupTask> tasks;
+  for (std::size_t first = 0; first < queries.size(); first += kLookupChunk) {
+    tasks.push_back({first, std::min(first + kLookupChunk, queries.size())});
+  }
+  pool.Run(std::move(tasks), [&](LookupTask task, WorkStealingPool<LookupTask>::Spawner&) {
+    // In name order every search starts where the previous one ended
+    std::vector<std::size_t> order;
+    for (std::size_t idx = task.first; idx < task.last; ++idx) {
+      order.push_back(idx);
+    }
+    std::sort(order.begin(), order.end(), [&](std::size_t lhs, std::size_t rhs) {
+      return strcmp(queries[lhs], queries[rhs]) < 0;
+    });
+    auto before = [](const Person& person, const char* key) { return strcmp(person.GetName(), key) < 0; };
+    auto from = sorted.begin();
+    for (std::size_t idx : order) {
+      const char* name = queries[idx];
+      // Gallop ahead from the previous result, then binary search the last step
+      std::ptrdiff_t step = 1;
+      std::ptrdiff_t left = sorted.end() - from;
+      while (step < left && before(from[step], name)) {
+        step *= 2;
+      }
+      auto last = step < left ? from + step + 1 : sorted.end();
+      from = std::lower_bound(from + step / 2, last, name, before);
+      result[idx] = from != sorted.end() && strcmp(from->GetName(), name) == 0 ? from - sorted.begin() : -1;
+    }
+  });
+  return result;
+}
+
+bool ByName(const Person& lhs, const Person& rhs) {
+  return strcmp(lhs.GetName(), rhs.GetName()) < 0;
+}
+
+void ShowRadixSort() {
+  std::vector<Person> persons;
+  for (const char* name : {"Meryn Trant", "Arthur Dayne", "Arryk Cargyll", "Arthur", "Barristan Selmy",
+                           "Meryn Trant", "Erryk Cargyll"}) {
+    persons.emplace_back(name);
+  }
+  WorkStealingPool<SortTask> pool{2};
+  ParallelRadixSort(pool, persons);
+  for (const Person& person : persons) {
+    printf("%-*s => %s\n", 50, "Sorted person", person.GetName());
+  }
+
+  WorkStealingPool<LookupTask> lookup_pool{2};
+  std::vector<const char*> queries{"Arthur Dayne", "Jaime Lannister"};
+  std::vector<std::ptrdiff_t> found = FindAll(lookup_pool, persons, queries);
+  for (std::size_t idx = 0; idx < queries.size(); ++idx) {
+    printf("%-*s => %td\n", 50, queries[idx], found[idx]);
+  }
+  printf("\n");
+}
+
+std::string MakeName(std::mt19937& gen) {
+  static const char* first_names[] = {"Arthur", "Meryn", "Barristan", "Jaime", "Arryk", "Erryk", "Loras",
+                                      "Boros", "Mandon", "Preston", "Balon", "Osmund", "Gerold", "Oswell"};
+  static const char* houses[] = {"Dayne", "Trant", "Selmy", "Lannister", "Cargyll", "Tyrell", "Blount",
+                                 "Moore", "Greenfield", "Swann", "Kettleblack", "Hightower", "Whent"};
+  std::uniform_int_distribution<std::size_t> first_dist{0, std::size(first_names) - 1};
+  std::uniform_int_distribution<std::size_t> house_dist{0, std::size(houses) - 1};
+  std::uniform_int_distribution<unsigned> number_dist{0, 9'999'999};
+  std::string name = std::string{"Ser "} + first_names[first_dist(gen)] + " " + houses[house_dist(gen)];
+  name += " " + std::to_string(number_dist(gen));
+  return name;
+}
+
+// Order independent, so it tells whether a sort lost or duplicated a name
+std::size_t NameChecksum(const std::vector<Person>& persons) {
+  std::size_t checksum = 0;
+  for (const Person& person : persons) {
+    checksum += std::hash<std::string_view>{}(person.GetName());
+  }
+  return checksum;
+}
+
+void CheckSorted(const std::vector<Person>& persons, std::size_t checksum) {
+  if (!std::is_sorted(persons.begin(), persons.end(), ByName) || NameChecksum(persons) != checksum) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+}
+
+void BenchmarkSort(std::size_t count, unsigned threads) {
+  std::mt19937 gen{42};
+  std::vector<Person> input;
+  input.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    input.emplace_back(MakeName(gen).c_str());
+  }
+  std::size_t checksum = NameChecksum(input);
+
+  std::vector<Person> persons = input;
+  double sort_ms = MeasureMs([&] { std::sort(persons.begin(), persons.end(), ByName); });
+  CheckSorted(persons, checksum);
+
+  persons = input;
+  double par_sort_ms = MeasureMs([&] { std::sort(std::execution::par, persons.begin(), persons.end(), ByName); });
+  CheckSorted(persons, checksum);
+
+  persons = input;
+  WorkStealingPool<SortTask> sort_pool{threads};
+  double radix_ms = MeasureMs([&] { ParallelRadixSort(sort_pool, persons); });
+  CheckSorted(persons, checksum);
+
+  // Every other query is a name that does not exist
+  std::vector<const char*> queries;
+  std::vector<std::string> missing;
+  std::size_t query_count = std::min<std::size_t>(count, 1'000'000);
+  missing.reserve(query_count / 2 + 1);
+  std::uniform_int_distribution<std::size_t> index_dist{0, count - 1};
+  for (std::size_t idx = 0; idx < query_count; ++idx) {
+    if (idx % 2 == 0) {
+      queries.push_back(input[index_dist(gen)].GetName());
+    } else {
+      missing.push_back(MakeName(gen) + " the Unknown");
+      queries.push_back(missing.back().c_str());
+    }
+  }
+
+  std::vector<std::ptrdiff_t> sequential_found(queries.size());
+  double lookup_ms = MeasureMs([&] {
+    for (std::size_t idx = 0; idx < queries.size(); ++idx) {
+      auto found = std::lower_bound(persons.begin(), persons.end(), queries[idx],
+                                    [](const Person& person, const char* key) { return strcmp(person.GetName(), key) < 0; });
+      sequential_found[idx] = found != persons.end() && strcmp(found->GetName(), queries[idx]) == 0
+                                ? found - persons.begin() : -1;
+    }
+  });
+  WorkStealingPool<LookupTask> lookup_pool{threads};
+  std::vector<std::ptrdiff_t> parallel_found;
+  double parallel_lookup_ms = MeasureMs([&] { parallel_found = FindAll(lookup_pool, persons, queries); });
+
+  if (sequential_found != parallel_found) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu persons, %u threads\n", count, sort_pool.Workers());
+  LOG_BENCH("std::sort", sort_ms, count);
+  LOG_BENCH("std::sort(std::execution::par)", par_sort_ms, count);
+  LOG_BENCH("ParallelRadixSort", radix_ms, count);
+  printf("%-*s => %zu\n", 50, "  tasks stolen", sort_pool.Steals());
+  LOG_BENCH("lower_bound per query", lookup_ms, query_count);
+  LOG_BENCH("FindAll, batched on the pool", parallel_lookup_ms, query_count);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+  unsigned threads = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10))
+                              : std::thread::hardware_concurrency();
+  ShowRadixSort();
+  BenchmarkSort(count, threads);
+}
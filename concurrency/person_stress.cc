@@ -0,0 +1,284 @@
+/*
+ * Create/move/destroy stress test across threads
+ *
+ * Every other example creates and destroys its persons on one thread. Here
+ * persons are built by N producer threads, moved through a bounded queue and
+ * destroyed by M consumer threads, so most names are freed by a different
+ * thread than the one that allocated them. That is the pattern that makes
+ * allocators slow: the freeing thread has to hand memory back to the
+ * allocating thread's arena or cache.
+ *
+ * Person is the one from move_semantics.cc without the prints. Name lengths
+ * follow a log-normal distribution around a configurable median, short names
+ * still go through new[] since Person does not have a small buffer.
+ *
+ * Reported:
+ *
+ *  - throughput in persons per second, construction to destruction
+ *  - p50/p99/p999 of the time a person spends between construction and
+ *    destruction, which includes the queueing
+ *  - RSS sampled every 50 ms while the test runs
+ *
+ * Usage: person_stress.out [items per producer] [producers] [consumers] [median name length]
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -pthread -o person_stress.out person_stress.cc
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+class Person{
+
+public:
+  Person(const char* name) : name_{new char[strlen(name) + 1]} {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+
+  ~Person(){
+    delete [] name_;
+  }
+
+  Person(const Person& rhs) : Person(rhs.name_) {}
+
+  Person& operator=(const Person& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = new char[name_size];
+    memcpy(new_name, rhs.name_, name_size);
+    delete [] name_;
+    name_ = new_name;
+    return *this;
+  }
+
+  Person(Person&& rhs) noexcept : name_{std::move(rhs.name_)} {
+    rhs.name_ = nullptr;
+  }
+
+  Person& operator=(Person&& rhs) noexcept {
+    if (this != &rhs){
+      delete [] name_;
+      name_ = rhs.name_;
+      rhs.name_ = nullptr;
+    }
+    return *this;
+  }
+
+  const char* GetName() const {
+    return name_;
+  }
+
+private:
+  char* name_;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// What travels through the queue
+struct Envelope {
+  Person person;
+  Clock::time_point created;
+};
+
+/*
+ * Bounded multi-producer multi-consumer queue. Producers block while it is
+ * full, so a slow consumer side shows up as latency instead of memory growth.
+ */
+template<typename T>
+class BlockingQueue {
+public:
+  explicit BlockingQueue(std::size_t capacity) : capacity_{capacity} {}
+
+  void Push(T&& value) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+    items_.push_back(std::move(value));
+    lock.unlock();
+    not_empty_.notify_one();
+  }
+
+  // Empty once the queue is closed and drained
+  std::optional<T> Pop() {
+    std::unique_lock<std::mutex> lock{mutex_};
+    not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+    if (items_.empty()) {
+      return std::nullopt;
+    }
+    std::optional<T> value{std::move(items_.front())};
+    items_.pop_front();
+    lock.unlock();
+    not_full_.notify_one();
+    return value;
+  }
+
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      closed_ = true;
+    }
+    not_empty_.notify_all();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<T> items_;
+  std::size_t capacity_;
+  bool closed_ = false;
+};
+
+struct StressConfig {
+  std::size_t items_per_producer;
+  int producers;
+  int consumers;
+  double median_name_length;
+};
+
+std::size_t ResidentKiB() {
+  long resident_pages = 0;
+  if (FILE* statm = fopen("/proc/self/statm", "r")) {
+    long total_pages = 0;
+    if (fscanf(statm, "%ld %ld", &total_pages, &resident_pages) != 2) {
+      resident_pages = 0;
+    }
+    fclose(statm);
+  }
+  return static_cast<std::size_t>(resident_pages) * static_cast<std::size_t>(sysconf(_SC_PAGESIZE)) / 1024;
+}
+
+void Produce(BlockingQueue<Envelope>& queue, const StressConfig& config, unsigned seed) {
+  std::mt19937 gen{seed};
+  std::lognormal_distribution<double> length_dist{std::log(config.median_name_length), 0.5};
+  std::uniform_int_distribution<int> letter_dist{'a', 'z'};
+  std::vector<char> name;
+
+  for (std::size_t idx = 0; idx < config.items_per_producer; ++idx) {
+    std::size_t length = std::clamp<std::size_t>(static_cast<std::size_t>(length_dist(gen)), 1, 4096);
+    name.resize(length + 1);
+    for (std::size_t pos = 0; pos < length; ++pos) {
+      name[pos] = static_cast<char>(letter_dist(gen));
+    }
+    name[length] = '\0';
+    queue.Push(Envelope{Person{name.data()}, Clock::now()});
+  }
+}
+
+// Returns the latency of every person it destroyed, in nanoseconds
+std::vector<std::int64_t> Consume(BlockingQueue<Envelope>& queue, std::size_t share) {
+  // Sized for an even share of the items, 8 bytes each against the persons'
+  // names; a consumer that wins more than its share grows the vector
+  std::vector<std::int64_t> latencies;
+  latencies.reserve(share);
+  while (std::optional<Envelope> envelope = queue.Pop()) {
+    Clock::time_point created = envelope->created;
+    DoNotOptimize(envelope->person.GetName());
+    // Destroys the person, and frees its name, on this thread
+    envelope.reset();
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - created).count());
+  }
+  return latencies;
+}
+
+double Percentile(const std::vector<std::int64_t>& sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  std::size_t idx = static_cast<std::size_t>(fraction * static_cast<double>(sorted.size() - 1));
+  return static_cast<double>(sorted[idx]) / 1000.0;
+}
+
+void RunStress(const StressConfig& config) {
+  BlockingQueue<Envelope> queue{1024};
+  std::vector<std::vector<std::int64_t>> latencies(static_cast<std::size_t>(config.consumers));
+  std::vector<std::pair<double, std::size_t>> rss_samples;
+  std::atomic<bool> running{true};
+
+  auto start = Clock::now();
+  std::thread sampler([&] {
+    while (running.load(std::memory_order_relaxed)) {
+      double elapsed_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+      rss_samples.emplace_back(elapsed_ms, ResidentKiB());
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  });
+
+  const std::size_t total = config.items_per_producer * static_cast<std::size_t>(config.producers);
+  const std::size_t share = total / static_cast<std::size_t>(config.consumers) + 1;
+  std::vector<std::thread> consumers;
+  for (int idx = 0; idx < config.consumers; ++idx) {
+    consumers.emplace_back([&, idx] { latencies[static_cast<std::size_t>(idx)] = Consume(queue, share); });
+  }
+  std::vector<std::thread> producers;
+  for (int idx = 0; idx < config.producers; ++idx) {
+    producers.emplace_back([&, idx] { Produce(queue, config, 42u + static_cast<unsigned>(idx)); });
+  }
+
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  queue.Close();
+  for (auto& consumer : consumers) {
+    consumer.join();
+  }
+  double total_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  running.store(false, std::memory_order_relaxed);
+  sampler.join();
+
+  std::vector<std::int64_t> all_latencies;
+  for (auto& consumer_latencies : latencies) {
+    all_latencies.insert(all_latencies.end(), consumer_latencies.begin(), consumer_latencies.end());
+  }
+  std::sort(all_latencies.begin(), all_latencies.end());
+
+  if (all_latencies.size() != total) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%d producers, %d consumers, %zu persons, median name length %.0f\n",
+    config.producers, config.consumers, total, config.median_name_length);
+  LOG_BENCH("create, move across threads, destroy", total_ms, total);
+  printf("%-*s => %10.2f us\n", 50, "latency p50", Percentile(all_latencies, 0.50));
+  printf("%-*s => %10.2f us\n", 50, "latency p99", Percentile(all_latencies, 0.99));
+  printf("%-*s => %10.2f us\n", 50, "latency p999", Percentile(all_latencies, 0.999));
+  printf("%-*s => %10.2f us\n", 50, "latency max", Percentile(all_latencies, 1.0));
+
+  printf("RSS over time\n");
+  for (const auto& [elapsed_ms, rss_kib] : rss_samples) {
+    printf("%-*s => %10zu KiB\n", 50, ("  " + std::to_string(static_cast<long>(elapsed_ms)) + " ms").c_str(), rss_kib);
+  }
+}
+
+int main(int argc, char** argv) {
+  StressConfig config;
+  config.items_per_producer = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 500'000;
+  config.producers = argc > 2 ? std::atoi(argv[2]) : 2;
+  config.consumers = argc > 3 ? std::atoi(argv[3]) : 2;
+  config.median_name_length = argc > 4 ? std::atof(argv[4]) : 24.0;
+  if (config.producers < 1 || config.consumers < 1 || config.median_name_length < 1.0) {
+    printf("Usage: %s [items per producer] [producers] [consumers] [median name length]\n", argv[0]);
+    return 1;
+  }
+  RunStress(config);
+}
@@ -0,0 +1,341 @@
+/*
+ * Parallel deep copy of Person containers on a work-stealing pool
+ *
+ * Copying a std::vector<Person> with the copy constructor of deep_copy.cc
+ * allocates and copies every name on one thread. The copies do not depend on
+ * each other, so the range can be cut into chunks and copied by all cores.
+ *
+ * ParallelUninitializedCopy and ParallelUninitializedMove construct into raw
+ * memory, like std::uninitialized_copy and std::uninitialized_move:
+ *
+ *  - The range is cut into several chunks per worker and each chunk is a task
+ *    of WorkStealingPool from common/work_stealing_pool.h. Chunks take
+ *    different amounts of time, since names differ in length and malloc
+ *    sometimes has to take new memory from the system. Workers that finish
+ *    early steal the remaining chunks from the others.
+ *  - A chunk is constructed with std::uninitialized_copy or _move, which
+ *    destroys what it constructed itself when an element throws.
+ *  - Once any chunk has failed, the chunks that have not started yet are
+ *    skipped. After all workers are done, every chunk that was completed is
+ *    destroyed and the first exception is rethrown, so a failed call leaves
+ *    no object behind, the same guarantee the sequential algorithms give.
+ *
+ * The benchmark copies persons and PersonInventory objects with 1, 2, 4, ...
+ * threads up to the number of cores, or up to the second argument.
+ *
+ * Usage: work_stealing_copy.out [persons] [max threads]
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -pthread -o work_stealing_copy.out work_stealing_copy.cc
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+#include "../common/work_stealing_pool.h"
+
+/*
+ * The Person of deep_copy.cc without the prints, with a move constructor.
+ */
+class Person{
+
+public:
+  Person(const char* name) : name_(new char[strlen(name) + 1]) {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+
+  ~Person() {
+    delete [] name_;
+  }
+
+  Person(const Person& rhs) : Person(rhs.name_) {}
+
+  Person& operator=(const Person& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = new char[name_size];
+    memcpy(new_name, rhs.name_, name_size);
+    delete [] name_;
+    name_ = new_name;
+    return *this;
+  }
+
+  Person(Person&& rhs) noexcept : name_{rhs.name_} {
+    rhs.name_ = nullptr;
+  }
+
+  const char* GetName() const {
+    return name_;
+  }
+
+private:
+  char* name_;
+};
+
+/*
+ * PersonInventory of perfect_forwarding_constructor_better.cc without the
+ * prints.
+ */
+class PersonInventory {
+public:
+  PersonInventory(const std::vector<float> values, std::vector<std::string> items)
+    : values_{values}, items_{items} {}
+  const std::vector<float>& Values() const { return values_; }
+  const std::vector<std::string>& Items() const { return items_; }
+private:
+  std::vector<float> values_;
+  std::vector<std::string> items_;
+};
+
+// Elements [first, last) of the source go to the same offsets of the target
+struct CopyChunk {
+  std::size_t index = 0;
+  std::size_t first = 0;
+  std::size_t last = 0;
+};
+
+constexpr std::size_t kChunksPerWorker = 8;
+constexpr std::size_t kMinChunk = 4096;
+
+std::vector<CopyChunk> SplitChunks(std::size_t count, unsigned workers) {
+  std::size_t chunk_size = std::max(kMinChunk, count / (workers * kChunksPerWorker) + 1);
+  std::vector<CopyChunk> chunks;
+  for (std::size_t first = 0; first < count; first += chunk_size) {
+    chunks.push_back({chunks.size(), first, std::min(first + chunk_size, count)});
+  }
+  return chunks;
+}
+
+/*
+ * Calls construct_chunk(first, last) for every chunk of [0, count). When one
+ * throws, destroys the chunks that were completed and rethrows.
+ */
+template<typename T, typename ConstructChunk>
+void ConstructInChunks(WorkStealingPool<CopyChunk>& pool, T* target, std::size_t count, ConstructChunk construct_chunk) {
+  std::vector<CopyChunk> chunks = SplitChunks(count, pool.Workers());
+  // One flag per chunk, only written by the worker that constructs the chunk
+  std::vector<char> constructed(chunks.size(), 0);
+  std::atomic<bool> failed{false};
+  std::mutex error_mutex;
+  std::exception_ptr error;
+
+  pool.Run(chunks, [&](CopyChunk chunk, WorkStealingPool<CopyChunk>::Spawner&) {
+    if (failed.load(std::memory_order_relaxed)) {
+      return;
+    }
+    try {
+      construct_chunk(chunk.first, chunk.last);
+      constructed[chunk.index] = 1;
+    } catch (...) {
+      std::lock_guard<std::mutex> lock{error_mutex};
+      if (!error) {
+        error = std::current_exception();
+      }
+      failed.store(true, std::memory_order_relaxed);
+    }
+  });
+
+  // Run() has joined the workers, their writes are visible here
+  if (error) {
+    for (const CopyChunk& chunk : chunks) {
+      if (constructed[chunk.index]) {
+        std::destroy(target + chunk.first, target + chunk.last);
+      }
+    }
+    std::rethrow_exception(error);
+  }
+}
+
+template<typename T>
+void ParallelUninitializedCopy(WorkStealingPool<CopyChunk>& pool, const T* first, const T* last, T* target) {
+  ConstructInChunks(pool, target, static_cast<std::size_t>(last - first), [&](std::size_t begin, std::size_t end) {
+    std::uninitialized_copy(first + begin, first + end, target + begin);
+  });
+}
+
+// On failure the source elements that were moved from stay moved-from
+template<typename T>
+void ParallelUninitializedMove(WorkStealingPool<CopyChunk>& pool, T* first, T* last, T* target) {
+  ConstructInChunks(pool, target, static_cast<std::size_t>(last - first), [&](std::size_t begin, std::size_t end) {
+    std::uninitialized_move(first + begin, first + end, target + begin);
+  });
+}
+
+/*
+ * Memory for `count` objects, which the owner constructs and destroys.
+ */
+template<typename T>
+class UninitializedBuffer {
+public:
+  explicit UninitializedBuffer(std::size_t count)
+    : data_{static_cast<T*>(::operator new(count * sizeof(T)))} {}
+  ~UninitializedBuffer() { ::operator delete(data_); }
+  UninitializedBuffer(const UninitializedBuffer&) = delete;
+  UninitializedBuffer& operator=(const UninitializedBuffer&) = delete;
+  T* data() const { return data_; }
+private:
+  T* data_;
+};
+
+// Counts live objects and throws from the copy constructor on request
+static std::atomic<long> live_counted = 0;
+static std::atomic<long> copies_until_throw = -1;
+
+class CountedPerson {
+public:
+  CountedPerson(const char* name) : person_{name} { ++live_counted; }
+  CountedPerson(const CountedPerson& rhs) : person_{rhs.person_} {
+    if (copies_until_throw.fetch_sub(1) == 0) {
+      throw std::runtime_error{"copy failed"};
+    }
+    ++live_counted;
+  }
+  ~CountedPerson() { --live_counted; }
+private:
+  Person person_;
+};
+
+void ShowPartialFailure() {
+  std::vector<CountedPerson> persons;
+  persons.reserve(100'000);
+  for (std::size_t idx = 0; idx < 100'000; ++idx) {
+    persons.emplace_back(idx % 2 == 0 ? "Arthur Dayne" : "Meryn Trant");
+  }
+  printf("%-*s => %ld\n", 50, "Live persons before the copy", live_counted.load());
+
+  WorkStealingPool<CopyChunk> pool{4};
+  UninitializedBuffer<CountedPerson> target{persons.size()};
+  copies_until_throw = 60'000;
+  try {
+    ParallelUninitializedCopy(pool, persons.data(), persons.data() + persons.size(), target.data());
+  } catch (const std::exception& error) {
+    printf("%-*s => %s\n", 50, "Copy threw", error.what());
+  }
+  copies_until_throw = -1;
+  printf("%-*s => %ld\n\n", 50, "Live persons after the failed copy", live_counted.load());
+}
+
+std::vector<Person> MakePersons(std::size_t count) {
+  const char* first_names[] = {"Arthur", "Meryn", "Barristan", "Jaime", "Arryk", "Erryk", "Loras"};
+  const char* houses[] = {"Dayne", "Trant", "Selmy", "Lannister", "Cargyll", "Tyrell", "Blount"};
+  std::mt19937 gen{42};
+  std::uniform_int_distribution<std::size_t> name_dist{0, 6};
+  std::uniform_int_distribution<std::size_t> title_dist{0, 40};
+  std::vector<Person> persons;
+  persons.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    std::string name = std::string{"Ser "} + first_names[name_dist(gen)] + " of House " + houses[name_dist(gen)];
+    name += std::string(title_dist(gen), '!');
+    persons.emplace_back(name.c_str());
+  }
+  return persons;
+}
+
+std::vector<PersonInventory> MakeInventories(std::size_t count) {
+  std::vector<PersonInventory> inventories;
+  inventories.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    inventories.emplace_back(std::vector<float>{5.5f, 3.5f, 2.5f, 1.0f, 0.5f, 7.0f, 1.5f, 2.0f},
+                             std::vector<std::string>{"Longsword of House Dayne", "Shield of the Kingsguard",
+                                                      "Dagger of Valyrian steel", "Sack of golden dragons",
+                                                      "Helm of the Sword of the Morning", "Cloak of white wool",
+                                                      "Horse named Dawnbreaker", "Letter sealed by the king"});
+  }
+  return inventories;
+}
+
+// 1, 2, 4, ... and max_threads itself
+std::vector<unsigned> ThreadCounts(unsigned max_threads) {
+  std::vector<unsigned> counts;
+  for (unsigned threads = 1; threads < max_threads; threads *= 2) {
+    counts.push_back(threads);
+  }
+  counts.push_back(max_threads);
+  return counts;
+}
+
+template<typename T, typename Check>
+void BenchmarkCopy(const char* type_name, const std::vector<T>& source, unsigned max_threads, Check same) {
+  std::size_t count = source.size();
+  UninitializedBuffer<T> target{count};
+
+  double sequential_ms = MeasureBestMs(3, [&] {
+    std::uninitialized_copy(source.data(), source.data() + count, target.data());
+    std::destroy(target.data(), target.data() + count);
+  });
+  printf("%zu %s objects\n", count, type_name);
+  LOG_BENCH("  std::uninitialized_copy (copy + destroy)", sequential_ms, count);
+
+  for (unsigned threads : ThreadCounts(max_threads)) {
+    WorkStealingPool<CopyChunk> pool{threads};
+    double parallel_ms = MeasureBestMs(3, [&] {
+      ParallelUninitializedCopy(pool, source.data(), source.data() + count, target.data());
+      std::destroy(target.data(), target.data() + count);
+    });
+    ParallelUninitializedCopy(pool, source.data(), source.data() + count, target.data());
+    // An empty source has no front() or back() to compare
+    bool ok = count == 0 ||
+              (same(source.front(), target.data()[0]) && same(source.back(), target.data()[count - 1]));
+    std::destroy(target.data(), target.data() + count);
+    if (!ok) {
+      printf("Results differ!\n");
+      std::exit(1);
+    }
+
+    std::string label = "  ParallelUninitializedCopy, " + std::to_string(threads) + " threads";
+    LOG_BENCH(label.c_str(), parallel_ms, count);
+  }
+}
+
+void BenchmarkMove(std::vector<Person>& persons, unsigned max_threads) {
+  std::size_t count = persons.size();
+  UninitializedBuffer<Person> target{count};
+  for (unsigned threads : ThreadCounts(max_threads)) {
+    WorkStealingPool<CopyChunk> pool{threads};
+    double move_ms = MeasureMs([&] { ParallelUninitializedMove(pool, persons.data(), persons.data() + count, target.data()); });
+    // Move back for the next round
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      persons[idx].~Person();
+      new (&persons[idx]) Person{std::move(target.data()[idx])};
+      target.data()[idx].~Person();
+    }
+    std::string label = "  ParallelUninitializedMove, " + std::to_string(threads) + " threads";
+    LOG_BENCH(label.c_str(), move_ms, count);
+  }
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4'000'000;
+  unsigned max_threads = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10))
+                                  : std::max(1u, std::thread::hardware_concurrency());
+  ShowPartialFailure();
+
+  std::vector<Person> persons = MakePersons(count);
+  BenchmarkCopy("Person", persons, max_threads, [](const Person& lhs, const Person& rhs) {
+    return strcmp(lhs.GetName(), rhs.GetName()) == 0 && lhs.GetName() != rhs.GetName();
+  });
+  BenchmarkMove(persons, max_threads);
+
+  std::vector<PersonInventory> inventories = MakeInventories(count / 16);
+  BenchmarkCopy("PersonInventory", inventories, max_threads, [](const PersonInventory& lhs, const PersonInventory& rhs) {
+    return lhs.Values() == rhs.Values() && lhs.Items() == rhs.Items();
+  });
+}
@@ -0,0 +1,693 @@
+/*
+ * Persistent vector with structural sharing
+ *
+ * PersonInventory in perfect_forwarding_constructor_better.cc keeps its
+ * values and items in two std::vectors, so every copy duplicates both of them:
+ * an undo history of 64 snapshots of a 10'000 item inventory holds 640'000
+ * strings, and taking each snapshot costs 10'000 string copies even when the
+ * next edit only changes one float.
+ *
+ * persistent_vector<T> is a 32-way trie in the style of Clojure's vector:
+ *
+ *  - Elements live in leaves of 32. Branches of 32 children sit on top of them,
+ *    so a million elements are four levels deep. The last, partially filled
+ *    leaf is kept aside as the tail, which makes push_back O(1) amortized.
+ *  - Nodes are immutable once shared and reference counted. Copying a vector
+ *    copies two pointers and bumps two counts, O(1) regardless of its size.
+ *  - Updating an element copies only the path from the root to its leaf
+ *    (path copying, O(log32 n) nodes) and shares every other node with the
+ *    previous version, which stays valid and unchanged.
+ *  - A node whose count is one is owned by a single vector, and nobody else can
+ *    observe it. Mutations on an rvalue vector and on a transient edit such
+ *    nodes in place, so a batch of updates copies each touched node at most
+ *    once instead of copying a fresh path for every element.
+ *
+ * The price is paid by readers: operator[] walks the trie instead of indexing
+ * one array, and a full scan should go through ForEachChunk(), which hands out
+ * whole leaves.
+ *
+ * Usage: persistent_vector.out [edits]
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o persistent_vector.out persistent_vector.cc
+ *
+ */
+
+#include <stdio.h>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+#include "../common/allocation_counter.h"
+#include "../common/timer.h"
+
+template<typename T>
+class persistent_vector {
+  static constexpr unsigned kBits = 5;
+  static constexpr std::size_t kWidth = std::size_t{1} << kBits;
+  static constexpr std::size_t kMask = kWidth - 1;
+
+  struct Node {
+    std::atomic<std::uint32_t> refs{1};
+  };
+
+  struct Branch : Node {
+    Node* children[kWidth] = {};
+  };
+
+  struct Leaf : Node {
+    std::uint32_t size = 0;
+    alignas(T) unsigned char storage[sizeof(T) * kWidth];
+
+    T* data() {
+      return std::launder(reinterpret_cast<T*>(storage));
+    }
+    const T* data() const {
+      return std::launder(reinterpret_cast<const T*>(storage));
+    }
+    ~Leaf() {
+      std::destroy_n(data(), size);
+    }
+  };
+
+public:
+  class transient_type;
+
+  persistent_vector() = default;
+
+  persistent_vector(const persistent_vector& rhs)
+    : size_{rhs.size_}, shift_{rhs.shift_}, root_{rhs.root_}, tail_{rhs.tail_} {
+    Retain(root_);
+    Retain(tail_);
+  }
+
+  persistent_vector(persistent_vector&& rhs) noexcept
+    : size_{std::exchange(rhs.size_, 0)},
+      shift_{std::exchange(rhs.shift_, 0)},
+      root_{std::exchange(rhs.root_, nullptr)},
+      tail_{std::exchange(rhs.tail_, nullptr)} {}
+
+  persistent_vector& operator=(persistent_vector rhs) noexcept {
+    swap(rhs);
+    return *this;
+  }
+
+  ~persistent_vector() {
+    Release(root_, shift_);
+    Release(tail_, 0);
+  }
+
+  void swap(persistent_vector& rhs) noexcept {
+    std::swap(size_, rhs.size_);
+    std::swap(shift_, rhs.shift_);
+    std::swap(root_, rhs.root_);
+    std::swap(tail_, rhs.tail_);
+  }
+
+  std::size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  const T& operator[](std::size_t idx) const {
+    if (idx >= TailOffset()) {
+      return tail_->data()[idx - TailOffset()];
+    }
+    const Node* node = root_;
+    for (unsigned level = shift_; level > 0; level -= kBits) {
+      node = static_cast<const Branch*>(node)->children[(idx >> level) & kMask];
+    }
+    return static_cast<const Leaf*>(node)->data()[idx & kMask];
+  }
+
+  /*
+   * Returns a new version with element `idx` replaced. The lvalue overload
+   * leaves this vector untouched; the rvalue overload reuses the nodes it owns
+   * exclusively, so `v = std::move(v).set(...)` does not copy them again.
+   */
+  persistent_vector set(std::size_t idx, T value) const& {
+    persistent_vector result{*this};
+    result.Assign(idx, std::move(value));
+    return result;
+  }
+  persistent_vector set(std::size_t idx, T value) && {
+    Assign(idx, std::move(value));
+    return std::move(*this);
+  }
+
+  persistent_vector push_back(T value) const& {
+    persistent_vector result{*this};
+    result.Append(std::move(value));
+    return result;
+  }
+  persistent_vector push_back(T value) && {
+    Append(std::move(value));
+    return std::move(*this);
+  }
+
+  transient_type transient() const& {
+    return transient_type{*this};
+  }
+  transient_type transient() && {
+    return transient_type{std::move(*this)};
+  }
+
+  /*
+   * Calls func(const T* first, std::size_t count) once per leaf, in order.
+   */
+  template<typename Func>
+  void ForEachChunk(Func&& func) const {
+    if (root_ != nullptr) {
+      Visit(root_, shift_, func);
+    }
+    if (tail_ != nullptr) {
+      func(static_cast<const T*>(tail_->data()), std::size_t{tail_->size});
+    }
+  }
+
+  /*
+   * Number of nodes this vector shares with `rhs`, to show structural sharing.
+   */
+  std::size_t SharedNodes(const persistent_vector& rhs) const {
+    std::vector<const Node*> mine;
+    Collect(root_, shift_, mine);
+    std::vector<const Node*> theirs;
+    rhs.Collect(rhs.root_, rhs.shift_, theirs);
+    std::size_t shared = tail_ != nullptr && tail_ == rhs.tail_;
+    for (const Node* node : mine) {
+      for (const Node* other : theirs) {
+        shared += node == other;
+      }
+    }
+    return shared;
+  }
+
+private:
+  std::size_t TailOffset() const {
+    return size_ == 0 ? 0 : (size_ - 1) & ~kMask;
+  }
+
+  static void Retain(Node* node) {
+    if (node != nullptr) {
+      node->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  static void Release(Node* node, unsigned level) {
+    if (node == nullptr || node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    if (level == 0) {
+      delete static_cast<Leaf*>(node);
+      return;
+    }
+    Branch* branch = static_cast<Branch*>(node);
+    for (Node* child : branch->children) {
+      Release(child, level - kBits);
+    }
+    delete branch;
+  }
+
+  static bool Unique(const Node* node) {
+    return node->refs.load(std::memory_order_acquire) == 1;
+  }
+
+  /*
+   * Returns `node` if this vector is its only owner, otherwise a private copy.
+   * The copy takes over this vector's reference, so the original loses one;
+   * the other owners may have let go meanwhile, so that goes through Release().
+   */
+  static Branch* OwnBranch(Node* node, unsigned level) {
+    Branch* branch = static_cast<Branch*>(node);
+    if (Unique(branch)) {
+      return branch;
+    }
+    Branch* copy = new Branch;
+    for (std::size_t idx = 0; idx < kWidth; ++idx) {
+      copy->children[idx] = branch->children[idx];
+      Retain(copy->children[idx]);
+    }
+    Release(branch, level);
+    return copy;
+  }
+
+  static Leaf* OwnLeaf(Node* node) {
+    Leaf* leaf = static_cast<Leaf*>(node);
+    if (Unique(leaf)) {
+      return leaf;
+    }
+    Leaf* copy = new Leaf;
+    try {
+      for (; copy->size < leaf->size; ++copy->size) {
+        new (copy->data() + copy->size) T(leaf->data()[copy->size]);
+      }
+    } catch (...) {
+      delete copy;
+      throw;
+    }
+    Release(leaf, 0);
+    return copy;
+  }
+
+  void Assign(std::size_t idx, T&& value) {
+    if (idx >= TailOffset()) {
+      tail_ = OwnLeaf(tail_);
+      tail_->data()[idx - TailOffset()] = std::move(value);
+      return;
+    }
+    root_ = OwnBranch(root_, shift_);
+    Branch* branch = static_cast<Branch*>(root_);
+    for (unsigned level = shift_; level > kBits; level -= kBits) {
+      Node*& child = branch->children[(idx >> level) & kMask];
+      child = OwnBranch(child, level - kBits);
+      branch = static_cast<Branch*>(child);
+    }
+    Node*& child = branch->children[(idx >> kBits) & kMask];
+    child = OwnLeaf(child);
+    static_cast<Leaf*>(child)->data()[idx & kMask] = std::move(value);
+  }
+
+  void Append(T&& value) {
+    if (tail_ != nullptr && tail_->size == kWidth) {
+      // Build the new tail first, so a throwing T leaves the vector intact
+      Leaf* tail = new Leaf;
+      try {
+        new (tail->data()) T(std::move(value));
+      } catch (...) {
+        delete tail;
+        throw;
+      }
+      tail->size = 1;
+      PushTail(tail_);
+      tail_ = tail;
+      ++size_;
+      return;
+    }
+    if (tail_ == nullptr) {
+      tail_ = new Leaf;
+    } else {
+      tail_ = OwnLeaf(tail_);
+    }
+    new (tail_->data() + tail_->size) T(std::move(value));
+    ++tail_->size;
+    ++size_;
+  }
+
+  /*
+   * Hangs the full tail holding elements [size_ - 32, size_) into the trie,
+   * growing a new root level when the trie is full.
+   */
+  void PushTail(Leaf* leaf) {
+    if (root_ == nullptr) {
+      Branch* root = new Branch;
+      root->children[0] = leaf;
+      root_ = root;
+      shift_ = kBits;
+      return;
+    }
+    if ((size_ >> kBits) > (std::size_t{1} << shift_)) {
+      Branch* root = new Branch;
+      root->children[0] = root_;
+      root->children[1] = NewPath(shift_, leaf);
+      root_ = root;
+      shift_ += kBits;
+      return;
+    }
+    std::size_t idx = size_ - 1;
+    root_ = OwnBranch(root_, shift_);
+    Branch* branch = static_cast<Branch*>(root_);
+    for (unsigned level = shift_; level > kBits; level -= kBits) {
+      Node*& child = branch->children[(idx >> level) & kMask];
+      if (child == nullptr) {
+        child = NewPath(level - kBits, leaf);
+        return;
+      }
+      child = OwnBranch(child, level - kBits);
+      branch = static_cast<Branch*>(child);
+    }
+    branch->children[(idx >> kBits) & kMask] = leaf;
+  }
+
+  static Node* NewPath(unsigned level, Node* node) {
+    for (; level > 0; level -= kBits) {
+      Branch* branch = new Branch;
+      branch->children[0] = node;
+      node = branch;
+    }
+    return node;
+  }
+
+  template<typename Func>
+  static void Visit(const Node* node, unsigned level, Func& func) {
+    if (level == 0) {
+      const Leaf* leaf = static_cast<const Leaf*>(node);
+      func(leaf->data(), std::size_t{leaf->size});
+      return;
+    }
+    for (const Node* child : static_cast<const Branch*>(node)->children) {
+      if (child == nullptr) {
+        return;
+      }
+      Visit(child, level - kBits, func);
+    }
+  }
+
+  static void Collect(const Node* node, unsigned level, std::vector<const Node*>& nodes) {
+    if (node == nullptr) {
+      return;
+    }
+    nodes.push_back(node);
+    if (level == 0) {
+      return;
+    }
+    for (const Node* child : static_cast<const Branch*>(node)->children) {
+      Collect(child, level - kBits, nodes);
+    }
+  }
+
+  std::size_t size_ = 0;
+  unsigned shift_ = 0;
+  Node* root_ = nullptr;
+  Leaf* tail_ = nullptr;
+};
+
+/*
+ * Mutable view for batched updates. It edits nodes it owns in place, copying
+ * a shared node only the first time it is touched. persistent() hands the
+ * result back as an ordinary persistent_vector in O(1).
+ */
+template<typename T>
+class persistent_vector<T>::transient_type {
+public:
+  explicit transient_type(persistent_vector vector) : vector_{std::move(vector)} {}
+
+  std::size_t size() const {
+    return vector_.size();
+  }
+
+  const T& operator[](std::size_t idx) const {
+    return vector_[idx];
+  }
+
+  void set(std::size_t idx, T value) {
+    vector_.Assign(idx, std::move(value));
+  }
+
+  void push_back(T value) {
+    vector_.Append(std::move(value));
+  }
+
+  persistent_vector persistent() && {
+    return std::move(vector_);
+  }
+
+private:
+  persistent_vector vector_;
+};
+
+/*
+ * PersonInventory from perfect_forwarding_constructor_better.cc, as it is:
+ * copying it copies both vectors.
+ */
+class CopyingInventory {
+public:
+  CopyingInventory(const std::vector<float>& values, const std::vector<std::string>& items)
+    : values_{values}, items_{items} {}
+
+  std::size_t size() const {
+    return values_.size();
+  }
+  float GetValue(std::size_t idx) const {
+    return values_[idx];
+  }
+  const std::string& GetItem(std::size_t idx) const {
+    return items_[idx];
+  }
+  void SetValue(std::size_t idx, float value) {
+    values_[idx] = value;
+  }
+  void SetItem(std::size_t idx, std::string item) {
+    items_[idx] = std::move(item);
+  }
+  void Revalue(float factor) {
+    for (float& value : values_) {
+      value *= factor;
+    }
+  }
+  double TotalValue() const {
+    double total = 0.0;
+    for (float value : values_) {
+      total += value;
+    }
+    return total;
+  }
+
+private:
+  std::vector<float> values_;
+  std::vector<std::string> items_;
+};
+
+/*
+ * The same inventory on persistent vectors. Copies are O(1) snapshots that
+ * share every node with the original until one of them is modified.
+ */
+class PersonInventory {
+public:
+  PersonInventory(const std::vector<float>& values, const std::vector<std::string>& items) {
+    auto values_builder = values_.transient();
+    for (float value : values) {
+      values_builder.push_back(value);
+    }
+    values_ = std::move(values_builder).persistent();
+    auto items_builder = items_.transient();
+    for (const std::string& item : items) {
+      items_builder.push_back(item);
+    }
+    items_ = std::move(items_builder).persistent();
+  }
+
+  std::size_t size() const {
+    return values_.size();
+  }
+  float GetValue(std::size_t idx) const {
+    return values_[idx];
+  }
+  const std::string& GetItem(std::size_t idx) const {
+    return items_[idx];
+  }
+
+  // Path-copies on the first write after a snapshot, then edits in place
+  void SetValue(std::size_t idx, float value) {
+    values_ = std::move(values_).set(idx, value);
+  }
+  void SetItem(std::size_t idx, std::string item) {
+    items_ = std::move(items_).set(idx, std::move(item));
+  }
+
+  // Always leaves this inventory alone and returns a new version
+  PersonInventory WithValue(std::size_t idx, float value) const {
+    PersonInventory result{*this};
+    result.values_ = values_.set(idx, value);
+    return result;
+  }
+
+  void Revalue(float factor) {
+    auto values = std::move(values_).transient();
+    for (std::size_t idx = 0; idx < values.size(); ++idx) {
+      values.set(idx, values[idx] * factor);
+    }
+    values_ = std::move(values).persistent();
+  }
+
+  double TotalValue() const {
+    double total = 0.0;
+    values_.ForEachChunk([&](const float* values, std::size_t count) {
+      for (std::size_t idx = 0; idx < count; ++idx) {
+        total += values[idx];
+      }
+    });
+    return total;
+  }
+
+  std::size_t SharedNodes(const PersonInventory& rhs) const {
+    return values_.SharedNodes(rhs.values_) + items_.SharedNodes(rhs.items_);
+  }
+
+private:
+  persistent_vector<float> values_;
+  persistent_vector<std::string> items_;
+};
+
+// Longer than the small string buffer, so copying an item allocates
+std::string ItemName(std::size_t idx) {
+  return "Item #" + std::to_string(idx) + " from the armory of Casterly Rock";
+}
+
+void MakeInventory(std::size_t count, std::vector<float>& values, std::vector<std::string>& items) {
+  values.clear();
+  items.clear();
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    values.push_back(static_cast<float>(idx % 100) + 0.5f);
+    items.push_back(ItemName(idx));
+  }
+}
+
+void ShowSnapshots() {
+  std::vector<float> values;
+  std::vector<std::string> items;
+  MakeInventory(1000, values, items);
+  PersonInventory inventory{values, items};
+
+  std::size_t before = allocation_count;
+  PersonInventory snapshot{inventory};
+  printf("%-*s => %zu\n", 50, "Allocations to snapshot 1000 items", allocation_count - before);
+
+  before = allocation_count;
+  inventory.SetValue(500, 1000.0f);
+  printf("%-*s => %zu\n", 50, "Allocations for the first SetValue", allocation_count - before);
+  before = allocation_count;
+  inventory.SetValue(501, 2000.0f);
+  printf("%-*s => %zu\n", 50, "Allocations for a second SetValue nearby", allocation_count - before);
+
+  printf("%-*s => %.1f / %.1f\n", 50, "Value 500 in snapshot / inventory",
+         snapshot.GetValue(500), inventory.GetValue(500));
+  printf("%-*s => %zu\n", 50, "Nodes shared by snapshot and inventory", snapshot.SharedNodes(inventory));
+
+  before = allocation_count;
+  inventory.Revalue(2.0f);
+  printf("%-*s => %zu\n", 50, "Allocations to revalue all 1000 items", allocation_count - before);
+  printf("%-*s => %.1f / %.1f\n\n", 50, "Total value of snapshot / inventory",
+         snapshot.TotalValue(), inventory.TotalValue());
+}
+
+/*
+ * Edits one value per step and keeps the last kHistory versions for undo,
+ * renaming an item every 8th step.
+ */
+template<typename Inventory>
+double RunUndoHistory(const Inventory& initial, std::size_t edits) {
+  constexpr std::size_t kHistory = 64;
+  Inventory current{initial};
+  std::deque<Inventory> history;
+  for (std::size_t edit = 0; edit < edits; ++edit) {
+    history.push_back(current);
+    if (history.size() > kHistory) {
+      history.pop_front();
+    }
+    std::size_t idx = (edit * 7919) % current.size();
+    current.SetValue(idx, current.GetValue(idx) + 1.0f);
+    if (edit % 8 == 0) {
+      current.SetItem(idx, ItemName(edit));
+    }
+  }
+  return current.TotalValue() + history.front().TotalValue();
+}
+
+void BenchmarkUndoHistory(std::size_t items, std::size_t edits) {
+  std::vector<float> values;
+  std::vector<std::string> names;
+  MakeInventory(items, values, names);
+  CopyingInventory copying{values, names};
+  PersonInventory persistent{values, names};
+
+  double copying_total = 0.0;
+  std::size_t before = allocation_count;
+  double copying_ms = MeasureMs([&] { copying_total = RunUndoHistory(copying, edits); });
+  std::size_t copying_allocations = allocation_count - before;
+
+  double persistent_total = 0.0;
+  before = allocation_count;
+  double persistent_ms = MeasureMs([&] { persistent_total = RunUndoHistory(persistent, edits); });
+  std::size_t persistent_allocations = allocation_count - before;
+
+  if (copying_total != persistent_total) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("Undo history, %zu items, %zu edits\n", items, edits);
+  LOG_BENCH("  copying inventory", copying_ms, edits);
+  printf("%-*s => %zu\n", 50, "  copying inventory allocations", copying_allocations);
+  LOG_BENCH("  persistent inventory", persistent_ms, edits);
+  printf("%-*s => %zu\n", 50, "  persistent inventory allocations", persistent_allocations);
+}
+
+/*
+ * Every request takes its own copy of a shared inventory and revalues all of
+ * its items: once by copying, once as a chain of persistent single updates and
+ * once as one transient batch.
+ */
+void BenchmarkBatch(std::size_t items, std::size_t requests) {
+  std::vector<float> values;
+  std::vector<std::string> names;
+  MakeInventory(items, values, names);
+  const CopyingInventory copying{values, names};
+  const PersonInventory persistent{values, names};
+  const float factor = 1.01f;
+
+  double copying_total = 0.0;
+  std::size_t before = allocation_count;
+  double copying_ms = MeasureMs([&] {
+    for (std::size_t request = 0; request < requests; ++request) {
+      CopyingInventory inventory{copying};
+      inventory.Revalue(factor);
+      copying_total += inventory.TotalValue();
+    }
+  });
+  std::size_t copying_allocations = allocation_count - before;
+
+  double chained_total = 0.0;
+  before = allocation_count;
+  double chained_ms = MeasureMs([&] {
+    for (std::size_t request = 0; request < requests; ++request) {
+      PersonInventory inventory{persistent};
+      for (std::size_t idx = 0; idx < inventory.size(); ++idx) {
+        inventory = inventory.WithValue(idx, inventory.GetValue(idx) * factor);
+      }
+      chained_total += inventory.TotalValue();
+    }
+  });
+  std::size_t chained_allocations = allocation_count - before;
+
+  double transient_total = 0.0;
+  before = allocation_count;
+  double transient_ms = MeasureMs([&] {
+    for (std::size_t request = 0; request < requests; ++request) {
+      PersonInventory inventory{persistent};
+      inventory.Revalue(factor);
+      transient_total += inventory.TotalValue();
+    }
+  });
+  std::size_t transient_allocations = allocation_count - before;
+
+  if (copying_total != chained_total || copying_total != transient_total) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  std::size_t updates = items * requests;
+  printf("Batched revalue, %zu items, %zu requests\n", items, requests);
+  LOG_BENCH("  copying inventory", copying_ms, updates);
+  printf("%-*s => %zu\n", 50, "  copying inventory allocations", copying_allocations);
+  LOG_BENCH("  persistent, one WithValue per item", chained_ms, updates);
+  printf("%-*s => %zu\n", 50, "  persistent, one WithValue per item allocations", chained_allocations);
+  LOG_BENCH("  persistent, transient Revalue", transient_ms, updates);
+  printf("%-*s => %zu\n", 50, "  persistent, transient Revalue allocations", transient_allocations);
+}
+
+int main(int argc, char** argv) {
+  std::size_t edits = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2'000;
+  ShowSnapshots();
+  BenchmarkUndoHistory(100, edits);
+  BenchmarkUndoHistory(10'000, edits);
+  BenchmarkBatch(10'000, edits / 20);
+}
@@ -0,0 +1,338 @@
+/*
+ * Segmented container with stable addresses
+ *
+ * NotMovablePerson in special_member_generation.cc has copy operations but
+ * deleted move operations. When a std::vector<NotMovablePerson> grows, it has
+ * no choice but to copy every existing element into the new buffer, and every
+ * pointer or reference to an element is invalidated on the way.
+ *
+ * stable_vector<T> never relocates an element:
+ *
+ *  - Elements live in fixed-size segments. Appending allocates a new segment
+ *    when the last one is full and leaves existing segments alone, so append is
+ *    O(1) amortized and never copies or moves existing elements.
+ *  - Addresses stay valid until the element itself is erased.
+ *  - Erased slots go on a free list and are reused by the next emplace(), so
+ *    erase/emplace churn does not grow the container.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o stable_vector.out stable_vector.cc
+ *
+ */
+
+#include <stdio.h>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+constexpr std::size_t RoundUpToPowerOfTwo(std::size_t value) {
+  std::size_t power = 1;
+  while (power < value) {
+    power <<= 1;
+  }
+  return power;
+}
+
+template<typename T, std::size_t SegmentSize = 1024>
+class stable_vector {
+  static_assert(SegmentSize % 64 == 0, "SegmentSize must be a multiple of 64");
+
+public:
+  stable_vector() = default;
+  stable_vector(const stable_vector&) = delete;
+  stable_vector& operator=(const stable_vector&) = delete;
+
+  // Segments move as a whole, so element addresses survive the move
+  stable_vector(stable_vector&& rhs) noexcept
+    : segments_{std::move(rhs.segments_)},
+      free_list_{std::exchange(rhs.free_list_, nullptr)},
+      end_{std::exchange(rhs.end_, 0)},
+      size_{std::exchange(rhs.size_, 0)} {
+    rhs.segments_.clear();
+  }
+
+  stable_vector& operator=(stable_vector&& rhs) noexcept {
+    if (this != &rhs) {
+      clear();
+      segments_ = std::move(rhs.segments_);
+      free_list_ = std::exchange(rhs.free_list_, nullptr);
+      end_ = std::exchange(rhs.end_, 0);
+      size_ = std::exchange(rhs.size_, 0);
+      rhs.segments_.clear();
+    }
+    return *this;
+  }
+
+  ~stable_vector() {
+    clear();
+  }
+
+  /*
+   * Constructs an element in a free slot, or at the end if there is none.
+   * The returned pointer stays valid until the element is erased.
+   */
+  template<typename... Args>
+  T* emplace(Args&&... args) {
+    if (free_list_ != nullptr) {
+      // The slot is a union, so the link must be read before T overwrites it
+      Slot* slot = free_list_;
+      Slot* next_free = slot->next_free;
+      T* element;
+      try {
+        element = ::new (slot->storage) T(std::forward<Args>(args)...);
+      } catch (...) {
+        slot->next_free = next_free;
+        throw;
+      }
+      free_list_ = next_free;
+      SetAlive(slot, true);
+      ++size_;
+      return element;
+    }
+    return emplace_back(std::forward<Args>(args)...);
+  }
+
+  // Always appends, so elements are visited in insertion order
+  template<typename... Args>
+  T* emplace_back(Args&&... args) {
+    if (segments_.empty() || end_ == SegmentSize) {
+      segments_.push_back(NewSegment());
+      end_ = 0;
+    }
+    Segment& segment = *segments_.back();
+    T* element = ::new (segment.slots[end_].storage) T(std::forward<Args>(args)...);
+    segment.alive[end_ / 64] |= std::uint64_t{1} << (end_ % 64);
+    ++end_;
+    ++size_;
+    return element;
+  }
+
+  T* push_back(const T& value) {
+    return emplace_back(value);
+  }
+
+  void erase(T* element) {
+    Slot* slot = reinterpret_cast<Slot*>(element);
+    element->~T();
+    SetAlive(slot, false);
+    slot->next_free = free_list_;
+    free_list_ = slot;
+    --size_;
+  }
+
+  std::size_t size() const { return size_; }
+
+  template<typename Func>
+  void for_each(Func&& func) {
+    for (auto& segment : segments_) {
+      for (std::size_t word = 0; word < kWords; ++word) {
+        std::uint64_t bits = segment->alive[word];
+        while (bits != 0) {
+          std::size_t idx = word * 64 + static_cast<std::size_t>(__builtin_ctzll(bits));
+          func(*std::launder(reinterpret_cast<T*>(segment->slots[idx].storage)));
+          bits &= bits - 1;
+        }
+      }
+    }
+  }
+
+  void clear() {
+    for_each([](T& element) { element.~T(); });
+    segments_.clear();
+    free_list_ = nullptr;
+    end_ = 0;
+    size_ = 0;
+  }
+
+private:
+  static constexpr std::size_t kWords = SegmentSize / 64;
+
+  union Slot {
+    alignas(T) unsigned char storage[sizeof(T)];
+    Slot* next_free;
+  };
+
+  struct Segment {
+    Slot slots[SegmentSize];
+    std::uint64_t alive[kWords] = {};
+  };
+
+  /*
+   * Segments start at a multiple of kSegmentAlign, a power of two no smaller
+   * than the segment, so clearing the low bits of a slot's address gives its
+   * segment in O(1). The aligned allocation hands the slack back to the heap.
+   */
+  static constexpr std::size_t kSegmentAlign = RoundUpToPowerOfTwo(sizeof(Segment));
+
+  struct SegmentDeleter {
+    void operator()(Segment* segment) const {
+      segment->~Segment();
+      ::operator delete(segment, std::align_val_t{kSegmentAlign});
+    }
+  };
+  using SegmentPtr = std::unique_ptr<Segment, SegmentDeleter>;
+
+  static SegmentPtr NewSegment() {
+    void* memory = ::operator new(sizeof(Segment), std::align_val_t{kSegmentAlign});
+    return SegmentPtr{::new (memory) Segment};
+  }
+
+  static Segment* SegmentOf(Slot* slot) {
+    return reinterpret_cast<Segment*>(reinterpret_cast<std::uintptr_t>(slot) & ~(kSegmentAlign - 1));
+  }
+
+  void SetAlive(Slot* slot, bool alive) {
+    Segment* segment = SegmentOf(slot);
+    std::size_t idx = static_cast<std::size_t>(slot - segment->slots);
+    std::uint64_t bit = std::uint64_t{1} << (idx % 64);
+    if (alive) {
+      segment->alive[idx / 64] |= bit;
+    } else {
+      segment->alive[idx / 64] &= ~bit;
+    }
+  }
+
+  std::vector<SegmentPtr> segments_;
+  Slot* free_list_ = nullptr;
+  std::size_t end_ = 0;
+  std::size_t size_ = 0;
+};
+
+/*
+ * The classes from special_member_generation.cc, counting copies and moves
+ * instead of printing them.
+ */
+static std::size_t copy_count = 0;
+static std::size_t move_count = 0;
+
+class CopyablePerson {
+private:
+  std::string name_;
+  int id_;
+
+public:
+  CopyablePerson(const std::string name, int id) : name_(name), id_(id) {}
+  CopyablePerson(const CopyablePerson& rhs) : name_{rhs.name_}, id_{rhs.id_} {
+    ++copy_count;
+  };
+  const char* GetName(){
+    return name_.c_str();
+  }
+};
+
+class NotMovablePerson {
+private:
+  std::string name_;
+  int id_;
+
+public:
+  NotMovablePerson(const std::string name, int id) : name_(name), id_(id) {}
+  NotMovablePerson(const NotMovablePerson& rhs) : name_{rhs.name_}, id_{rhs.id_} {
+    ++copy_count;
+  };
+
+  NotMovablePerson(NotMovablePerson&& rhs) = delete;
+  NotMovablePerson& operator=(NotMovablePerson&& rhs) = delete;
+
+  const char* GetName(){
+    return name_.c_str();
+  }
+};
+
+class MovablePerson {
+private:
+  std::string name_;
+  int id_;
+
+public:
+  MovablePerson(const std::string name, int id) : name_(name), id_(id) {}
+  MovablePerson(MovablePerson&& rhs) noexcept : name_{std::move(rhs.name_)}, id_{rhs.id_} {
+    ++move_count;
+  }
+  MovablePerson& operator=(MovablePerson&& rhs) = default;
+  const char* GetName(){
+    return name_.c_str();
+  }
+};
+
+void ShowStableAddresses() {
+  stable_vector<NotMovablePerson, 64> persons;
+  NotMovablePerson* first = persons.emplace_back("Rhaegar Targaryen", 55);
+  printf("%-*s => %p\n", 50, "Address of first person", (void*)first);
+
+  for (int idx = 0; idx < 1000; ++idx) {
+    persons.emplace_back("Lyanna Stark", idx);
+  }
+  printf("%-*s => %p\n", 50, "Address of first person after 1000 appends", (void*)first);
+  printf("%-*s => %s\n", 50, "Name of first person", first->GetName());
+  printf("%-*s => %zu\n", 50, "Copies made while growing", copy_count);
+
+  NotMovablePerson* erased = persons.emplace_back("Arthur Dayne", 1);
+  persons.erase(erased);
+  NotMovablePerson* reused = persons.emplace("Gerold Hightower", 2);
+  printf("%-*s => %d\n\n", 50, "Erased slot reused by next emplace", erased == reused);
+}
+
+template<typename Person>
+void BenchmarkPerson(const char* type_name, std::size_t count) {
+  // Longer than the small string buffer, so every copy allocates
+  const std::string name{"Ser Barristan Selmy of the Kingsguard"};
+
+  copy_count = 0;
+  move_count = 0;
+  double vector_ms = MeasureMs([&] {
+    std::vector<Person> persons;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      persons.emplace_back(name, static_cast<int>(idx));
+    }
+    DoNotOptimize(persons.data());
+  });
+  std::size_t vector_copies = copy_count;
+  std::size_t vector_moves = move_count;
+
+  copy_count = 0;
+  move_count = 0;
+  double deque_ms = MeasureMs([&] {
+    std::deque<Person> persons;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      persons.emplace_back(name, static_cast<int>(idx));
+    }
+    DoNotOptimize(&persons.back());
+  });
+  std::size_t deque_relocations = copy_count + move_count;
+
+  copy_count = 0;
+  move_count = 0;
+  double stable_ms = MeasureMs([&] {
+    stable_vector<Person> persons;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      persons.emplace_back(name, static_cast<int>(idx));
+    }
+    DoNotOptimize(persons.size());
+  });
+  std::size_t stable_relocations = copy_count + move_count;
+
+  printf("%s, %zu appends\n", type_name, count);
+  LOG_BENCH("  std::vector", vector_ms, count);
+  printf("%-*s => %zu copies, %zu moves\n", 50, "  std::vector relocations", vector_copies, vector_moves);
+  LOG_BENCH("  std::deque", deque_ms, count);
+  printf("%-*s => %zu\n", 50, "  std::deque relocations", deque_relocations);
+  LOG_BENCH("  stable_vector", stable_ms, count);
+  printf("%-*s => %zu\n", 50, "  stable_vector relocations", stable_relocations);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+  ShowStableAddresses();
+  BenchmarkPerson<NotMovablePerson>("NotMovablePerson", count);
+  BenchmarkPerson<CopyablePerson>("CopyablePerson", count);
+  BenchmarkPerson<MovablePerson>("MovablePerson", count);
+}
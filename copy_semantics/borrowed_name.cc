@@ -0,0 +1,361 @@
+/*
+ * Borrowing names from a memory-mapped file
+ *
+ * Person in deep_copy.cc always owns a private copy of its name. Loading a
+ * million names from a file that way reads every line into a buffer, then
+ * copies it once more into the person, and the heap ends up holding a second
+ * copy of the whole file.
+ *
+ * The Person here has two modes:
+ *
+ *  - Owning: the name is a new[] buffer, like in deep_copy.cc.
+ *  - Borrowing: the name is a string_view into a MappedFile, and the person
+ *    holds a shared_ptr to the mapping. The file stays mapped as long as any
+ *    person borrows from it, so a borrowed name can never dangle. Copying a
+ *    borrowing person copies the view and the handle, not the name.
+ *
+ * A borrowing person turns into an owning one when it has to:
+ *
+ *  - MutableName() copies the name out before handing out writable memory,
+ *    the mapping is read-only.
+ *  - Own() copies the name out, for a person that should live on without
+ *    keeping the whole file mapped.
+ *
+ * Borrowed names are not null-terminated, so GetName() returns a string_view.
+ *
+ * LoadPersons() maps a file with one name per line and builds a borrowing
+ * person per line. It allocates the vector and the mapping handle and nothing
+ * else. The benchmark compares it with reading the file through std::getline
+ * into owning persons, counting allocations with common/allocation_counter.h.
+ *
+ * Usage: borrowed_name.out [persons] [names file]
+ *
+ * Without a names file, one with the given number of names is generated.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o borrowed_name.out borrowed_name.cc
+ *
+ */
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "../common/allocation_counter.h"
+#include "../common/timer.h"
+
+/*
+ * A read-only mapping of a whole file, unmapped when the last handle to it
+ * goes away.
+ */
+class MappedFile {
+public:
+  // Returns nullptr and prints the reason when the file cannot be mapped
+  static std::shared_ptr<const MappedFile> Open(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+      perror(path);
+      return nullptr;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) == -1) {
+      perror("fstat");
+      close(fd);
+      return nullptr;
+    }
+    std::size_t size = static_cast<std::size_t>(info.st_size);
+    void* data = nullptr;
+    if (size != 0) {
+      data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return nullptr;
+      }
+      madvise(data, size, MADV_SEQUENTIAL);
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    return std::make_shared<const MappedFile>(static_cast<const char*>(data), size);
+  }
+
+  // Takes over a mapping made by mmap
+  MappedFile(const char* data, std::size_t size) : data_{data}, size_{size} {}
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  std::string_view Contents() const { return {data_, size_}; }
+
+private:
+  const char* data_;
+  std::size_t size_;
+};
+
+class Person{
+
+public:
+  // Owning
+  Person(const char* name) : Person{std::string_view{name}} {}
+
+  // Borrowing, `name` has to point into `mapping`
+  Person(std::string_view name, std::shared_ptr<const MappedFile> mapping)
+    : name_{name.data()}, size_{name.size()}, mapping_{std::move(mapping)} {}
+
+  ~Person(){
+    if (!mapping_) {
+      delete [] name_;
+    }
+  }
+
+  // A borrowed name is shared, an owned one is copied
+  Person(const Person& rhs) : mapping_{rhs.mapping_} {
+    if (mapping_) {
+      name_ = rhs.name_;
+      size_ = rhs.size_;
+    } else {
+      CopyFrom(rhs.GetName());
+    }
+  }
+
+  Person(Person&& rhs) noexcept
+    : name_{std::exchange(rhs.name_, nullptr)}, size_{std::exchange(rhs.size_, 0)},
+      mapping_{std::move(rhs.mapping_)} {}
+
+  Person& operator=(Person rhs) {
+    swap(*this, rhs);
+    return *this;
+  }
+
+  friend void swap(Person& first, Person& second) noexcept {
+    using std::swap;
+    swap(first.name_, second.name_);
+    swap(first.size_, second.size_);
+    swap(first.mapping_, second.mapping_);
+  }
+
+  std::string_view GetName() const {
+    return {name_, size_};
+  }
+
+  bool IsBorrowed() const {
+    return static_cast<bool>(mapping_);
+  }
+
+  // Copies a borrowed name out of the mapping and releases the mapping
+  void Own() {
+    if (mapping_) {
+      CopyFrom(GetName());
+      mapping_.reset();
+    }
+  }
+
+  char* MutableName() {
+    Own();
+    return const_cast<char*>(name_);
+  }
+
+private:
+  explicit Person(std::string_view name) {
+    CopyFrom(name);
+  }
+
+  // Owned names are null-terminated as well, so they can be printed with %s
+  void CopyFrom(std::string_view name) {
+    char* copy = new char[name.size() + 1];
+    memcpy(copy, name.data(), name.size());
+    copy[name.size()] = '\0';
+    name_ = copy;
+    size_ = name.size();
+  }
+
+  const char* name_ = nullptr;
+  std::size_t size_ = 0;
+  std::shared_ptr<const MappedFile> mapping_;
+};
+
+/*
+ * One borrowing person per non-empty line of `mapping`.
+ */
+std::vector<Person> LoadPersons(const std::shared_ptr<const MappedFile>& mapping) {
+  std::string_view contents = mapping->Contents();
+  std::size_t lines = 0;
+  for (const char* cursor = contents.data(); cursor != nullptr;) {
+    std::size_t left = contents.size() - static_cast<std::size_t>(cursor - contents.data());
+    cursor = static_cast<const char*>(memchr(cursor, '\n', left));
+    if (cursor != nullptr) {
+      ++lines;
+      ++cursor;
+    }
+  }
+
+  std::vector<Person> persons;
+  persons.reserve(lines + 1);
+  while (!contents.empty()) {
+    std::size_t end = contents.find('\n');
+    std::string_view line = contents.substr(0, end);
+    contents.remove_prefix(end == std::string_view::npos ? contents.size() : end + 1);
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (!line.empty()) {
+      persons.emplace_back(line, mapping);
+    }
+  }
+  return persons;
+}
+
+// What LoadPersons replaces: every line is read into a string and copied
+std::vector<Person> ReadPersons(const char* path) {
+  std::vector<Person> persons;
+  std::ifstream file{path};
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!line.empty()) {
+      persons.emplace_back(line.c_str());
+    }
+  }
+  return persons;
+}
+
+void ShowBorrowedName(const char* path) {
+  std::shared_ptr<const MappedFile> mapping = MappedFile::Open(path);
+  if (!mapping) {
+    return;
+  }
+  std::vector<Person> persons = LoadPersons(mapping);
+  if (persons.size() < 2) {
+    return;
+  }
+
+  Person copy = persons[0];
+  printf("%-*s => %.*s\n", 50, "Copy of the first person", (int)copy.GetName().size(), copy.GetName().data());
+  printf("%-*s => %s\n", 50, "Copy borrows the same bytes",
+         copy.GetName().data() == persons[0].GetName().data() ? "yes" : "no");
+  printf("%-*s => %ld\n", 50, "Handles to the mapping", mapping.use_count());
+
+  Person knight = persons[1];
+  char* name = knight.MutableName();
+  for (std::size_t idx = 0; idx < knight.GetName().size(); ++idx) {
+    name[idx] = static_cast<char>(toupper(static_cast<unsigned char>(name[idx])));
+  }
+  printf("%-*s => %s\n", 50, "Mutated copy of the second person", name);
+  printf("%-*s => %s\n", 50, "Mutated copy still borrows", knight.IsBorrowed() ? "yes" : "no");
+  printf("%-*s => %.*s\n", 50, "Original in the mapping",
+         (int)persons[1].GetName().size(), persons[1].GetName().data());
+
+  // Outlives the mapping: every other handle is dropped below
+  copy.Own();
+  persons.clear();
+  mapping.reset();
+  printf("%-*s => %s\n\n", 50, "Owned copy after the file is unmapped", copy.GetName().data());
+}
+
+bool WriteNames(const char* path, std::size_t count) {
+  static const char* first_names[] = {"Arthur", "Meryn", "Barristan", "Jaime", "Arryk", "Erryk", "Loras"};
+  static const char* houses[] = {"Dayne", "Trant", "Selmy", "Lannister", "Cargyll", "Tyrell", "Blount"};
+  FILE* file = fopen(path, "w");
+  if (file == nullptr) {
+    perror(path);
+    return false;
+  }
+  std::mt19937 gen{42};
+  std::uniform_int_distribution<std::size_t> name_dist{0, 6};
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    fprintf(file, "Ser %s of House %s, knight number %zu\n", first_names[name_dist(gen)],
+            houses[name_dist(gen)], idx);
+  }
+  return fclose(file) == 0;
+}
+
+void BenchmarkLoad(const char* path) {
+  std::size_t before_count = allocation_count;
+  std::size_t before_bytes = allocated_bytes;
+  std::vector<Person> read_persons;
+  double read_ms = MeasureMs([&] { read_persons = ReadPersons(path); });
+  std::size_t read_allocations = allocation_count - before_count;
+  std::size_t read_bytes = allocated_bytes - before_bytes;
+
+  before_count = allocation_count;
+  before_bytes = allocated_bytes;
+  std::vector<Person> mapped_persons;
+  double mapped_ms = MeasureMs([&] {
+    std::shared_ptr<const MappedFile> mapping = MappedFile::Open(path);
+    if (mapping) {
+      mapped_persons = LoadPersons(mapping);
+    }
+  });
+  std::size_t mapped_allocations = allocation_count - before_count;
+  std::size_t mapped_bytes = allocated_bytes - before_bytes;
+
+  std::size_t read_total = 0;
+  std::size_t mapped_total = 0;
+  for (const Person& person : read_persons) {
+    read_total += person.GetName().size();
+  }
+  for (const Person& person : mapped_persons) {
+    mapped_total += person.GetName().size();
+  }
+  if (read_persons.size() != mapped_persons.size() || read_total != mapped_total) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  std::size_t count = read_persons.size();
+  printf("%zu persons, %zu bytes of names\n", count, read_total);
+  LOG_BENCH("std::getline into owning persons", read_ms, count);
+  printf("%-*s => %zu allocations, %10.2f MiB\n", 50, "  heap", read_allocations, read_bytes / 1048576.0);
+  LOG_BENCH("LoadPersons, borrowing from the mapping", mapped_ms, count);
+  printf("%-*s => %zu allocations, %10.2f MiB\n", 50, "  heap", mapped_allocations, mapped_bytes / 1048576.0);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 5'000'000;
+  std::string path;
+  if (argc > 2) {
+    path = argv[2];
+  } else {
+    char generated[] = "/tmp/borrowed_name_XXXXXX";
+    int fd = mkstemp(generated);
+    if (fd == -1) {
+      perror("mkstemp");
+      return 1;
+    }
+    close(fd);
+    path = generated;
+    if (!WriteNames(path.c_str(), count)) {
+      unlink(path.c_str());
+      return 1;
+    }
+  }
+
+  ShowBorrowedName(path.c_str());
+  BenchmarkLoad(path.c_str());
+
+  if (argc <= 2) {
+    unlink(path.c_str());
+  }
+}
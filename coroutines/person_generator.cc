@@ -0,0 +1,344 @@
+/*
+ * Streaming persons with a coroutine generator
+ *
+ * CreatePerson(int) in move_semantics.cc returns one Person per call. A caller
+ * that wants a million of them usually fills a std::vector first, so all of
+ * them, and all of their names, are alive at the same time.
+ *
+ * generator<T> is a C++20 coroutine that produces values on demand:
+ *
+ *  - `co_yield Person{...}` suspends the coroutine with the person still in
+ *    the coroutine frame. The promise only keeps its address.
+ *  - `co_yield person;` on an lvalue cannot hand out the coroutine's own
+ *    person, which it may still use, so the yield copies it once.
+ *  - Dereferencing the iterator gives T&&, so `Person person = *it;` moves the
+ *    person out. Nothing is ever copied.
+ *  - The coroutine frame is allocated through promise_type::operator new,
+ *    which takes it from FrameRecycler, a per-thread free list of frames, and
+ *    gives it back there. Starting a generator in a loop allocates one frame
+ *    in total.
+ *
+ * The benchmark streams persons from a generator and, for comparison, fills a
+ * vector and then consumes it. common/allocation_counter.h tracks the peak
+ * heap usage of each.
+ *
+ * Compile:
+ *
+ * g++ -std=c++20 -O2 -o person_generator.out person_generator.cc
+ *
+ */
+
+#include <string.h>
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../common/allocation_counter.h"
+#include "../common/timer.h"
+
+/*
+ * Keeps freed coroutine frames per thread and hands them out again when a
+ * frame of the same or smaller size is requested.
+ */
+class FrameRecycler {
+public:
+  static void* Allocate(std::size_t size) {
+    FrameRecycler& recycler = Get();
+    FreeFrame** link = &recycler.free_;
+    for (; *link != nullptr; link = &(*link)->next) {
+      if ((*link)->capacity >= size) {
+        FreeFrame* frame = *link;
+        *link = frame->next;
+        ++recycler.reused_;
+        return frame->Memory();
+      }
+    }
+    ++recycler.allocated_;
+    FreeFrame* frame = static_cast<FreeFrame*>(::operator new(sizeof(FreeFrame) + size));
+    frame->capacity = size;
+    return frame->Memory();
+  }
+
+  static void Deallocate(void* memory) {
+    FrameRecycler& recycler = Get();
+    FreeFrame* frame = FreeFrame::Of(memory);
+    frame->next = recycler.free_;
+    recycler.free_ = frame;
+  }
+
+  static std::size_t Allocated() { return Get().allocated_; }
+  static std::size_t Reused() { return Get().reused_; }
+
+  ~FrameRecycler() {
+    while (free_ != nullptr) {
+      FreeFrame* next = free_->next;
+      ::operator delete(free_);
+      free_ = next;
+    }
+  }
+
+private:
+  // Header in front of every frame, so the frame itself stays max-aligned
+  struct alignas(std::max_align_t) FreeFrame {
+    FreeFrame* next;
+    std::size_t capacity;
+    void* Memory() { return this + 1; }
+    static FreeFrame* Of(void* memory) { return static_cast<FreeFrame*>(memory) - 1; }
+  };
+
+  static FrameRecycler& Get() {
+    thread_local FrameRecycler recycler;
+    return recycler;
+  }
+
+  FreeFrame* free_ = nullptr;
+  std::size_t allocated_ = 0;
+  std::size_t reused_ = 0;
+};
+
+template<typename T>
+class generator {
+public:
+  struct promise_type {
+    T* current = nullptr;
+    std::exception_ptr exception;
+
+    generator get_return_object() {
+      return generator{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+
+    // The yielded temporary lives until the coroutine resumes
+    std::suspend_always yield_value(T&& value) noexcept {
+      current = std::addressof(value);
+      return {};
+    }
+
+    // Like the temporary above, the awaiter lives until the coroutine resumes
+    struct CopyAwaiter {
+      T value;
+
+      bool await_ready() const noexcept { return false; }
+      void await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+        handle.promise().current = std::addressof(value);
+      }
+      void await_resume() const noexcept {}
+    };
+
+    CopyAwaiter yield_value(const T& value) noexcept(std::is_nothrow_copy_constructible_v<T>) {
+      return CopyAwaiter{value};
+    }
+
+    void return_void() noexcept {}
+    void unhandled_exception() { exception = std::current_exception(); }
+
+    static void* operator new(std::size_t size) { return FrameRecycler::Allocate(size); }
+    static void operator delete(void* memory) noexcept { FrameRecycler::Deallocate(memory); }
+  };
+
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  class iterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+
+    iterator() = default;
+    explicit iterator(handle_type handle) : handle_{handle} {}
+
+    // Moving out of the result leaves the coroutine's value moved-from
+    T&& operator*() const { return std::move(*handle_.promise().current); }
+
+    iterator& operator++() {
+      Resume(handle_);
+      return *this;
+    }
+    void operator++(int) { ++*this; }
+
+    friend bool operator==(const iterator& it, std::default_sentinel_t) { return it.handle_.done(); }
+
+  private:
+    handle_type handle_;
+  };
+
+  generator(generator&& rhs) noexcept : handle_{std::exchange(rhs.handle_, {})} {}
+  generator& operator=(generator&& rhs) noexcept {
+    std::swap(handle_, rhs.handle_);
+    return *this;
+  }
+  generator(const generator&) = delete;
+  generator& operator=(const generator&) = delete;
+
+  ~generator() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  iterator begin() {
+    Resume(handle_);
+    return iterator{handle_};
+  }
+  std::default_sentinel_t end() { return {}; }
+
+private:
+  explicit generator(handle_type handle) : handle_{handle} {}
+
+  static void Resume(handle_type handle) {
+    handle.resume();
+    if (handle.done() && handle.promise().exception) {
+      std::rethrow_exception(handle.promise().exception);
+    }
+  }
+
+  handle_type handle_;
+};
+
+static std::size_t copy_count = 0;
+static std::size_t move_count = 0;
+
+/*
+ * The Person of move_semantics.cc, counting copies and moves instead of
+ * printing them.
+ */
+class Person{
+
+public:
+  Person(const char* name) : name_{new char[strlen(name) + 1]} {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+
+  ~Person(){
+    delete [] name_;
+  }
+
+  Person(const Person& rhs) : Person(rhs.name_) {
+    ++copy_count;
+  }
+
+  Person& operator=(const Person& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    ++copy_count;
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = new char[name_size];
+    memcpy(new_name, rhs.name_, name_size);
+    delete [] name_;
+    name_ = new_name;
+    return *this;
+  }
+
+  Person(Person&& rhs) noexcept : name_{std::move(rhs.name_)} {
+    rhs.name_ = nullptr;
+    ++move_count;
+  }
+
+  Person& operator=(Person&& rhs) noexcept {
+    if (this != &rhs){
+      ++move_count;
+      delete [] name_;
+      name_ = rhs.name_;
+      rhs.name_ = nullptr;
+    }
+    return *this;
+  }
+
+  const char* GetName() const {
+    return name_;
+  }
+
+private:
+  char* name_;
+};
+
+Person CreatePerson(int rand_number) {
+  if (rand_number == 1) {
+    return Person{"Ser Arthur Dayne, the Sword of the Morning"};
+  }
+  return Person{"Ser Meryn Trant of the Kingsguard"};
+}
+
+generator<Person> CreatePersons(std::size_t count) {
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    co_yield CreatePerson(static_cast<int>(idx % 2));
+  }
+}
+
+generator<Person> RepeatPerson(const char* name, std::size_t count) {
+  Person person{name};
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    co_yield person;
+  }
+}
+
+void ShowGenerator() {
+  copy_count = 0;
+  move_count = 0;
+  for (int round = 0; round < 3; ++round) {
+    for (Person person : CreatePersons(2)) {
+      printf("%-*s => %s\n", 50, "Streamed person", person.GetName());
+    }
+  }
+  printf("%-*s => %zu\n", 50, "Copies", copy_count);
+  printf("%-*s => %zu\n", 50, "Moves", move_count);
+  printf("%-*s => %zu\n", 50, "Coroutine frames allocated", FrameRecycler::Allocated());
+  printf("%-*s => %zu\n", 50, "Coroutine frames reused", FrameRecycler::Reused());
+
+  copy_count = 0;
+  for (Person person : RepeatPerson("Ser Barristan Selmy", 2)) {
+    printf("%-*s => %s\n", 50, "Repeated person", person.GetName());
+  }
+  printf("%-*s => %zu\n\n", 50, "Copies of the yielded lvalue", copy_count);
+}
+
+void BenchmarkStreaming(std::size_t count) {
+  std::size_t vector_total = 0;
+  std::size_t baseline = heap_in_use;
+  heap_peak = heap_in_use;
+  double vector_ms = MeasureMs([&] {
+    std::vector<Person> persons;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      persons.push_back(CreatePerson(static_cast<int>(idx % 2)));
+    }
+    for (const Person& person : persons) {
+      vector_total += strlen(person.GetName());
+    }
+  });
+  std::size_t vector_peak = heap_peak - baseline;
+
+  std::size_t generator_total = 0;
+  baseline = heap_in_use;
+  heap_peak = heap_in_use;
+  copy_count = 0;
+  double generator_ms = MeasureMs([&] {
+    for (Person person : CreatePersons(count)) {
+      generator_total += strlen(person.GetName());
+    }
+  });
+  std::size_t generator_peak = heap_peak - baseline;
+
+  if (vector_total != generator_total || copy_count != 0) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu persons\n", count);
+  LOG_BENCH("fill std::vector, then consume", vector_ms, count);
+  LOG_BENCH("stream from generator<Person>", generator_ms, count);
+  printf("%-*s => %10.2f KiB\n", 50, "peak heap, std::vector", vector_peak / 1024.0);
+  printf("%-*s => %10.2f KiB\n", 50, "peak heap, generator<Person>", generator_peak / 1024.0);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 5'000'000;
+  ShowGenerator();
+  BenchmarkStreaming(count);
+}
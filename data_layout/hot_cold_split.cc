@@ -0,0 +1,251 @@
+/*
+ * Hot/cold field splitting
+ *
+ * Person in value_types.cc mixes a field that every frame touches, hp_, with
+ * fields that are rarely looked at, inv_ref_ and skills_. A std::vector<Person>
+ * stores them interleaved, so a scan over hp_ loads 24 bytes per person to use 8
+ * of them.
+ *
+ * split_table<Hot, Cold> keeps the two groups in separate arrays:
+ *
+ *  - Hot fields are dense, a scan touches nothing else.
+ *  - Cold fields live in a side table at the same index.
+ *  - insert() returns a handle that addresses both halves.
+ *
+ * PersonTable builds on it and hands out PersonRef, a struct of references
+ * named after the members of Person, so `person.hp_ -= 10` reads the same for
+ * both layouts. Accessing a whole record now touches two arrays, which the
+ * benchmark measures as well.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o hot_cold_split.out hot_cold_split.cc
+ *
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+struct Inventory {};
+
+struct Skills {};
+
+struct Person {
+  Person(Inventory& inv_ref) : inv_ref_(inv_ref){}
+  static int total_number_;
+  double hp_;
+  Inventory& inv_ref_;
+  Skills skills_;
+};
+int Person::total_number_ = 1;
+
+/*
+ * Index into both halves of a split_table. The tag keeps handles of different
+ * tables from being mixed up.
+ */
+template<typename Tag>
+struct table_handle {
+  std::uint32_t index;
+  friend bool operator==(table_handle lhs, table_handle rhs) { return lhs.index == rhs.index; }
+  friend bool operator!=(table_handle lhs, table_handle rhs) { return lhs.index != rhs.index; }
+};
+
+template<typename Hot, typename Cold>
+class split_table {
+public:
+  using handle = table_handle<split_table>;
+
+  void reserve(std::size_t capacity) {
+    hot_.reserve(capacity);
+    cold_.reserve(capacity);
+  }
+
+  handle insert(Hot hot, Cold cold) {
+    hot_.push_back(std::move(hot));
+    cold_.push_back(std::move(cold));
+    return handle{static_cast<std::uint32_t>(hot_.size() - 1)};
+  }
+
+  std::size_t size() const { return hot_.size(); }
+
+  Hot& hot(handle id) { return hot_[id.index]; }
+  const Hot& hot(handle id) const { return hot_[id.index]; }
+  Cold& cold(handle id) { return cold_[id.index]; }
+  const Cold& cold(handle id) const { return cold_[id.index]; }
+
+  // Dense hot array for scans
+  Hot* hot_begin() { return hot_.data(); }
+  Hot* hot_end() { return hot_.data() + hot_.size(); }
+  const Hot* hot_begin() const { return hot_.data(); }
+  const Hot* hot_end() const { return hot_.data() + hot_.size(); }
+
+private:
+  std::vector<Hot> hot_;
+  std::vector<Cold> cold_;
+};
+
+struct PersonHot {
+  double hp_;
+};
+
+struct PersonCold {
+  // std::reference_wrapper, so that the side table stays assignable
+  std::reference_wrapper<Inventory> inv_ref_;
+  Skills skills_;
+};
+
+/*
+ * Has the members of Person, as references into the split table.
+ */
+struct PersonRef {
+  double& hp_;
+  Inventory& inv_ref_;
+  Skills& skills_;
+
+  operator Person() const {
+    Person person{inv_ref_};
+    person.hp_ = hp_;
+    person.skills_ = skills_;
+    return person;
+  }
+};
+
+class PersonTable {
+public:
+  using Table = split_table<PersonHot, PersonCold>;
+  using handle = Table::handle;
+
+  void reserve(std::size_t capacity) { table_.reserve(capacity); }
+
+  handle insert(const Person& person) {
+    return table_.insert(PersonHot{person.hp_}, PersonCold{person.inv_ref_, person.skills_});
+  }
+
+  PersonRef operator[](handle id) {
+    PersonCold& cold = table_.cold(id);
+    return PersonRef{table_.hot(id).hp_, cold.inv_ref_.get(), cold.skills_};
+  }
+
+  std::size_t size() const { return table_.size(); }
+
+  template<typename Func>
+  void for_each_hot(Func&& func) {
+    for (PersonHot* hot = table_.hot_begin(); hot != table_.hot_end(); ++hot) {
+      func(*hot);
+    }
+  }
+
+private:
+  Table table_;
+};
+
+static_assert(sizeof(Person) == 24);
+static_assert(sizeof(PersonHot) == 8);
+
+Inventory inv;
+
+void ShowPersonTable() {
+  PersonTable persons;
+  Person stark{inv};
+  stark.hp_ = 100.0;
+  PersonTable::handle ned = persons.insert(stark);
+
+  // Same member names as Person
+  PersonRef person = persons[ned];
+  person.hp_ -= 30.0;
+  printf("%-*s => %f\n", 50, "persons[ned].hp_", persons[ned].hp_);
+  printf("%-*s => %d\n", 50, "persons[ned].inv_ref_ is inv", &persons[ned].inv_ref_ == &inv);
+
+  Person copy = persons[ned];
+  printf("%-*s => %f\n\n", 50, "Person copied out of the table, hp_", copy.hp_);
+}
+
+void BenchmarkLayouts(std::size_t count) {
+  std::mt19937 gen{42};
+  std::uniform_real_distribution<double> hp_dist{0.0, 100.0};
+
+  std::vector<Person> monolithic;
+  PersonTable split;
+  std::vector<PersonTable::handle> handles;
+  monolithic.reserve(count);
+  split.reserve(count);
+  handles.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    Person person{inv};
+    person.hp_ = hp_dist(gen);
+    monolithic.push_back(person);
+    handles.push_back(split.insert(person));
+  }
+
+  // Full records are visited in random order, like lookups by id
+  std::vector<std::uint32_t> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), gen);
+
+  double monolithic_hp = 0.0;
+  double monolithic_scan_ms = MeasureBestMs(5, [&] {
+    double sum = 0.0;
+    for (const Person& person : monolithic) {
+      sum += person.hp_;
+    }
+    DoNotOptimize(sum);
+    monolithic_hp = sum;
+  });
+
+  double split_hp = 0.0;
+  double split_scan_ms = MeasureBestMs(5, [&] {
+    double sum = 0.0;
+    split.for_each_hot([&sum](const PersonHot& hot) { sum += hot.hp_; });
+    DoNotOptimize(sum);
+    split_hp = sum;
+  });
+
+  std::uintptr_t monolithic_record = 0;
+  double monolithic_record_ms = MeasureBestMs(5, [&] {
+    std::uintptr_t checksum = 0;
+    for (std::uint32_t idx : order) {
+      Person& person = monolithic[idx];
+      checksum += static_cast<std::uintptr_t>(person.hp_);
+      checksum += reinterpret_cast<std::uintptr_t>(&person.inv_ref_) & 0xff;
+    }
+    DoNotOptimize(checksum);
+    monolithic_record = checksum;
+  });
+
+  std::uintptr_t split_record = 0;
+  double split_record_ms = MeasureBestMs(5, [&] {
+    std::uintptr_t checksum = 0;
+    for (std::uint32_t idx : order) {
+      PersonRef person = split[handles[idx]];
+      checksum += static_cast<std::uintptr_t>(person.hp_);
+      checksum += reinterpret_cast<std::uintptr_t>(&person.inv_ref_) & 0xff;
+    }
+    DoNotOptimize(checksum);
+    split_record = checksum;
+  });
+
+  if (monolithic_hp != split_hp || monolithic_record != split_record) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu persons, %zu bytes per Person, %zu hot bytes\n", count, sizeof(Person), sizeof(PersonHot));
+  LOG_BENCH("hp_ scan, std::vector<Person>", monolithic_scan_ms, count);
+  LOG_BENCH("hp_ scan, PersonTable", split_scan_ms, count);
+  LOG_BENCH("random full record access, std::vector<Person>", monolithic_record_ms, count);
+  LOG_BENCH("random full record access, PersonTable", split_record_ms, count);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+  ShowPersonTable();
+  BenchmarkLayouts(count);
+}
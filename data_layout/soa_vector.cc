@@ -0,0 +1,311 @@
+/*
+ * Array of structs to struct of arrays for aggregate types
+ *
+ * std::vector<AggregatePerson> stores id_ and weight_ interleaved (array of
+ * structs, AoS). A scan that only reads weight_ still drags every id_ through
+ * the cache, and the compiler has to vectorize over a strided layout.
+ *
+ * soa_vector<T> stores every field of an aggregate T in its own std::vector
+ * (struct of arrays, SoA). Aggregates can be decomposed with structured
+ * bindings, so the fields are discovered at compile time without any
+ * per-type registration:
+ *
+ *  - field_count<T> counts the members by trying aggregate initialization
+ *    with a growing number of arguments.
+ *  - AsTuple() binds the members with `auto& [a, b, ...] = value;` and returns
+ *    them as a tuple of references.
+ *
+ * soa[i] returns a proxy reference with get<I>(), assignment from T and
+ * conversion to T for AoS-style code. column<I>() returns a contiguous view of
+ * one field for loops that the compiler can vectorize.
+ *
+ * Compile (C++17, AggregatePerson is not an aggregate in C++20):
+ *
+ * g++ -std=c++17 -O3 -march=native -ffast-math -o soa_vector.out soa_vector.cc
+ *
+ * -ffast-math lets the compiler reorder the float additions, without it neither
+ * layout's sum gets vectorized.
+ *
+ */
+
+#include <stdio.h>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+struct AggregatePerson {
+  int id_;
+  float weight_;
+  AggregatePerson() = default;
+};
+
+// Converts to anything, used to probe how many initializers T accepts
+struct AnyField {
+  template<typename T>
+  operator T() const;
+};
+
+template<typename T, typename Indices, typename = void>
+struct is_initializable_with : std::false_type {};
+
+template<typename T, std::size_t... I>
+struct is_initializable_with<T, std::index_sequence<I...>,
+    std::void_t<decltype(T{(void(I), AnyField{})...})>> : std::true_type {};
+
+template<typename T, std::size_t N = 0>
+constexpr std::size_t CountFields() {
+  if constexpr (is_initializable_with<T, std::make_index_sequence<N + 1>>::value) {
+    return CountFields<T, N + 1>();
+  } else {
+    return N;
+  }
+}
+
+template<typename T>
+constexpr std::size_t field_count = CountFields<T>();
+
+/*
+ * Structured bindings need the number of names spelled out, so every
+ * supported field count has its own branch.
+ */
+template<typename T>
+auto AsTuple(T& value) {
+  constexpr std::size_t count = field_count<std::remove_const_t<T>>;
+  static_assert(count >= 1 && count <= 6, "AsTuple supports aggregates with 1 to 6 fields");
+  if constexpr (count == 1) {
+    auto& [f1] = value;
+    return std::tie(f1);
+  } else if constexpr (count == 2) {
+    auto& [f1, f2] = value;
+    return std::tie(f1, f2);
+  } else if constexpr (count == 3) {
+    auto& [f1, f2, f3] = value;
+    return std::tie(f1, f2, f3);
+  } else if constexpr (count == 4) {
+    auto& [f1, f2, f3, f4] = value;
+    return std::tie(f1, f2, f3, f4);
+  } else if constexpr (count == 5) {
+    auto& [f1, f2, f3, f4, f5] = value;
+    return std::tie(f1, f2, f3, f4, f5);
+  } else {
+    auto& [f1, f2, f3, f4, f5, f6] = value;
+    return std::tie(f1, f2, f3, f4, f5, f6);
+  }
+}
+
+/*
+ * Contiguous view over one column.
+ */
+template<typename Field>
+class column_view {
+public:
+  column_view(Field* data, std::size_t size) : data_{data}, size_{size} {}
+  Field* data() const { return data_; }
+  std::size_t size() const { return size_; }
+  Field* begin() const { return data_; }
+  Field* end() const { return data_ + size_; }
+  Field& operator[](std::size_t idx) const { return data_[idx]; }
+private:
+  Field* data_;
+  std::size_t size_;
+};
+
+template<typename T>
+class soa_vector {
+  static_assert(std::is_aggregate_v<T>, "soa_vector requires an aggregate type");
+
+  template<typename Tuple>
+  struct ColumnsOf;
+  template<typename... Fields>
+  struct ColumnsOf<std::tuple<Fields&...>> {
+    using type = std::tuple<std::vector<Fields>...>;
+  };
+
+  using Columns = typename ColumnsOf<decltype(AsTuple(std::declval<T&>()))>::type;
+  static constexpr std::size_t kFieldCount = field_count<T>;
+
+public:
+  template<std::size_t I>
+  using field_type = typename std::tuple_element_t<I, Columns>::value_type;
+
+  /*
+   * Behaves like T& for reads and whole-object writes. Fields are reached with
+   * get<I>() since member names are not available on the proxy.
+   */
+  template<bool IsConst>
+  class basic_reference {
+  public:
+    using Owner = std::conditional_t<IsConst, const soa_vector, soa_vector>;
+    basic_reference(Owner& owner, std::size_t idx) : owner_{owner}, idx_{idx} {}
+
+    template<std::size_t I>
+    decltype(auto) get() const {
+      return std::get<I>(owner_.columns_)[idx_];
+    }
+
+    template<bool Enabled = !IsConst, typename = std::enable_if_t<Enabled>>
+    const basic_reference& operator=(const T& value) const {
+      owner_.Store(idx_, value, std::make_index_sequence<kFieldCount>{});
+      return *this;
+    }
+
+    operator T() const {
+      return owner_.Load(idx_, std::make_index_sequence<kFieldCount>{});
+    }
+
+  private:
+    Owner& owner_;
+    std::size_t idx_;
+  };
+
+  using reference = basic_reference<false>;
+  using const_reference = basic_reference<true>;
+
+  void reserve(std::size_t capacity) {
+    std::apply([capacity](auto&... column) { (column.reserve(capacity), ...); }, columns_);
+  }
+
+  void push_back(const T& value) {
+    PushBack(value, std::make_index_sequence<kFieldCount>{});
+  }
+
+  std::size_t size() const { return std::get<0>(columns_).size(); }
+
+  reference operator[](std::size_t idx) { return reference{*this, idx}; }
+  const_reference operator[](std::size_t idx) const { return const_reference{*this, idx}; }
+
+  template<std::size_t I>
+  column_view<field_type<I>> column() {
+    auto& column = std::get<I>(columns_);
+    return {column.data(), column.size()};
+  }
+
+  template<std::size_t I>
+  column_view<const field_type<I>> column() const {
+    const auto& column = std::get<I>(columns_);
+    return {column.data(), column.size()};
+  }
+
+private:
+  template<std::size_t... I>
+  void PushBack(const T& value, std::index_sequence<I...>) {
+    auto fields = AsTuple(value);
+    (std::get<I>(columns_).push_back(std::get<I>(fields)), ...);
+  }
+
+  template<std::size_t... I>
+  void Store(std::size_t idx, const T& value, std::index_sequence<I...>) {
+    auto fields = AsTuple(value);
+    ((std::get<I>(columns_)[idx] = std::get<I>(fields)), ...);
+  }
+
+  template<std::size_t... I>
+  T Load(std::size_t idx, std::index_sequence<I...>) const {
+    return T{std::get<I>(columns_)[idx]...};
+  }
+
+  Columns columns_;
+};
+
+static_assert(field_count<AggregatePerson> == 2);
+static_assert(std::is_same_v<soa_vector<AggregatePerson>::field_type<1>, float>);
+
+void ShowSoaVector() {
+  soa_vector<AggregatePerson> persons;
+  persons.push_back(AggregatePerson{1, 72.5f});
+  persons.push_back(AggregatePerson{2, 81.0f});
+
+  // AoS-style access through the proxy
+  persons[1] = AggregatePerson{3, 90.0f};
+  AggregatePerson copy = persons[1];
+  printf("%-*s => %d - %f\n", 50, "persons[1]", copy.id_, copy.weight_);
+
+  // Field-wise access, the weights are contiguous
+  auto weights = persons.column<1>();
+  printf("%-*s => %p\n", 50, "Address of weight column[0]", (void*)&weights[0]);
+  printf("%-*s => %p\n\n", 50, "Address of weight column[1]", (void*)&weights[1]);
+}
+
+void BenchmarkScan(std::size_t count) {
+  std::mt19937 gen{42};
+  std::uniform_int_distribution<int> id_dist{0, 1000};
+  std::uniform_real_distribution<float> weight_dist{40.0f, 120.0f};
+
+  std::vector<AggregatePerson> aos_persons;
+  soa_vector<AggregatePerson> soa_persons;
+  aos_persons.reserve(count);
+  soa_persons.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    AggregatePerson person{id_dist(gen), weight_dist(gen)};
+    aos_persons.push_back(person);
+    soa_persons.push_back(person);
+  }
+
+  constexpr int k = 500;
+
+  float aos_sum = 0.0f;
+  double aos_ms = MeasureBestMs(5, [&] {
+    float sum = 0.0f;
+    for (const auto& person : aos_persons) {
+      sum += person.id_ > k ? person.weight_ : 0.0f;
+    }
+    DoNotOptimize(sum);
+    aos_sum = sum;
+  });
+
+  float soa_sum = 0.0f;
+  double soa_ms = MeasureBestMs(5, [&] {
+    auto ids = soa_persons.column<0>();
+    auto weights = soa_persons.column<1>();
+    float sum = 0.0f;
+    for (std::size_t idx = 0; idx < ids.size(); ++idx) {
+      sum += ids[idx] > k ? weights[idx] : 0.0f;
+    }
+    DoNotOptimize(sum);
+    soa_sum = sum;
+  });
+
+  float aos_total = 0.0f;
+  double aos_total_ms = MeasureBestMs(5, [&] {
+    float sum = 0.0f;
+    for (const auto& person : aos_persons) {
+      sum += person.weight_;
+    }
+    DoNotOptimize(sum);
+    aos_total = sum;
+  });
+
+  float soa_total = 0.0f;
+  double soa_total_ms = MeasureBestMs(5, [&] {
+    float sum = 0.0f;
+    for (float weight : soa_persons.column<1>()) {
+      sum += weight;
+    }
+    DoNotOptimize(sum);
+    soa_total = sum;
+  });
+
+  // -ffast-math may sum in a different order for each layout
+  if (std::fabs(aos_sum - soa_sum) > 1e-3f * std::fabs(aos_sum) ||
+      std::fabs(aos_total - soa_total) > 1e-3f * std::fabs(aos_total)) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("Scanning %zu persons\n", count);
+  LOG_BENCH("sum of weight_ where id_ > k, std::vector", aos_ms, count);
+  LOG_BENCH("sum of weight_ where id_ > k, soa_vector", soa_ms, count);
+  LOG_BENCH("sum of weight_, std::vector", aos_total_ms, count);
+  LOG_BENCH("sum of weight_, soa_vector", soa_total_ms, count);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+  ShowSoaVector();
+  BenchmarkScan(count);
+}
@@ -0,0 +1,315 @@
+/*
+ * Expression templates for PersonInventory values
+ *
+ * Writing inventory arithmetic with operators on std::vector<float>,
+ *
+ *   total = (swords + shields) * 0.9f - daggers * 0.05f;
+ *
+ * creates a temporary vector for every operator: (swords + shields), its
+ * product with 0.9f, daggers * 0.05f and the difference. Each one is an
+ * allocation and a full pass over memory, and only the last is kept.
+ *
+ * With expression templates the operators build no vectors at all. They
+ * return small objects that describe the computation:
+ *
+ *  - ValueExpr<E> is the CRTP base of everything that has a size() and an
+ *    operator[], InventoryValues being the only one that stores floats.
+ *  - BinaryExpr<L, R, Op> and ScalarExpr<E, Op> hold their operands and
+ *    compute element idx on demand. Expressions are held by value, they are
+ *    a few pointers and floats. InventoryValues is held by reference.
+ *  - Assigning an expression to InventoryValues runs one loop that asks the
+ *    whole tree for element idx. Every operator[] is inlined, so the loop body
+ *    is the arithmetic of the full expression, which the compiler vectorizes.
+ *
+ * Operands of one expression must have the same size. The result may be one
+ * of the operands, every element only depends on the operands at its index.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O3 -march=native -o inventory_expressions.out inventory_expressions.cc
+ *
+ */
+
+#include <stdio.h>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <initializer_list>
+#include <new>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../common/allocation_counter.h"
+#include "../common/timer.h"
+
+template<typename E>
+struct ValueExpr {
+  const E& Self() const { return static_cast<const E&>(*this); }
+};
+
+class InventoryValues : public ValueExpr<InventoryValues> {
+public:
+  InventoryValues() = default;
+  InventoryValues(std::initializer_list<float> values) : values_{values} {}
+  explicit InventoryValues(std::vector<float> values) : values_{std::move(values)} {}
+
+  // Evaluates the whole expression in one loop
+  template<typename E>
+  InventoryValues(const ValueExpr<E>& expr) {
+    Assign(expr.Self());
+  }
+
+  template<typename E>
+  InventoryValues& operator=(const ValueExpr<E>& expr) {
+    Assign(expr.Self());
+    return *this;
+  }
+
+  float operator[](std::size_t idx) const { return values_[idx]; }
+  std::size_t size() const { return values_.size(); }
+  const std::vector<float>& Values() const { return values_; }
+
+private:
+  template<typename E>
+  void Assign(const E& expr) {
+    std::size_t size = expr.size();
+    values_.resize(size);
+    float* out = values_.data();
+    for (std::size_t idx = 0; idx < size; ++idx) {
+      out[idx] = expr[idx];
+    }
+  }
+
+  std::vector<float> values_;
+};
+
+// InventoryValues is referenced, expression nodes are copied
+template<typename E>
+using ExprOperand = std::conditional_t<std::is_same_v<E, InventoryValues>, const InventoryValues&, E>;
+
+template<typename L, typename R, typename Op>
+class BinaryExpr : public ValueExpr<BinaryExpr<L, R, Op>> {
+public:
+  BinaryExpr(const L& lhs, const R& rhs) : lhs_{lhs}, rhs_{rhs} {}
+  float operator[](std::size_t idx) const { return Op::Apply(lhs_[idx], rhs_[idx]); }
+  std::size_t size() const { return lhs_.size(); }
+private:
+  ExprOperand<L> lhs_;
+  ExprOperand<R> rhs_;
+};
+
+template<typename E, typename Op>
+class ScalarExpr : public ValueExpr<ScalarExpr<E, Op>> {
+public:
+  ScalarExpr(const E& expr, float scalar) : expr_{expr}, scalar_{scalar} {}
+  float operator[](std::size_t idx) const { return Op::Apply(expr_[idx], scalar_); }
+  std::size_t size() const { return expr_.size(); }
+private:
+  ExprOperand<E> expr_;
+  float scalar_;
+};
+
+struct AddOp { static float Apply(float lhs, float rhs) { return lhs + rhs; } };
+struct SubOp { static float Apply(float lhs, float rhs) { return lhs - rhs; } };
+struct MulOp { static float Apply(float lhs, float rhs) { return lhs * rhs; } };
+struct MinOp { static float Apply(float lhs, float rhs) { return lhs < rhs ? lhs : rhs; } };
+
+template<typename L, typename R>
+BinaryExpr<L, R, AddOp> operator+(const ValueExpr<L>& lhs, const ValueExpr<R>& rhs) {
+  return {lhs.Self(), rhs.Self()};
+}
+
+template<typename L, typename R>
+BinaryExpr<L, R, SubOp> operator-(const ValueExpr<L>& lhs, const ValueExpr<R>& rhs) {
+  return {lhs.Self(), rhs.Self()};
+}
+
+template<typename L, typename R>
+BinaryExpr<L, R, MulOp> operator*(const ValueExpr<L>& lhs, const ValueExpr<R>& rhs) {
+  return {lhs.Self(), rhs.Self()};
+}
+
+template<typename E>
+ScalarExpr<E, AddOp> operator+(const ValueExpr<E>& expr, float scalar) {
+  return {expr.Self(), scalar};
+}
+
+template<typename E>
+ScalarExpr<E, SubOp> operator-(const ValueExpr<E>& expr, float scalar) {
+  return {expr.Self(), scalar};
+}
+
+template<typename E>
+ScalarExpr<E, MulOp> operator*(const ValueExpr<E>& expr, float scalar) {
+  return {expr.Self(), scalar};
+}
+
+template<typename E>
+ScalarExpr<E, MulOp> operator*(float scalar, const ValueExpr<E>& expr) {
+  return {expr.Self(), scalar};
+}
+
+// Caps every value at `limit`
+template<typename E>
+ScalarExpr<E, MinOp> Min(const ValueExpr<E>& expr, float limit) {
+  return {expr.Self(), limit};
+}
+
+/*
+ * PersonInventory of perfect_forwarding_constructor_better.cc with its
+ * values as InventoryValues and without the prints.
+ */
+class PersonInventory {
+public:
+  PersonInventory(InventoryValues values, std::vector<std::string> items)
+    : values_{std::move(values)}, items_{std::move(items)} {}
+  InventoryValues& Values() { return values_; }
+  const InventoryValues& Values() const { return values_; }
+  const std::vector<std::string>& Items() const { return items_; }
+private:
+  InventoryValues values_;
+  std::vector<std::string> items_;
+};
+
+/*
+ * What the expression templates replace: every operator returns a new vector.
+ */
+namespace eager {
+
+template<typename Op>
+std::vector<float> Apply(const std::vector<float>& lhs, const std::vector<float>& rhs) {
+  std::vector<float> result(lhs.size());
+  for (std::size_t idx = 0; idx < lhs.size(); ++idx) {
+    result[idx] = Op::Apply(lhs[idx], rhs[idx]);
+  }
+  return result;
+}
+
+template<typename Op>
+std::vector<float> Apply(const std::vector<float>& values, float scalar) {
+  std::vector<float> result(values.size());
+  for (std::size_t idx = 0; idx < values.size(); ++idx) {
+    result[idx] = Op::Apply(values[idx], scalar);
+  }
+  return result;
+}
+
+std::vector<float> operator+(const std::vector<float>& lhs, const std::vector<float>& rhs) { return Apply<AddOp>(lhs, rhs); }
+std::vector<float> operator-(const std::vector<float>& lhs, const std::vector<float>& rhs) { return Apply<SubOp>(lhs, rhs); }
+std::vector<float> operator*(const std::vector<float>& values, float scalar) { return Apply<MulOp>(values, scalar); }
+std::vector<float> Min(const std::vector<float>& values, float limit) { return Apply<MinOp>(values, limit); }
+
+}  // namespace eager
+
+void PrintValues(const char* label, const InventoryValues& values) {
+  std::string text;
+  for (float value : values.Values()) {
+    text += std::to_string(value).substr(0, 5) + " ";
+  }
+  printf("%-*s => %s\n", 50, label, text.c_str());
+}
+
+void ShowExpressions() {
+  PersonInventory arthur{{5.5f, 3.5f, 2.5f}, {"Dawn", "Shield", "Dagger"}};
+  PersonInventory meryn{{4.0f, 3.0f, 1.0f}, {"Sword", "Shield", "Dagger"}};
+
+  // The type of a lazy expression, nothing has been computed yet
+  auto discounted = arthur.Values() * 0.8f;
+  PrintValues("arthur * 0.8", discounted);
+
+  std::size_t before = allocation_count;
+  InventoryValues combined = Min((arthur.Values() + meryn.Values()) * 1.1f, 8.0f) - meryn.Values() * 0.5f;
+  std::size_t allocations = allocation_count - before;
+  PrintValues("min((arthur + meryn) * 1.1, 8) - meryn * 0.5", combined);
+  printf("%-*s => %zu\n", 50, "Allocations for the whole expression", allocations);
+
+  // In place, the only buffer written is arthur's own
+  before = allocation_count;
+  arthur.Values() = arthur.Values() * 0.9f + 0.25f;
+  allocations = allocation_count - before;
+  PrintValues("arthur = arthur * 0.9 + 0.25", arthur.Values());
+  printf("%-*s => %zu\n\n", 50, "Allocations for the in-place update", allocations);
+}
+
+bool NearlyEqual(const std::vector<float>& lhs, const std::vector<float>& rhs) {
+  if (lhs.size() != rhs.size()) {
+    return false;
+  }
+  for (std::size_t idx = 0; idx < lhs.size(); ++idx) {
+    // The fused loop may contract a multiply and add into one FMA
+    if (std::fabs(lhs[idx] - rhs[idx]) > 1e-4f * std::fabs(rhs[idx]) + 1e-6f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void BenchmarkExpressions(std::size_t count) {
+  std::mt19937 gen{42};
+  std::uniform_real_distribution<float> value_dist{0.0f, 6.0f};
+  std::vector<float> swords(count);
+  std::vector<float> shields(count);
+  std::vector<float> daggers(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    swords[idx] = value_dist(gen);
+    shields[idx] = value_dist(gen);
+    daggers[idx] = value_dist(gen);
+  }
+  InventoryValues lazy_swords{swords};
+  InventoryValues lazy_shields{shields};
+  InventoryValues lazy_daggers{daggers};
+
+  std::vector<float> eager_total(count);
+  InventoryValues lazy_total{std::vector<float>(count)};
+
+  std::size_t before = allocation_count;
+  double eager_short_ms = MeasureBestMs(5, [&] {
+    using namespace eager;
+    eager_total = (swords + shields) * 0.9f - daggers * 0.05f;
+  });
+  std::size_t eager_short_allocations = (allocation_count - before) / 5;
+  before = allocation_count;
+  double lazy_short_ms = MeasureBestMs(5, [&] {
+    lazy_total = (lazy_swords + lazy_shields) * 0.9f - lazy_daggers * 0.05f;
+  });
+  std::size_t lazy_short_allocations = (allocation_count - before) / 5;
+  if (!NearlyEqual(lazy_total.Values(), eager_total)) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  before = allocation_count;
+  double eager_long_ms = MeasureBestMs(5, [&] {
+    using namespace eager;
+    eager_total = Min((swords + shields + daggers) * 1.1f, 12.0f) - (shields - daggers) * 0.5f + swords * 0.2f;
+  });
+  std::size_t eager_long_allocations = (allocation_count - before) / 5;
+  before = allocation_count;
+  double lazy_long_ms = MeasureBestMs(5, [&] {
+    lazy_total = Min((lazy_swords + lazy_shields + lazy_daggers) * 1.1f, 12.0f)
+                 - (lazy_shields - lazy_daggers) * 0.5f + lazy_swords * 0.2f;
+  });
+  std::size_t lazy_long_allocations = (allocation_count - before) / 5;
+  if (!NearlyEqual(lazy_total.Values(), eager_total)) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu values per inventory\n", count);
+  LOG_BENCH("(a + b) * s - c * s, eager vectors", eager_short_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", eager_short_allocations);
+  LOG_BENCH("(a + b) * s - c * s, expression template", lazy_short_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", lazy_short_allocations);
+  LOG_BENCH("9 operator chain, eager vectors", eager_long_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", eager_long_allocations);
+  LOG_BENCH("9 operator chain, expression template", lazy_long_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", lazy_long_allocations);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4'000'000;
+  ShowExpressions();
+  BenchmarkExpressions(count);
+}
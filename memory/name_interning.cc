@@ -0,0 +1,409 @@
+/*
+ * Interned names
+ *
+ * CreatePerson in move_semantics.cc gives thousands of persons the name
+ * "Meryn Trant", and each of them owns a separate copy of the same 12 bytes.
+ * InternPool keeps one immutable, reference counted buffer per distinct name:
+ *
+ *  - The pool is split into shards by name hash, each guarded by its own
+ *    std::shared_mutex. Interning a name that is already present takes the
+ *    shared lock only, so threads interning popular names do not serialize.
+ *  - InternedName is a handle to an entry. Copying it bumps the reference
+ *    count, comparing two of them compares pointers.
+ *  - Dropping the last handle does not free the entry, Reclaim() sweeps the
+ *    shards and frees entries nobody refers to. Entries are freed only under
+ *    the exclusive lock, so a lookup can revive an entry whose count dropped
+ *    to zero without racing with its deallocation.
+ *
+ * InternedPerson stores an InternedName instead of a char*. Constructing it
+ * from a string hashes the name and, if the name is present, only bumps a
+ * counter. Constructing, copying and comparing from an InternedName are O(1).
+ *
+ * The benchmark builds persons from name lists with different duplication
+ * ratios and reports construction throughput and heap in use, measured with
+ * mallinfo2().
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -pthread -o name_interning.out name_interning.cc
+ *
+ */
+
+#include <malloc.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+class InternPool;
+
+/*
+ * One allocation per distinct name, the bytes follow the header.
+ */
+struct InternEntry {
+  std::atomic<std::uint32_t> refs;
+  std::uint32_t size;
+  char data[1];
+
+  std::string_view View() const { return {data, size}; }
+};
+
+class InternedName {
+public:
+  InternedName() = default;
+  explicit InternedName(InternEntry* entry) : entry_{entry} {}
+
+  InternedName(const InternedName& rhs) : entry_{rhs.entry_} {
+    if (entry_ != nullptr) {
+      entry_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  InternedName& operator=(const InternedName& rhs) {
+    InternedName copy{rhs};
+    std::swap(entry_, copy.entry_);
+    return *this;
+  }
+
+  InternedName(InternedName&& rhs) noexcept : entry_{rhs.entry_} {
+    rhs.entry_ = nullptr;
+  }
+
+  InternedName& operator=(InternedName&& rhs) noexcept {
+    std::swap(entry_, rhs.entry_);
+    return *this;
+  }
+
+  ~InternedName() {
+    if (entry_ != nullptr) {
+      entry_->refs.fetch_sub(1, std::memory_order_release);
+    }
+  }
+
+  const char* c_str() const { return entry_ != nullptr ? entry_->data : ""; }
+  std::string_view view() const { return entry_ != nullptr ? entry_->View() : std::string_view{}; }
+
+  friend bool operator==(const InternedName& lhs, const InternedName& rhs) { return lhs.entry_ == rhs.entry_; }
+  friend bool operator!=(const InternedName& lhs, const InternedName& rhs) { return lhs.entry_ != rhs.entry_; }
+
+private:
+  InternEntry* entry_ = nullptr;
+};
+
+class InternPool {
+public:
+  static constexpr std::size_t kShards = 16;
+
+  InternPool() = default;
+  InternPool(const InternPool&) = delete;
+  InternPool& operator=(const InternPool&) = delete;
+
+  // Every handle must be gone by now
+  ~InternPool() {
+    for (Shard& shard : shards_) {
+      for (auto& [name, entry] : shard.entries) {
+        FreeEntry(entry);
+      }
+    }
+  }
+
+  InternedName Intern(std::string_view name) {
+    const std::size_t hash = std::hash<std::string_view>{}(name);
+    Shard& shard = shards_[hash % kShards];
+    {
+      std::shared_lock<std::shared_mutex> lock{shard.mutex};
+      auto it = shard.entries.find(name);
+      if (it != shard.entries.end()) {
+        return Acquire(it->second);
+      }
+    }
+    std::unique_lock<std::shared_mutex> lock{shard.mutex};
+    // Another thread may have inserted it in between
+    auto it = shard.entries.find(name);
+    if (it != shard.entries.end()) {
+      return Acquire(it->second);
+    }
+    InternEntry* entry = NewEntry(name);
+    shard.entries.emplace(entry->View(), entry);
+    return InternedName{entry};
+  }
+
+  // Frees entries without handles, returns how many were freed
+  std::size_t Reclaim() {
+    std::size_t freed = 0;
+    for (Shard& shard : shards_) {
+      std::unique_lock<std::shared_mutex> lock{shard.mutex};
+      for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+        if (it->second->refs.load(std::memory_order_acquire) == 0) {
+          InternEntry* entry = it->second;
+          it = shard.entries.erase(it);
+          FreeEntry(entry);
+          ++freed;
+        } else {
+          ++it;
+        }
+      }
+    }
+    return freed;
+  }
+
+  std::size_t size() {
+    std::size_t total = 0;
+    for (Shard& shard : shards_) {
+      std::shared_lock<std::shared_mutex> lock{shard.mutex};
+      total += shard.entries.size();
+    }
+    return total;
+  }
+
+private:
+  // Separate cache lines, so that shards do not contend through their locks
+  struct alignas(64) Shard {
+    std::shared_mutex mutex;
+    std::unordered_map<std::string_view, InternEntry*> entries;
+  };
+
+  static InternedName Acquire(InternEntry* entry) {
+    entry->refs.fetch_add(1, std::memory_order_relaxed);
+    return InternedName{entry};
+  }
+
+  static InternEntry* NewEntry(std::string_view name) {
+    void* memory = ::operator new(offsetof(InternEntry, data) + name.size() + 1);
+    InternEntry* entry = ::new (memory) InternEntry;
+    entry->refs.store(1, std::memory_order_relaxed);
+    entry->size = static_cast<std::uint32_t>(name.size());
+    memcpy(entry->data, name.data(), name.size());
+    entry->data[name.size()] = '\0';
+    return entry;
+  }
+
+  static void FreeEntry(InternEntry* entry) {
+    entry->~InternEntry();
+    ::operator delete(entry);
+  }
+
+  Shard shards_[kShards];
+};
+
+InternPool& GetNamePool() {
+  static InternPool pool;
+  return pool;
+}
+
+/*
+ * The Person of move_semantics.cc without the prints.
+ */
+class Person{
+
+public:
+  Person(const char* name) : name_{new char[strlen(name) + 1]} {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+
+  ~Person(){
+    delete [] name_;
+  }
+
+  Person(const Person& rhs) : Person(rhs.name_) {}
+
+  Person& operator=(const Person& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = new char[name_size];
+    memcpy(new_name, rhs.name_, name_size);
+    delete [] name_;
+    name_ = new_name;
+    return *this;
+  }
+
+  Person(Person&& rhs) noexcept : name_{std::move(rhs.name_)} {
+    rhs.name_ = nullptr;
+  }
+
+  Person& operator=(Person&& rhs) noexcept {
+    if (this != &rhs){
+      delete [] name_;
+      name_ = rhs.name_;
+      rhs.name_ = nullptr;
+    }
+    return *this;
+  }
+
+  const char* GetName() const {
+    return name_;
+  }
+
+private:
+  char* name_;
+};
+
+/*
+ * Same interface, but the name is shared with every other person of that
+ * name. The implicit copy and move operations do the right thing.
+ */
+class InternedPerson{
+
+public:
+  InternedPerson(const char* name) : name_{GetNamePool().Intern(name)} {}
+  InternedPerson(InternedName name) : name_{std::move(name)} {}
+
+  const char* GetName() const {
+    return name_.c_str();
+  }
+
+  bool HasSameName(const InternedPerson& rhs) const {
+    return name_ == rhs.name_;
+  }
+
+private:
+  InternedName name_;
+};
+
+void ShowInternedPerson() {
+  InternedPerson first_kingsguard{"Meryn Trant"};
+  InternedPerson second_kingsguard{"Meryn Trant"};
+  InternedPerson copy_kingsguard{first_kingsguard};
+  printf("%-*s => %p\n", 50, "Address of first_kingsguard's name", (void*)first_kingsguard.GetName());
+  printf("%-*s => %p\n", 50, "Address of second_kingsguard's name", (void*)second_kingsguard.GetName());
+  printf("%-*s => %p\n", 50, "Address of copy_kingsguard's name", (void*)copy_kingsguard.GetName());
+  printf("%-*s => %d\n", 50, "Same name, compared by pointer", first_kingsguard.HasSameName(second_kingsguard));
+
+  {
+    InternedPerson passing_through{"Jaqen H'ghar"};
+  }
+  printf("%-*s => %zu\n", 50, "Names in the pool", GetNamePool().size());
+  printf("%-*s => %zu\n", 50, "Unused names reclaimed", GetNamePool().Reclaim());
+  printf("%-*s => %zu\n\n", 50, "Names in the pool after reclaim", GetNamePool().size());
+}
+
+std::size_t HeapInUse() {
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+/*
+ * `distinct` names, repeated round robin up to `count`. Long enough that
+ * std::string would not keep them inline either.
+ */
+std::vector<std::string> MakeNames(std::size_t count, std::size_t distinct) {
+  std::vector<std::string> names;
+  names.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    names.push_back("Ser Meryn Trant of the Kingsguard #" + std::to_string(idx % distinct));
+  }
+  return names;
+}
+
+template<typename P>
+std::size_t CountSameNames(const std::vector<P>& persons) {
+  std::size_t same = 0;
+  for (std::size_t idx = 1; idx < persons.size(); ++idx) {
+    if constexpr (std::is_same_v<P, InternedPerson>) {
+      same += persons[idx].HasSameName(persons[0]);
+    } else {
+      same += strcmp(persons[idx].GetName(), persons[0].GetName()) == 0;
+    }
+  }
+  return same;
+}
+
+/*
+ * Builds the persons from `threads` threads, each taking a contiguous part of
+ * the names, and returns the time and heap growth.
+ */
+template<typename P>
+void BuildPersons(const std::vector<std::string>& names, int threads,
+                  std::vector<P>& persons, double& ms, std::size_t& heap_bytes) {
+  persons.clear();
+  persons.reserve(names.size());
+  std::vector<std::vector<P>> parts(static_cast<std::size_t>(threads));
+  std::size_t heap_before = HeapInUse();
+  ms = MeasureMs([&] {
+    std::vector<std::thread> workers;
+    const std::size_t per_thread = (names.size() + static_cast<std::size_t>(threads) - 1) / static_cast<std::size_t>(threads);
+    for (int thread = 0; thread < threads; ++thread) {
+      workers.emplace_back([&, thread] {
+        auto& part = parts[static_cast<std::size_t>(thread)];
+        const std::size_t first = static_cast<std::size_t>(thread) * per_thread;
+        const std::size_t last = std::min(first + per_thread, names.size());
+        part.reserve(last > first ? last - first : 0);
+        for (std::size_t idx = first; idx < last; ++idx) {
+          part.emplace_back(names[idx].c_str());
+        }
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  });
+  for (auto& part : parts) {
+    for (auto& person : part) {
+      persons.push_back(std::move(person));
+    }
+    std::vector<P>{}.swap(part);
+  }
+  heap_bytes = HeapInUse() - heap_before;
+}
+
+void BenchmarkDuplication(std::size_t count, int threads) {
+  printf("%zu persons, %d threads\n", count, threads);
+  for (std::size_t requested : {count, count / 10, count / 1000, std::size_t{1}}) {
+    // Small counts would otherwise ask for zero distinct names
+    std::size_t distinct = std::max<std::size_t>(1, requested);
+    std::vector<std::string> names = MakeNames(count, distinct);
+
+    std::vector<Person> persons;
+    double person_ms = 0.0;
+    std::size_t person_bytes = 0;
+    BuildPersons(names, threads, persons, person_ms, person_bytes);
+
+    std::vector<InternedPerson> interned;
+    double interned_ms = 0.0;
+    std::size_t interned_bytes = 0;
+    BuildPersons(names, threads, interned, interned_ms, interned_bytes);
+
+    std::size_t person_same = 0;
+    std::size_t interned_same = 0;
+    double person_compare_ms = MeasureBestMs(3, [&] { person_same = CountSameNames(persons); DoNotOptimize(person_same); });
+    double interned_compare_ms = MeasureBestMs(3, [&] { interned_same = CountSameNames(interned); DoNotOptimize(interned_same); });
+    if (person_same != interned_same) {
+      printf("Results differ!\n");
+      std::exit(1);
+    }
+
+    printf("%zu distinct names\n", distinct);
+    LOG_BENCH("  construct Person", person_ms, count);
+    LOG_BENCH("  construct InternedPerson", interned_ms, count);
+    printf("%-*s => %10.2f MiB\n", 50, "  heap in use, Person", person_bytes / (1024.0 * 1024.0));
+    printf("%-*s => %10.2f MiB\n", 50, "  heap in use, InternedPerson and pool", interned_bytes / (1024.0 * 1024.0));
+    LOG_BENCH("  compare names, strcmp", person_compare_ms, count);
+    LOG_BENCH("  compare names, pointer", interned_compare_ms, count);
+
+    interned.clear();
+    printf("%-*s => %zu\n", 50, "  names reclaimed after destroying the persons", GetNamePool().Reclaim());
+  }
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+  int threads = argc > 2 ? std::atoi(argv[2]) : 4;
+  ShowInternedPerson();
+  BenchmarkDuplication(count, threads);
+}
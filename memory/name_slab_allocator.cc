@@ -0,0 +1,635 @@
+/*
+ * Size-class slab allocator for name buffers
+ *
+ * Every Person in move_semantics.cc allocates its name with new char[] and
+ * frees it with delete[]. NameSlabAllocator serves these buffers instead:
+ *
+ *  - Sizes are rounded up to a power of two size class, 16 to 2048 bytes.
+ *    Larger names go to ::operator new.
+ *  - Blocks are carved out of 64 KiB slabs, aligned to their size, so the slab
+ *    of a block is found by masking its address. Every slab belongs to one
+ *    thread and holds blocks of one size class.
+ *  - Each thread keeps a magazine, a small stack of free blocks, per size
+ *    class. Allocating and freeing on the owning thread only push and pop the
+ *    magazine. Slabs are touched only to refill an empty magazine or to flush
+ *    half of a full one.
+ *  - A block freed by another thread is pushed on its slab's remote free list
+ *    with one compare-and-swap. The owner takes the whole list lazily, when it
+ *    runs out of free blocks and would otherwise need a new slab.
+ *  - When a thread exits its slabs are orphaned, and the next thread that
+ *    needs a slab of that size class adopts them. Slabs are never returned to
+ *    the operating system.
+ *  - Slow paths update global counters, readable with GetStats(), and call
+ *    the hook installed with SetHook().
+ *
+ * Person is a template over the name allocator. Defining PERSON_NAME_SLAB at
+ * compile time makes the plain Person alias use the slab allocator.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -pthread -o name_slab_allocator.out name_slab_allocator.cc
+ * g++ -std=c++17 -O2 -pthread -DPERSON_NAME_SLAB -o name_slab_allocator.out name_slab_allocator.cc
+ *
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+enum class SlabEvent {
+  kSlabCreated,
+  kSlabAdopted,
+  kRefill,
+  kFlush,
+  kRemoteSweep,
+};
+
+struct SlabStats {
+  std::uint64_t slabs_created;
+  std::uint64_t slabs_adopted;
+  std::uint64_t refills;
+  std::uint64_t flushes;
+  std::uint64_t remote_frees;
+  std::uint64_t remote_sweeps;
+  std::uint64_t large_allocations;
+};
+
+class ThreadCache;
+
+class NameSlabAllocator {
+public:
+  static constexpr std::size_t kSlabSize = 64 * 1024;
+  static constexpr std::size_t kMinBlockSize = 16;
+  static constexpr std::size_t kMaxBlockSize = 2048;
+  static constexpr std::size_t kSizeClasses = 8;
+
+  using Hook = void (*)(SlabEvent event, std::size_t block_size);
+
+  static void* Allocate(std::size_t size);
+  // `size` must be the size passed to Allocate
+  static void Deallocate(void* block, std::size_t size);
+
+  static SlabStats GetStats();
+  // Called on slow paths only, from whichever thread hits them
+  static void SetHook(Hook hook) { hook_.store(hook, std::memory_order_relaxed); }
+
+  static constexpr std::size_t SizeClass(std::size_t size) {
+    return size <= kMinBlockSize ? 0 : 64 - static_cast<std::size_t>(__builtin_clzll(size - 1)) - 4;
+  }
+  static constexpr std::size_t BlockSize(std::size_t size_class) { return kMinBlockSize << size_class; }
+
+private:
+  friend class ThreadCache;
+
+  static void Notify(SlabEvent event, std::size_t size_class) {
+    if (Hook hook = hook_.load(std::memory_order_relaxed)) {
+      hook(event, BlockSize(size_class));
+    }
+  }
+
+  static inline std::atomic<Hook> hook_{nullptr};
+  static inline std::atomic<std::uint64_t> slabs_created_{0};
+  static inline std::atomic<std::uint64_t> slabs_adopted_{0};
+  static inline std::atomic<std::uint64_t> refills_{0};
+  static inline std::atomic<std::uint64_t> flushes_{0};
+  static inline std::atomic<std::uint64_t> remote_frees_{0};
+  static inline std::atomic<std::uint64_t> remote_sweeps_{0};
+  static inline std::atomic<std::uint64_t> large_allocations_{0};
+};
+
+static_assert(NameSlabAllocator::BlockSize(NameSlabAllocator::kSizeClasses - 1) == NameSlabAllocator::kMaxBlockSize);
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+/*
+ * Lives at the start of its 64 KiB, the blocks follow. Only the owner touches
+ * local_free_ and the bump range, other threads only push on remote_free_.
+ */
+struct alignas(64) Slab {
+  std::atomic<ThreadCache*> owner;
+  std::atomic<FreeBlock*> remote_free{nullptr};
+  FreeBlock* local_free = nullptr;
+  char* bump;
+  char* end;
+  std::size_t size_class;
+  bool in_partial = false;
+
+  static Slab* Of(void* block) {
+    return reinterpret_cast<Slab*>(reinterpret_cast<std::uintptr_t>(block) & ~(NameSlabAllocator::kSlabSize - 1));
+  }
+
+  void PushRemote(FreeBlock* block) {
+    FreeBlock* head = remote_free.load(std::memory_order_relaxed);
+    do {
+      block->next = head;
+    } while (!remote_free.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  // Moves every remote free to the local list, returns whether there was any
+  bool TakeRemote() {
+    FreeBlock* remote = remote_free.exchange(nullptr, std::memory_order_acquire);
+    if (remote == nullptr) {
+      return false;
+    }
+    FreeBlock* last = remote;
+    while (last->next != nullptr) {
+      last = last->next;
+    }
+    last->next = local_free;
+    local_free = remote;
+    return true;
+  }
+
+  bool HasLocal() const { return local_free != nullptr || bump != end; }
+
+  void* Pop() {
+    if (local_free != nullptr) {
+      FreeBlock* block = local_free;
+      local_free = block->next;
+      return block;
+    }
+    if (bump != end) {
+      void* block = bump;
+      bump += NameSlabAllocator::BlockSize(size_class);
+      return block;
+    }
+    return nullptr;
+  }
+};
+
+/*
+ * Slabs of exited threads, per size class, waiting to be adopted.
+ */
+class OrphanSlabs {
+public:
+  void Push(Slab* slab) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    slabs_[slab->size_class].push_back(slab);
+  }
+
+  Slab* Pop(std::size_t size_class) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto& slabs = slabs_[size_class];
+    if (slabs.empty()) {
+      return nullptr;
+    }
+    Slab* slab = slabs.back();
+    slabs.pop_back();
+    return slab;
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<Slab*> slabs_[NameSlabAllocator::kSizeClasses];
+};
+
+OrphanSlabs& GetOrphanSlabs() {
+  // Leaked on purpose, threads may still free into orphans during exit
+  static OrphanSlabs* orphans = new OrphanSlabs;
+  return *orphans;
+}
+
+class ThreadCache {
+public:
+  static constexpr std::size_t kMagazineSize = 64;
+
+  ThreadCache() = default;
+  ThreadCache(const ThreadCache&) = delete;
+  ThreadCache& operator=(const ThreadCache&) = delete;
+
+  // Flushes the magazines and leaves the slabs for other threads to adopt
+  ~ThreadCache() {
+    for (std::size_t size_class = 0; size_class < NameSlabAllocator::kSizeClasses; ++size_class) {
+      Magazine& magazine = magazines_[size_class];
+      while (magazine.count > 0) {
+        FreeLocal(magazine.blocks[--magazine.count]);
+      }
+      for (Slab* slab : owned_[size_class]) {
+        slab->owner.store(nullptr, std::memory_order_release);
+        slab->in_partial = false;
+        GetOrphanSlabs().Push(slab);
+      }
+    }
+  }
+
+  void* Allocate(std::size_t size_class) {
+    Magazine& magazine = magazines_[size_class];
+    if (magazine.count == 0) {
+      Refill(size_class);
+    }
+    return magazine.blocks[--magazine.count];
+  }
+
+  void Deallocate(void* block) {
+    Slab* slab = Slab::Of(block);
+    if (slab->owner.load(std::memory_order_relaxed) != this) {
+      slab->PushRemote(static_cast<FreeBlock*>(block));
+      NameSlabAllocator::remote_frees_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    Magazine& magazine = magazines_[slab->size_class];
+    if (magazine.count == kMagazineSize) {
+      Flush(slab->size_class);
+    }
+    magazine.blocks[magazine.count++] = block;
+  }
+
+private:
+  struct Magazine {
+    void* blocks[kMagazineSize];
+    std::size_t count = 0;
+  };
+
+  // Fills half of the magazine, so that a following free does not flush
+  void Refill(std::size_t size_class) {
+    Magazine& magazine = magazines_[size_class];
+    while (magazine.count < kMagazineSize / 2) {
+      Slab* slab = current_[size_class];
+      void* block = slab != nullptr ? slab->Pop() : nullptr;
+      if (block == nullptr) {
+        current_[size_class] = NextSlab(size_class);
+        continue;
+      }
+      magazine.blocks[magazine.count++] = block;
+    }
+    NameSlabAllocator::refills_.fetch_add(1, std::memory_order_relaxed);
+    NameSlabAllocator::Notify(SlabEvent::kRefill, size_class);
+  }
+
+  void Flush(std::size_t size_class) {
+    Magazine& magazine = magazines_[size_class];
+    while (magazine.count > kMagazineSize / 2) {
+      FreeLocal(magazine.blocks[--magazine.count]);
+    }
+    NameSlabAllocator::flushes_.fetch_add(1, std::memory_order_relaxed);
+    NameSlabAllocator::Notify(SlabEvent::kFlush, size_class);
+  }
+
+  void FreeLocal(void* block) {
+    Slab* slab = Slab::Of(block);
+    FreeBlock* free_block = static_cast<FreeBlock*>(block);
+    free_block->next = slab->local_free;
+    slab->local_free = free_block;
+    MarkPartial(slab);
+  }
+
+  void MarkPartial(Slab* slab) {
+    if (!slab->in_partial && slab != current_[slab->size_class]) {
+      slab->in_partial = true;
+      partial_[slab->size_class].push_back(slab);
+    }
+  }
+
+  /*
+   * Picks the slab to carve from next. Slabs with local frees come first. Then
+   * the remote free lists of all owned slabs are swept, which is where blocks
+   * freed by other threads come back. Only then an orphan is adopted or a new
+   * slab is allocated.
+   */
+  Slab* NextSlab(std::size_t size_class) {
+    auto& partial = partial_[size_class];
+    while (!partial.empty()) {
+      Slab* slab = partial.back();
+      partial.pop_back();
+      slab->in_partial = false;
+      if (slab->HasLocal()) {
+        return slab;
+      }
+    }
+
+    bool swept = false;
+    for (Slab* slab : owned_[size_class]) {
+      if (slab->TakeRemote()) {
+        swept = true;
+        MarkPartial(slab);
+      }
+    }
+    if (swept) {
+      NameSlabAllocator::remote_sweeps_.fetch_add(1, std::memory_order_relaxed);
+      NameSlabAllocator::Notify(SlabEvent::kRemoteSweep, size_class);
+      return NextSlab(size_class);
+    }
+
+    if (Slab* slab = GetOrphanSlabs().Pop(size_class)) {
+      slab->owner.store(this, std::memory_order_release);
+      slab->TakeRemote();
+      owned_[size_class].push_back(slab);
+      NameSlabAllocator::slabs_adopted_.fetch_add(1, std::memory_order_relaxed);
+      NameSlabAllocator::Notify(SlabEvent::kSlabAdopted, size_class);
+      return slab;
+    }
+
+    void* memory = std::aligned_alloc(NameSlabAllocator::kSlabSize, NameSlabAllocator::kSlabSize);
+    if (memory == nullptr) {
+      throw std::bad_alloc{};
+    }
+    Slab* slab = ::new (memory) Slab;
+    slab->owner.store(this, std::memory_order_relaxed);
+    slab->size_class = size_class;
+    std::size_t block_size = NameSlabAllocator::BlockSize(size_class);
+    // Blocks start after the header, aligned to their size up to 64 bytes
+    std::size_t header = (sizeof(Slab) + block_size - 1) / block_size * block_size;
+    header = std::max(header, sizeof(Slab));
+    slab->bump = static_cast<char*>(memory) + header;
+    slab->end = slab->bump + (NameSlabAllocator::kSlabSize - header) / block_size * block_size;
+    owned_[size_class].push_back(slab);
+    NameSlabAllocator::slabs_created_.fetch_add(1, std::memory_order_relaxed);
+    NameSlabAllocator::Notify(SlabEvent::kSlabCreated, size_class);
+    return slab;
+  }
+
+  Magazine magazines_[NameSlabAllocator::kSizeClasses];
+  Slab* current_[NameSlabAllocator::kSizeClasses] = {};
+  std::vector<Slab*> partial_[NameSlabAllocator::kSizeClasses];
+  std::vector<Slab*> owned_[NameSlabAllocator::kSizeClasses];
+};
+
+/*
+ * The thread's cache is created on first use. After it is destroyed at thread
+ * exit, late allocations and frees, e.g. from destructors of statics, go
+ * through a shared cache under a lock.
+ */
+enum class CacheState { kUnused, kAlive, kDestroyed };
+thread_local CacheState cache_state = CacheState::kUnused;
+
+struct ThreadCacheHolder {
+  ThreadCacheHolder() { cache_state = CacheState::kAlive; }
+  ~ThreadCacheHolder() { cache_state = CacheState::kDestroyed; }
+  ThreadCache cache;
+};
+
+std::mutex shared_cache_mutex;
+
+ThreadCache& SharedCache() {
+  static ThreadCache* cache = new ThreadCache;
+  return *cache;
+}
+
+// Not a template, so every caller on a thread sees the same cache
+ThreadCache& LocalCache() {
+  thread_local ThreadCacheHolder holder;
+  return holder.cache;
+}
+
+template<typename Func>
+auto WithThreadCache(Func&& func) {
+  if (cache_state != CacheState::kDestroyed) {
+    return func(LocalCache());
+  }
+  std::lock_guard<std::mutex> lock{shared_cache_mutex};
+  return func(SharedCache());
+}
+
+void* NameSlabAllocator::Allocate(std::size_t size) {
+  if (size > kMaxBlockSize) {
+    large_allocations_.fetch_add(1, std::memory_order_relaxed);
+    return ::operator new(size);
+  }
+  std::size_t size_class = SizeClass(size);
+  return WithThreadCache([size_class](ThreadCache& cache) { return cache.Allocate(size_class); });
+}
+
+void NameSlabAllocator::Deallocate(void* block, std::size_t size) {
+  if (size > kMaxBlockSize) {
+    ::operator delete(block);
+    return;
+  }
+  WithThreadCache([block](ThreadCache& cache) { cache.Deallocate(block); });
+}
+
+SlabStats NameSlabAllocator::GetStats() {
+  return SlabStats{
+    slabs_created_.load(std::memory_order_relaxed),
+    slabs_adopted_.load(std::memory_order_relaxed),
+    refills_.load(std::memory_order_relaxed),
+    flushes_.load(std::memory_order_relaxed),
+    remote_frees_.load(std::memory_order_relaxed),
+    remote_sweeps_.load(std::memory_order_relaxed),
+    large_allocations_.load(std::memory_order_relaxed),
+  };
+}
+
+struct NewDeleteNames {
+  static char* Allocate(std::size_t size) { return new char[size]; }
+  static void Deallocate(char* name, std::size_t) { delete [] name; }
+};
+
+struct SlabNames {
+  static char* Allocate(std::size_t size) { return static_cast<char*>(NameSlabAllocator::Allocate(size)); }
+  static void Deallocate(char* name, std::size_t size) { NameSlabAllocator::Deallocate(name, size); }
+};
+
+/*
+ * The Person of move_semantics.cc without the prints, with its name buffer
+ * coming from NameAllocator. The buffer size is not stored, the terminating
+ * null gives it back on free.
+ */
+template<typename NameAllocator>
+class BasicPerson{
+
+public:
+  BasicPerson(const char* name) : name_{NameAllocator::Allocate(strlen(name) + 1)} {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+
+  ~BasicPerson(){
+    Release();
+  }
+
+  BasicPerson(const BasicPerson& rhs) : BasicPerson(rhs.name_) {}
+
+  BasicPerson& operator=(const BasicPerson& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = NameAllocator::Allocate(name_size);
+    memcpy(new_name, rhs.name_, name_size);
+    Release();
+    name_ = new_name;
+    return *this;
+  }
+
+  BasicPerson(BasicPerson&& rhs) noexcept : name_{std::move(rhs.name_)} {
+    rhs.name_ = nullptr;
+  }
+
+  BasicPerson& operator=(BasicPerson&& rhs) noexcept {
+    if (this != &rhs){
+      Release();
+      name_ = rhs.name_;
+      rhs.name_ = nullptr;
+    }
+    return *this;
+  }
+
+  const char* GetName() const {
+    return name_;
+  }
+
+private:
+  void Release() {
+    if (name_ != nullptr) {
+      NameAllocator::Deallocate(name_, strlen(name_) + 1);
+    }
+  }
+
+  char* name_;
+};
+
+#ifdef PERSON_NAME_SLAB
+using Person = BasicPerson<SlabNames>;
+#else
+using Person = BasicPerson<NewDeleteNames>;
+#endif
+
+void PrintStats() {
+  SlabStats stats = NameSlabAllocator::GetStats();
+  printf("%-*s => %llu\n", 50, "  slabs created", (unsigned long long)stats.slabs_created);
+  printf("%-*s => %llu\n", 50, "  slabs adopted", (unsigned long long)stats.slabs_adopted);
+  printf("%-*s => %llu\n", 50, "  magazine refills", (unsigned long long)stats.refills);
+  printf("%-*s => %llu\n", 50, "  magazine flushes", (unsigned long long)stats.flushes);
+  printf("%-*s => %llu\n", 50, "  remote frees", (unsigned long long)stats.remote_frees);
+  printf("%-*s => %llu\n", 50, "  remote sweeps", (unsigned long long)stats.remote_sweeps);
+  printf("%-*s => %llu\n", 50, "  large allocations", (unsigned long long)stats.large_allocations);
+}
+
+std::atomic<std::size_t> slabs_seen_by_hook{0};
+
+void ShowSlabPerson() {
+  NameSlabAllocator::SetHook([](SlabEvent event, std::size_t) {
+    if (event == SlabEvent::kSlabCreated) {
+      slabs_seen_by_hook.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+
+  Person wild_king{"Mance Rayder"};
+  BasicPerson<SlabNames> slab_king{"Mance Rayder"};
+  BasicPerson<SlabNames> neighbour{"Tormund Giantsbane"};
+  printf("%-*s => %s\n", 50, "Person uses the slab allocator",
+    std::is_same_v<Person, BasicPerson<SlabNames>> ? "yes" : "no");
+  printf("%-*s => %p\n", 50, "Address of slab_king.name_", (void*)slab_king.GetName());
+  printf("%-*s => %p\n", 50, "Address of neighbour.name_", (void*)neighbour.GetName());
+  printf("%-*s => %zu\n\n", 50, "Slabs created, seen by the hook", slabs_seen_by_hook.load());
+  NameSlabAllocator::SetHook(nullptr);
+}
+
+std::vector<std::string> MakeNames(std::size_t count) {
+  const char* houses[] = {"Stark", "Lannister", "Targaryen", "Baratheon of Storm's End", "Greyjoy"};
+  std::vector<std::string> names;
+  names.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    names.push_back(std::string{"Ser "} + std::to_string(idx) + " of House " + houses[idx % 5]);
+  }
+  return names;
+}
+
+// Builds and destroys batches on one thread
+template<typename P>
+double SameThreadChurn(const std::vector<std::string>& names, int rounds) {
+  return MeasureMs([&] {
+    std::vector<P> persons;
+    persons.reserve(names.size());
+    for (int round = 0; round < rounds; ++round) {
+      for (const auto& name : names) {
+        persons.emplace_back(name.c_str());
+      }
+      persons.clear();
+    }
+  });
+}
+
+/*
+ * Producers build batches of persons and hand them to consumers, which destroy
+ * them, so every name is freed by another thread.
+ */
+template<typename P>
+double CrossThreadChurn(const std::vector<std::string>& names, int rounds, int producers, int consumers) {
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::vector<P>> batches;
+  int producers_left = producers;
+  constexpr std::size_t kBatch = 256;
+
+  return MeasureMs([&] {
+    std::vector<std::thread> threads;
+    for (int idx = 0; idx < producers; ++idx) {
+      threads.emplace_back([&] {
+        for (int round = 0; round < rounds; ++round) {
+          for (std::size_t first = 0; first < names.size(); first += kBatch) {
+            std::vector<P> batch;
+            batch.reserve(kBatch);
+            for (std::size_t pos = first; pos < std::min(first + kBatch, names.size()); ++pos) {
+              batch.emplace_back(names[pos].c_str());
+            }
+            std::lock_guard<std::mutex> lock{mutex};
+            batches.push_back(std::move(batch));
+            ready.notify_one();
+          }
+        }
+        std::lock_guard<std::mutex> lock{mutex};
+        --producers_left;
+        ready.notify_all();
+      });
+    }
+    for (int idx = 0; idx < consumers; ++idx) {
+      threads.emplace_back([&] {
+        while (true) {
+          std::vector<P> batch;
+          {
+            std::unique_lock<std::mutex> lock{mutex};
+            ready.wait(lock, [&] { return !batches.empty() || producers_left == 0; });
+            if (batches.empty()) {
+              return;
+            }
+            batch = std::move(batches.front());
+            batches.pop_front();
+          }
+          // batch goes out of scope here, destroying its persons
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  });
+}
+
+void BenchmarkAllocators(std::size_t count) {
+  std::vector<std::string> names = MakeNames(count);
+  constexpr int kRounds = 10;
+  const std::size_t total = count * kRounds;
+
+  double new_same_ms = SameThreadChurn<BasicPerson<NewDeleteNames>>(names, kRounds);
+  double slab_same_ms = SameThreadChurn<BasicPerson<SlabNames>>(names, kRounds);
+  double new_cross_ms = CrossThreadChurn<BasicPerson<NewDeleteNames>>(names, kRounds, 2, 2);
+  double slab_cross_ms = CrossThreadChurn<BasicPerson<SlabNames>>(names, kRounds, 2, 2);
+
+  printf("%zu persons, %d rounds\n", count, kRounds);
+  LOG_BENCH("same thread, new[]/delete[]", new_same_ms, total);
+  LOG_BENCH("same thread, NameSlabAllocator", slab_same_ms, total);
+  LOG_BENCH("2 producers -> 2 consumers, new[]/delete[]", new_cross_ms, total * 2);
+  LOG_BENCH("2 producers -> 2 consumers, NameSlabAllocator", slab_cross_ms, total * 2);
+  printf("NameSlabAllocator stats\n");
+  PrintStats();
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200'000;
+  ShowSlabPerson();
+  BenchmarkAllocators(count);
+}
@@ -0,0 +1,192 @@
+/*
+ * Counting live objects per type
+ *
+ * CreatePerson in move_semantics.cc and using_swap.cc lets a Person leak on
+ * purpose, and nothing tells how many persons are still alive afterwards.
+ * Here the classes of the examples derive from Census<T> in
+ * common/object_census.h, which counts live objects, peak objects and peak
+ * bytes per type.
+ *
+ * The census is printed when SIGUSR1 arrives, which a long-running process can
+ * be sent with `kill -USR1 <pid>`, and once more at exit. The leaked persons
+ * show up as live Person objects in the final report.
+ *
+ * BenchmarkCensus() measures what counting adds to constructing and destroying
+ * an object.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o object_census.out object_census.cc
+ *
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+#include "../common/object_census.h"
+#include "../common/timer.h"
+
+class Person : public Census<Person> {
+
+public:
+  Person(const char* name) : name_{new char[strlen(name) + 1]} {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+
+  ~Person(){
+    delete [] name_;
+  }
+
+  Person(const Person& rhs) : Census<Person>{rhs}, name_{new char[strlen(rhs.name_) + 1]} {
+    memcpy(name_, rhs.name_, strlen(rhs.name_) + 1);
+  }
+
+  Person& operator=(const Person& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = new char[name_size];
+    memcpy(new_name, rhs.name_, name_size);
+    delete [] name_;
+    name_ = new_name;
+    return *this;
+  }
+
+  Person(Person&& rhs) noexcept : Census<Person>{std::move(rhs)}, name_{rhs.name_} {
+    rhs.name_ = nullptr;
+  }
+
+  Person& operator=(Person&& rhs) noexcept {
+    if (this != &rhs){
+      delete [] name_;
+      name_ = rhs.name_;
+      rhs.name_ = nullptr;
+    }
+    return *this;
+  }
+
+  const char* GetName() const {
+    return name_;
+  }
+
+private:
+  char* name_;
+};
+
+class PersonTraits : public Census<PersonTraits> {
+public:
+  PersonTraits(int id, std::string name) : id_{id}, name_{name} {}
+private:
+  int id_;
+  std::string name_;
+};
+
+class PersonInventory : public Census<PersonInventory> {
+public:
+  PersonInventory(const std::vector<float> values, std::vector<std::string> items)
+    : values_{values}, items_{items} {}
+private:
+  std::vector<float> values_;
+  std::vector<std::string> items_;
+};
+
+class PerfectPerson : public Census<PerfectPerson> {
+public:
+  template<typename T1, typename T2>
+  PerfectPerson (T1&& t1, T2&& t2)
+    : trait_{std::forward<T1>(t1)}, inventory_{std::forward<T2>(t2)} {}
+private:
+  PersonTraits trait_;
+  PersonInventory inventory_;
+};
+
+class Wrapped : public Census<Wrapped> {
+public:
+  Wrapped() {}
+};
+
+class Wrapper : public Census<Wrapper> {
+public:
+  Wrapper(const Wrapped& wrapped) : wrapped_{wrapped} {}
+private:
+  Wrapped wrapped_;
+};
+
+// Same as Wrapped, without the census
+class PlainWrapped {
+public:
+  PlainWrapped() {}
+};
+
+Person CreatePerson(int rand_number) {
+  if(rand_number == 1) {
+    Person legendary_person {"Arthur Dayne"};
+    return legendary_person;
+  } else {
+    // Let it leak
+    Person* person_ptr = new Person{"Meryn Trant"};
+    return *person_ptr;
+  }
+}
+
+void ShowCensus() {
+  InstallCensusSignal(SIGUSR1);
+
+  std::vector<Person> persons;
+  for (int idx = 0; idx < 5; ++idx) {
+    persons.push_back(CreatePerson(idx % 2));
+  }
+
+  PersonTraits trait_lvalue{1, "trait_lvalue"};
+  PersonInventory inventory_lvalue{{5.5, 3.5, 2.5}, {"Sword", "Shield", "Dagger"}};
+  PerfectPerson perfect_person{trait_lvalue, std::move(inventory_lvalue)};
+  Wrapper wrapper{Wrapped{}};
+
+  printf("%-*s => %lld\n", 50, "Live persons, including leaked ones", (long long)Person::Counters().live.load());
+  printf("%-*s => %lld\n", 50, "Peak persons", (long long)Person::Counters().peak.load());
+  printf("Census on SIGUSR1:\n");
+  fflush(stdout);
+  raise(SIGUSR1);
+  printf("\n");
+}
+
+void BenchmarkCensus(std::size_t count) {
+  double plain_ms = MeasureBestMs(3, [&] {
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      PlainWrapped wrapped;
+      DoNotOptimize(wrapped);
+    }
+  });
+  double census_ms = MeasureBestMs(3, [&] {
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      Wrapped wrapped;
+      DoNotOptimize(wrapped);
+    }
+  });
+  double person_ms = MeasureBestMs(3, [&] {
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      Person person{"Meryn Trant"};
+      DoNotOptimize(person.GetName());
+    }
+  });
+
+  if (Wrapped::Counters().live.load() != 0) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu objects constructed and destroyed\n", count);
+  LOG_BENCH("empty class, no census", plain_ms, count);
+  LOG_BENCH("empty class, with census", census_ms, count);
+  LOG_BENCH("Person with census", person_ms, count);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+  ShowCensus();
+  BenchmarkCensus(count);
+}
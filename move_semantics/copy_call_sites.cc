@@ -0,0 +1,142 @@
+/*
+ * Finds where Person copies come from.
+ *
+ * The Person of when_to_move.cc has no move operations, so every push_back of
+ * an lvalue, every pass by value and every reallocation of a std::vector copies
+ * its name. Here its copy constructor and copy assignment report to the
+ * profiler in common/copy_profiler.h, and the workloads below copy persons the
+ * same way the examples do, from several threads at once. At exit the profiler
+ * lists the call sites with the most copies and the most bytes copied.
+ *
+ * main() also measures what a profiled copy costs, with recording switched on
+ * and off at runtime.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -g -rdynamic -pthread -DCOPY_PROFILER -o copy_call_sites.out copy_call_sites.cc -ldl
+ *
+ * Add -DCOPY_PROFILER_DEPTH=3 to see who called push_back, and leave out
+ * -DCOPY_PROFILER to compile the profiler away.
+ *
+ */
+
+#include <string.h>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../common/copy_profiler.h"
+#include "../common/timer.h"
+
+class Person{
+
+public:
+  Person(const char* name) : name_(new char[strlen(name) + 1])
+  {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+
+  ~Person() {
+    delete [] name_;
+  }
+
+  COPY_PROFILED Person(const Person& rhs) : Person(rhs.name_) {
+    PROFILE_COPY(sizeof(Person) + strlen(name_) + 1);
+  }
+
+  COPY_PROFILED Person& operator=(const Person& rhs) {
+    if (this == &rhs){
+      return *this;
+    }
+    PROFILE_COPY(sizeof(Person) + strlen(rhs.name_) + 1);
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = new char[name_size];
+    memcpy(new_name, rhs.name_, name_size);
+    delete [] name_;
+    name_ = new_name;
+    return *this;
+  }
+
+  const char* GetName() const {
+    return name_;
+  }
+
+private:
+  char* name_;
+};
+
+// Pass by value, the caller copies
+__attribute__((noinline)) size_t NameLength(Person person) {
+  return strlen(person.GetName());
+}
+
+// ShowMoveSemanticsInSTL: push_back copies, and so does every reallocation
+__attribute__((noinline)) size_t FillVector(int count) {
+  std::vector<Person> persons;
+  persons.reserve(2);
+  Person wild_king{"Mance Rayder"};
+  for (int idx = 0; idx < count; ++idx) {
+    persons.push_back(wild_king);
+  }
+  return persons.size();
+}
+
+__attribute__((noinline)) size_t PassByValue(int count) {
+  Person maester{"Maester Aemon Targaryen of the Night's Watch"};
+  size_t total = 0;
+  for (int idx = 0; idx < count; ++idx) {
+    total += NameLength(maester);
+  }
+  return total;
+}
+
+__attribute__((noinline)) size_t AssignInLoop(int count) {
+  Person lord_commander{"Jeor Mormont"};
+  Person steward{"Samwell Tarly"};
+  for (int idx = 0; idx < count; ++idx) {
+    steward = lord_commander;
+  }
+  return strlen(steward.GetName());
+}
+
+void RunWorkloads(int threads, int count) {
+  std::vector<std::thread> workers;
+  for (int thread = 0; thread < threads; ++thread) {
+    workers.emplace_back([count] {
+      DoNotOptimize(FillVector(count));
+      DoNotOptimize(PassByValue(count / 2));
+      DoNotOptimize(AssignInLoop(count / 4));
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+void BenchmarkOverhead(int count) {
+  Person wild_king{"Mance Rayder"};
+  auto copy_loop = [&] {
+    for (int idx = 0; idx < count; ++idx) {
+      Person copy{wild_king};
+      DoNotOptimize(copy.GetName());
+    }
+  };
+
+#ifdef COPY_PROFILER
+  copy_profiler::SetEnabled(false);
+  double disabled_ms = MeasureBestMs(3, copy_loop);
+  copy_profiler::SetEnabled(true);
+  double enabled_ms = MeasureBestMs(3, copy_loop);
+  LOG_BENCH("copies, recording switched off", disabled_ms, count);
+  LOG_BENCH("copies, recording", enabled_ms, count);
+#else
+  double plain_ms = MeasureBestMs(3, copy_loop);
+  LOG_BENCH("copies, profiler compiled out", plain_ms, count);
+#endif
+}
+
+int main(int argc, char** argv) {
+  int count = argc > 1 ? std::atoi(argv[1]) : 1'000'000;
+  RunWorkloads(4, count / 4);
+  BenchmarkOverhead(count);
+}
@@ -0,0 +1,433 @@
+/*
+ * Rope names: O(1) concatenation with lazy flattening
+ *
+ * Building a name as "Ser " + first + " of House " + house and passing it to
+ * the Person of move_semantics.cc copies the characters at every step: into
+ * the std::string temporaries, then once more into the new[] buffer of the
+ * person. Appending to a name that a Person owns is worse, every append
+ * allocates a new buffer and copies the whole name into it.
+ *
+ * RopeName is a handle to an immutable, reference counted tree:
+ *
+ *  - A leaf holds characters, null-terminated, in the same allocation as its
+ *    header. Leaves are never modified, so any number of names can share one,
+ *    like the " of House " all knights' names have in common.
+ *  - `lhs + rhs` allocates one concatenation node that points at both sides.
+ *    Nothing is copied, no matter how long the sides are. Both operands are
+ *    taken by value, so a temporary rope is moved in and its reference is
+ *    handed to the new node, while an lvalue costs one reference count
+ *    increment.
+ *  - c_str() flattens the tree into a single leaf the first time contiguous
+ *    characters are needed and keeps that leaf in the handle, the tree is
+ *    released. Later calls return the leaf directly.
+ *
+ * Appending one word at a time builds a tree as deep as the number of
+ * appends, so flattening and releasing walk the tree with a loop instead of
+ * recursion.
+ *
+ * Person holds a RopeName. Its move operations move the handle, and copying
+ * a person shares the name instead of copying the characters. A handle
+ * flattens itself from c_str(), so one handle must not be read from two
+ * threads at once, while handles sharing nodes may be.
+ *
+ * Every concatenation is an allocation, so for names of a few short pieces
+ * std::string, which appends into spare capacity, stays ahead. The rope pays
+ * off when pieces are long or shared, and the benchmark shows both: short
+ * names, names ending in a 2 KiB lineage, and single word appends.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o rope_name.out rope_name.cc
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+class RopeName {
+public:
+  RopeName() = default;
+
+  RopeName(const char* chars) : RopeName{chars, strlen(chars)} {}
+
+  RopeName(const char* chars, std::size_t size) {
+    if (size != 0) {
+      root_ = Node::MakeLeaf(chars, size);
+    }
+  }
+
+  ~RopeName() {
+    Node::Release(root_);
+  }
+
+  RopeName(const RopeName& rhs) : root_{rhs.root_} {
+    Node::Acquire(root_);
+  }
+
+  RopeName(RopeName&& rhs) noexcept : root_{std::exchange(rhs.root_, nullptr)} {}
+
+  RopeName& operator=(RopeName rhs) noexcept {
+    std::swap(root_, rhs.root_);
+    return *this;
+  }
+
+  friend RopeName operator+(RopeName lhs, RopeName rhs) {
+    if (lhs.root_ == nullptr) {
+      return rhs;
+    }
+    if (rhs.root_ == nullptr) {
+      return lhs;
+    }
+    // The node takes over both references
+    return RopeName{Node::MakeConcat(std::exchange(lhs.root_, nullptr), std::exchange(rhs.root_, nullptr))};
+  }
+
+  RopeName& operator+=(RopeName rhs) {
+    *this = std::move(*this) + std::move(rhs);
+    return *this;
+  }
+
+  std::size_t size() const {
+    return root_ != nullptr ? root_->size : 0;
+  }
+
+  bool IsFlat() const {
+    return root_ == nullptr || root_->IsLeaf();
+  }
+
+  // Flattens on first use, the handle keeps the flat leaf
+  const char* c_str() const {
+    if (root_ == nullptr) {
+      return "";
+    }
+    if (!root_->IsLeaf()) {
+      Node* flat = Node::Flatten(root_);
+      Node::Release(root_);
+      root_ = flat;
+    }
+    return root_->Chars();
+  }
+
+private:
+  struct Node {
+    std::atomic<std::uint32_t> refs{1};
+    std::size_t size = 0;
+    Node* left = nullptr;
+    Node* right = nullptr;
+
+    bool IsLeaf() const { return left == nullptr; }
+    char* Chars() { return reinterpret_cast<char*>(this + 1); }
+
+    static Node* MakeLeaf(const char* chars, std::size_t size) {
+      Node* leaf = new (::operator new(sizeof(Node) + size + 1)) Node;
+      leaf->size = size;
+      memcpy(leaf->Chars(), chars, size);
+      leaf->Chars()[size] = '\0';
+      return leaf;
+    }
+
+    static Node* MakeConcat(Node* left, Node* right) {
+      Node* node = new (::operator new(sizeof(Node))) Node;
+      node->size = left->size + right->size;
+      node->left = left;
+      node->right = right;
+      return node;
+    }
+
+    static void Acquire(Node* node) {
+      if (node != nullptr) {
+        node->refs.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    // Drops one reference, and the children of every node that goes away
+    static void Release(Node* node) {
+      std::vector<Node*> pending;
+      while (node != nullptr) {
+        Node* next = nullptr;
+        if (node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          if (!node->IsLeaf()) {
+            // Continue with one child and only remember the other when it
+            // is a tree too, so appending and prepending chains need no stack
+            Node* left = node->left;
+            Node* right = node->right;
+            if (left->IsLeaf()) {
+              Release(left);
+              next = right;
+            } else if (right->IsLeaf()) {
+              Release(right);
+              next = left;
+            } else {
+              pending.push_back(right);
+              next = left;
+            }
+          }
+          node->~Node();
+          ::operator delete(node);
+        }
+        if (next == nullptr && !pending.empty()) {
+          next = pending.back();
+          pending.pop_back();
+        }
+        node = next;
+      }
+    }
+
+    static Node* Flatten(Node* root) {
+      Node* flat = new (::operator new(sizeof(Node) + root->size + 1)) Node;
+      flat->size = root->size;
+      flat->Chars()[root->size] = '\0';
+
+      std::vector<std::pair<Node*, char*>> pending;
+      Node* node = root;
+      char* dest = flat->Chars();
+      while (true) {
+        while (!node->IsLeaf()) {
+          if (node->right->IsLeaf()) {
+            memcpy(dest + node->left->size, node->right->Chars(), node->right->size);
+            node = node->left;
+          } else if (node->left->IsLeaf()) {
+            memcpy(dest, node->left->Chars(), node->left->size);
+            dest += node->left->size;
+            node = node->right;
+          } else {
+            pending.emplace_back(node->right, dest + node->left->size);
+            node = node->left;
+          }
+        }
+        memcpy(dest, node->Chars(), node->size);
+        if (pending.empty()) {
+          return flat;
+        }
+        std::tie(node, dest) = pending.back();
+        pending.pop_back();
+      }
+    }
+  };
+
+  explicit RopeName(Node* root) : root_{root} {}
+
+  mutable Node* root_ = nullptr;
+};
+
+inline RopeName operator+(RopeName lhs, const char* rhs) {
+  return std::move(lhs) + RopeName{rhs};
+}
+
+/*
+ * Person of move_semantics.cc with a RopeName instead of an owned char*.
+ */
+class Person{
+
+public:
+  Person(RopeName name) : name_{std::move(name)} {}
+
+  // Shares the name, no characters are copied
+  Person(const Person& rhs) = default;
+  Person& operator=(const Person& rhs) = default;
+
+  Person(Person&& rhs) noexcept = default;
+  Person& operator=(Person&& rhs) noexcept = default;
+
+  void AppendToName(RopeName suffix) {
+    name_ += std::move(suffix);
+  }
+
+  const char* GetName() const {
+    return name_.c_str();
+  }
+
+  std::size_t NameSize() const {
+    return name_.size();
+  }
+
+private:
+  RopeName name_;
+};
+
+/*
+ * The char* owning Person of move_semantics.cc, with an append that works
+ * the way it has to for a single owned buffer.
+ */
+class OwningPerson{
+
+public:
+  OwningPerson(const char* name) : name_{new char[strlen(name) + 1]} {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+
+  ~OwningPerson(){
+    delete [] name_;
+  }
+
+  OwningPerson(OwningPerson&& rhs) noexcept : name_{rhs.name_} {
+    rhs.name_ = nullptr;
+  }
+
+  OwningPerson(const OwningPerson&) = delete;
+  OwningPerson& operator=(const OwningPerson&) = delete;
+
+  void AppendToName(const char* suffix) {
+    size_t name_size = strlen(name_);
+    size_t suffix_size = strlen(suffix);
+    char* new_name = new char[name_size + suffix_size + 1];
+    memcpy(new_name, name_, name_size);
+    memcpy(new_name + name_size, suffix, suffix_size + 1);
+    delete [] name_;
+    name_ = new_name;
+  }
+
+  const char* GetName() const {
+    return name_;
+  }
+
+private:
+  char* name_;
+};
+
+const char* kFirstNames[] = {"Arthur", "Meryn", "Barristan", "Jaime", "Arryk", "Erryk", "Loras", "Boros"};
+const char* kHouses[] = {"Dayne", "Trant", "Selmy", "Lannister", "Cargyll", "Cargyll", "Tyrell", "Blount"};
+const char* kTitles[] = {"Sword of the Morning", "of the Kingsguard", "the Bold", "the Kingslayer"};
+
+void ShowRopeName() {
+  RopeName ser{"Ser "};
+  RopeName of_house{" of House "};
+
+  RopeName name = ser + "Arthur" + of_house + "Dayne";
+  printf("%-*s => %s\n", 50, "Flat after concatenation", name.IsFlat() ? "yes" : "no");
+  name.c_str();
+  printf("%-*s => %s\n", 50, "Flat after c_str()", name.IsFlat() ? "yes" : "no");
+
+  Person arthur{name};
+  Person copy = arthur;
+  printf("%-*s => %s\n", 50, "Name", arthur.GetName());
+  printf("%-*s => %s\n", 50, "Copy shares the same characters",
+         copy.GetName() == arthur.GetName() ? "yes" : "no");
+
+  Person moved = std::move(arthur);
+  moved.AppendToName(RopeName{", "} + kTitles[0]);
+  printf("%-*s => %s\n", 50, "Moved and appended", moved.GetName());
+  printf("%-*s => %s\n\n", 50, "Copy is unchanged", copy.GetName());
+}
+
+// Appends and flattens through the old char* owning person or a std::string
+void BenchmarkChains(std::size_t count, const std::string& lineage) {
+  std::size_t string_total = 0;
+  double string_ms = MeasureBestMs(3, [&] {
+    string_total = 0;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      std::string name = std::string{"Ser "} + kFirstNames[idx % 8] + " of House " + kHouses[(idx / 8) % 8] + ", "
+                         + kTitles[idx % 4] + ", Lord Commander of the " + kHouses[idx % 8] + " guard" + lineage;
+      OwningPerson person{name.c_str()};
+      string_total += strlen(person.GetName());
+    }
+  });
+
+  // The pieces are ropes built once, each name only adds concatenation nodes
+  std::vector<RopeName> first_names(std::begin(kFirstNames), std::end(kFirstNames));
+  std::vector<RopeName> houses(std::begin(kHouses), std::end(kHouses));
+  std::vector<RopeName> titles(std::begin(kTitles), std::end(kTitles));
+  RopeName ser{"Ser "};
+  RopeName of_house{" of House "};
+  RopeName comma{", "};
+  RopeName lord_commander{", Lord Commander of the "};
+  RopeName guard{" guard"};
+  RopeName lineage_rope{lineage.c_str()};
+
+  std::size_t rope_total = 0;
+  double rope_ms = MeasureBestMs(3, [&] {
+    rope_total = 0;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      Person person{ser + first_names[idx % 8] + of_house + houses[(idx / 8) % 8] + comma + titles[idx % 4]
+                    + lord_commander + houses[idx % 8] + guard + lineage_rope};
+      rope_total += person.NameSize();
+    }
+  });
+
+  std::size_t flat_total = 0;
+  double flat_ms = MeasureBestMs(3, [&] {
+    flat_total = 0;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      Person person{ser + first_names[idx % 8] + of_house + houses[(idx / 8) % 8] + comma + titles[idx % 4]
+                    + lord_commander + houses[idx % 8] + guard + lineage_rope};
+      flat_total += strlen(person.GetName());
+    }
+  });
+
+  if (string_total != rope_total || string_total != flat_total) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu names of 9 pieces and a %zu byte lineage\n", count, lineage.size());
+  LOG_BENCH("std::string chain, then char* Person", string_ms, count);
+  LOG_BENCH("RopeName chain, never flattened", rope_ms, count);
+  LOG_BENCH("RopeName chain, flattened by GetName()", flat_ms, count);
+}
+
+void BenchmarkAppends(std::size_t appends) {
+  const char* words[] = {" the", " Sword", " of", " the", " Morning"};
+
+  std::size_t owning_total = 0;
+  double owning_ms = MeasureMs([&] {
+    OwningPerson person{"Arthur"};
+    for (std::size_t idx = 0; idx < appends; ++idx) {
+      person.AppendToName(words[idx % 5]);
+    }
+    owning_total = strlen(person.GetName());
+  });
+
+  std::size_t string_total = 0;
+  double string_ms = MeasureMs([&] {
+    std::string name{"Arthur"};
+    for (std::size_t idx = 0; idx < appends; ++idx) {
+      name += words[idx % 5];
+    }
+    OwningPerson person{name.c_str()};
+    string_total = strlen(person.GetName());
+  });
+
+  std::vector<RopeName> word_ropes(std::begin(words), std::end(words));
+  std::size_t rope_total = 0;
+  double rope_ms = MeasureMs([&] {
+    Person person{RopeName{"Arthur"}};
+    for (std::size_t idx = 0; idx < appends; ++idx) {
+      person.AppendToName(word_ropes[idx % 5]);
+    }
+    rope_total = strlen(person.GetName());
+  });
+
+  if (owning_total != string_total || owning_total != rope_total) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu single word appends to one name\n", appends);
+  LOG_BENCH("char* Person, reallocate per append", owning_ms, appends);
+  LOG_BENCH("std::string +=, then char* Person", string_ms, appends);
+  LOG_BENCH("RopeName +=, flattened once", rope_ms, appends);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+  ShowRopeName();
+  BenchmarkChains(count, "");
+
+  std::string lineage;
+  while (lineage.size() < 2048) {
+    lineage += std::string{", son of Ser "} + kFirstNames[lineage.size() % 8];
+  }
+  BenchmarkChains(count / 4, lineage);
+  BenchmarkAppends(count / 20);
+}
@@ -0,0 +1,336 @@
+/*
+ * Forwarding to callbacks without allocating: function_ref and inplace_function
+ *
+ * perfect_forwarder in forwarding.cc always forwards to the same `func`. When
+ * the target is a callback chosen by the caller, the usual parameter type is
+ * std::function, which owns a copy of the callable and puts it on the heap as
+ * soon as its captures do not fit in a couple of pointers.
+ *
+ * Two replacements, both forwarding their arguments with std::forward:
+ *
+ *  - function_ref<R(Args...)> does not own the callable. It is a pointer to
+ *    it plus a pointer to a thunk that casts it back and calls it, two words
+ *    that are copied for free. Like std::string_view, it must not outlive the
+ *    callable, so it is for parameters, not for members.
+ *  - inplace_function<R(Args...), Capacity> owns a copy of the callable in a
+ *    buffer inside itself. A callable larger than Capacity does not compile
+ *    instead of falling back to the heap. Copy, move and destroy go through a
+ *    static table of functions per callable type.
+ *
+ * Arguments keep their value category all the way through: the thunks take
+ * Args&&... and forward them, so a std::string&& parameter reaches the
+ * callable as an rvalue, and func(std::string&) and func(std::string&&) from
+ * forwarding.cc are picked the same way as with a direct call.
+ *
+ * The benchmark compares calling and constructing them with std::function
+ * and with the callable passed as a template parameter, and counts
+ * allocations with common/allocation_counter.h.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o function_ref.out function_ref.cc
+ *
+ */
+
+#include <stdio.h>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "../common/allocation_counter.h"
+#include "../common/timer.h"
+
+template<typename Signature>
+class function_ref;
+
+template<typename R, typename... Args>
+class function_ref<R(Args...)> {
+public:
+  template<typename F, typename = std::enable_if_t<
+    !std::is_same_v<std::decay_t<F>, function_ref> && std::is_invocable_r_v<R, F&, Args...>>>
+  function_ref(F&& callable) noexcept {
+    using Callable = std::remove_reference_t<F>;
+    if constexpr (std::is_function_v<Callable>) {
+      // A function pointer cannot be stored as void*
+      callable_.function = reinterpret_cast<void (*)()>(&callable);
+      thunk_ = [](Storage storage, Args&&... args) -> R {
+        return std::invoke(reinterpret_cast<Callable*>(storage.function), std::forward<Args>(args)...);
+      };
+    } else if constexpr (std::is_pointer_v<Callable> && std::is_function_v<std::remove_pointer_t<Callable>>) {
+      // Keeps the pointer itself, the variable holding it may be a temporary
+      callable_.function = reinterpret_cast<void (*)()>(callable);
+      thunk_ = [](Storage storage, Args&&... args) -> R {
+        return std::invoke(reinterpret_cast<Callable>(storage.function), std::forward<Args>(args)...);
+      };
+    } else {
+      callable_.object = const_cast<void*>(static_cast<const void*>(std::addressof(callable)));
+      thunk_ = [](Storage storage, Args&&... args) -> R {
+        return std::invoke(*static_cast<Callable*>(storage.object), std::forward<Args>(args)...);
+      };
+    }
+  }
+
+  R operator()(Args... args) const {
+    return thunk_(callable_, std::forward<Args>(args)...);
+  }
+
+private:
+  union Storage {
+    void* object;
+    void (*function)();
+  };
+
+  Storage callable_;
+  R (*thunk_)(Storage, Args&&...);
+};
+
+template<typename Signature, std::size_t Capacity = 32>
+class inplace_function;
+
+template<typename R, typename... Args, std::size_t Capacity>
+class inplace_function<R(Args...), Capacity> {
+public:
+  inplace_function() noexcept = default;
+
+  template<typename F, typename = std::enable_if_t<
+    !std::is_same_v<std::decay_t<F>, inplace_function> && std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+  inplace_function(F&& callable) {
+    using Callable = std::decay_t<F>;
+    static_assert(sizeof(Callable) <= Capacity, "callable does not fit, raise the capacity");
+    static_assert(alignof(Callable) <= alignof(std::max_align_t), "over-aligned callable");
+    static_assert(std::is_nothrow_move_constructible_v<Callable>, "callable must be nothrow movable");
+    new (storage_) Callable(std::forward<F>(callable));
+    ops_ = &kOps<Callable>;
+  }
+
+  ~inplace_function() {
+    if (ops_ != nullptr) {
+      ops_->destroy(storage_);
+    }
+  }
+
+  inplace_function(const inplace_function& rhs) : ops_{rhs.ops_} {
+    if (ops_ != nullptr) {
+      ops_->copy(storage_, rhs.storage_);
+    }
+  }
+
+  inplace_function(inplace_function&& rhs) noexcept : ops_{rhs.ops_} {
+    if (ops_ != nullptr) {
+      ops_->move(storage_, rhs.storage_);
+    }
+  }
+
+  inplace_function& operator=(inplace_function rhs) noexcept {
+    if (ops_ != nullptr) {
+      ops_->destroy(storage_);
+    }
+    ops_ = rhs.ops_;
+    if (ops_ != nullptr) {
+      ops_->move(storage_, rhs.storage_);
+    }
+    return *this;
+  }
+
+  explicit operator bool() const noexcept { return ops_ != nullptr; }
+
+  R operator()(Args... args) const {
+    if (ops_ == nullptr) {
+      throw std::bad_function_call{};
+    }
+    return ops_->invoke(storage_, std::forward<Args>(args)...);
+  }
+
+private:
+  struct Ops {
+    R (*invoke)(const void*, Args&&...);
+    void (*copy)(void*, const void*);
+    void (*move)(void*, void*) noexcept;
+    void (*destroy)(void*) noexcept;
+  };
+
+  // Like std::function, a const call may still call a mutable lambda
+  template<typename Callable>
+  static constexpr Ops kOps = {
+    [](const void* storage, Args&&... args) -> R {
+      return std::invoke(*static_cast<Callable*>(const_cast<void*>(storage)), std::forward<Args>(args)...);
+    },
+    [](void* target, const void* source) { new (target) Callable(*static_cast<const Callable*>(source)); },
+    [](void* target, void* source) noexcept { new (target) Callable(std::move(*static_cast<Callable*>(source))); },
+    [](void* storage) noexcept { static_cast<Callable*>(storage)->~Callable(); },
+  };
+
+  alignas(std::max_align_t) unsigned char storage_[Capacity];
+  const Ops* ops_ = nullptr;
+};
+
+// func and Wrapped of forwarding.cc, counting instead of printing
+static int lvalue_calls = 0;
+static int rvalue_calls = 0;
+static int wrapped_copies = 0;
+
+void func(std::string&) { ++lvalue_calls; }
+void func(std::string&&) { ++rvalue_calls; }
+
+class Wrapped {
+public:
+  Wrapped() {}
+  Wrapped(const Wrapped&) { ++wrapped_copies; }
+  Wrapped(Wrapped&&) noexcept {}
+};
+
+/*
+ * perfect_forwarder of forwarding.cc with the target passed in.
+ */
+template<typename T>
+void perfect_forwarder(function_ref<void(T&&)> callback, T&& param) {
+  callback(std::forward<T>(param));
+}
+
+void ShowForwarding() {
+  std::string song_name{"The Rains of Castamere"};
+  perfect_forwarder<std::string&>(static_cast<void (*)(std::string&)>(func), song_name);
+  perfect_forwarder<std::string>(static_cast<void (*)(std::string&&)>(func), std::string{"Hands of Gold"});
+  printf("%-*s => %d\n", 50, "func(std::string&) calls", lvalue_calls);
+  printf("%-*s => %d\n", 50, "func(std::string&&) calls", rvalue_calls);
+
+  // Wrapped is moved or referenced on the way, never copied
+  Wrapped wrapped;
+  auto keep = [](Wrapped&& moved) { Wrapped kept{std::move(moved)}; };
+  function_ref<void(Wrapped&&)> by_ref{keep};
+  by_ref(std::move(wrapped));
+  inplace_function<void(Wrapped&&)> in_place{keep};
+  in_place(Wrapped{});
+  printf("%-*s => %d\n", 50, "Copies of Wrapped", wrapped_copies);
+
+  // 48 bytes of captures
+  long a = 1, b = 2, c = 3, d = 4, e = 5, f = 6;
+  auto large = [a, b, c, d, e, f](long x) { return x + a + b + c + d + e + f; };
+  std::size_t before = allocation_count;
+  std::function<long(long)> std_function{large};
+  printf("%-*s => %zu\n", 50, "Allocations of std::function, 48 byte capture", allocation_count - before);
+  before = allocation_count;
+  inplace_function<long(long), 48> inplace{large};
+  function_ref<long(long)> ref{large};
+  printf("%-*s => %zu\n", 50, "Allocations of inplace_function and function_ref", allocation_count - before);
+  printf("%-*s => %ld %ld %ld\n\n", 50, "Results", std_function(1), inplace(1), ref(1));
+}
+
+template<typename Callback>
+__attribute__((noinline)) long CallTemplate(const Callback& callback, std::size_t count) {
+  long total = 0;
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    total += callback(static_cast<long>(idx));
+    DoNotOptimize(total);
+  }
+  return total;
+}
+
+__attribute__((noinline)) long CallFunctionRef(function_ref<long(long)> callback, std::size_t count) {
+  long total = 0;
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    total += callback(static_cast<long>(idx));
+    DoNotOptimize(total);
+  }
+  return total;
+}
+
+__attribute__((noinline)) long CallInplace(const inplace_function<long(long), 48>& callback, std::size_t count) {
+  long total = 0;
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    total += callback(static_cast<long>(idx));
+    DoNotOptimize(total);
+  }
+  return total;
+}
+
+__attribute__((noinline)) long CallStdFunction(const std::function<long(long)>& callback, std::size_t count) {
+  long total = 0;
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    total += callback(static_cast<long>(idx));
+    DoNotOptimize(total);
+  }
+  return total;
+}
+
+void BenchmarkCallbacks(std::size_t count) {
+  long a = 1, b = 2, c = 3, d = 4, e = 5, f = 6;
+  auto large = [a, b, c, d, e, f](long x) { return x ^ (a + b + c + d + e + f); };
+
+  long template_total = 0;
+  long ref_total = 0;
+  long inplace_total = 0;
+  long std_total = 0;
+  double template_ms = MeasureBestMs(3, [&] { template_total = CallTemplate(large, count); });
+  double ref_ms = MeasureBestMs(3, [&] { ref_total = CallFunctionRef(large, count); });
+  inplace_function<long(long), 48> inplace{large};
+  double inplace_ms = MeasureBestMs(3, [&] { inplace_total = CallInplace(inplace, count); });
+  std::function<long(long)> std_function{large};
+  double std_ms = MeasureBestMs(3, [&] { std_total = CallStdFunction(std_function, count); });
+
+  if (template_total != ref_total || template_total != inplace_total || template_total != std_total) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  // Construct, call once and destroy, the way a callback parameter is used
+  std::size_t before = allocation_count;
+  long construct_total = 0;
+  double std_construct_ms = MeasureBestMs(3, [&] {
+    construct_total = 0;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      long g = static_cast<long>(idx);
+      construct_total += CallStdFunction([a, b, c, d, e, g](long x) { return x + a + b + c + d + e + g; }, 1);
+    }
+  });
+  std::size_t std_allocations = (allocation_count - before) / 3;
+
+  before = allocation_count;
+  long inplace_construct_total = 0;
+  double inplace_construct_ms = MeasureBestMs(3, [&] {
+    inplace_construct_total = 0;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      long g = static_cast<long>(idx);
+      inplace_construct_total += CallInplace([a, b, c, d, e, g](long x) { return x + a + b + c + d + e + g; }, 1);
+    }
+  });
+  std::size_t inplace_allocations = (allocation_count - before) / 3;
+
+  before = allocation_count;
+  long ref_construct_total = 0;
+  double ref_construct_ms = MeasureBestMs(3, [&] {
+    ref_construct_total = 0;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      long g = static_cast<long>(idx);
+      ref_construct_total += CallFunctionRef([a, b, c, d, e, g](long x) { return x + a + b + c + d + e + g; }, 1);
+    }
+  });
+  std::size_t ref_allocations = (allocation_count - before) / 3;
+
+  if (construct_total != inplace_construct_total || construct_total != ref_construct_total) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu calls through a 48 byte capture\n", count);
+  LOG_BENCH("template parameter", template_ms, count);
+  LOG_BENCH("function_ref", ref_ms, count);
+  LOG_BENCH("inplace_function", inplace_ms, count);
+  LOG_BENCH("std::function", std_ms, count);
+  printf("%zu constructions, one call each\n", count);
+  LOG_BENCH("function_ref", ref_construct_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", ref_allocations);
+  LOG_BENCH("inplace_function", inplace_construct_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", inplace_allocations);
+  LOG_BENCH("std::function", std_construct_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", std_allocations);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 50'000'000;
+  ShowForwarding();
+  BenchmarkCallbacks(count);
+}
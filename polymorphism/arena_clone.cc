@@ -0,0 +1,213 @@
+/*
+ * Arena-backed polymorphic cloning
+ *
+ * Derived::Clone() in c21_67.cc returns std::make_unique<Derived>(*this), so
+ * every clone is one small heap allocation. Cloning a large polymorphic
+ * collection then means as many calls to operator new as there are objects.
+ *
+ * Here Clone() takes a CloneArena instead. The arena carves objects out of a
+ * std::pmr::monotonic_buffer_resource, which asks its upstream resource for a
+ * few large, geometrically growing blocks. The arena also remembers how to
+ * destroy every object it constructed and destroys them, in reverse order, when
+ * it goes out of scope. Clones never outlive their arena.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o arena_clone.out arena_clone.cc
+ *
+ */
+
+#include <stdio.h>
+#include <cstdlib>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../common/allocation_counter.h"
+#include "../common/timer.h"
+
+/*
+ * Forwards to another resource and counts how many blocks it hands out.
+ */
+class CountingResource : public std::pmr::memory_resource {
+public:
+  explicit CountingResource(std::pmr::memory_resource* upstream) : upstream_{upstream} {}
+  std::size_t GetAllocationCount() const { return allocation_count_; }
+  std::size_t GetAllocatedBytes() const { return allocated_bytes_; }
+
+private:
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+    ++allocation_count_;
+    allocated_bytes_ += bytes;
+    return upstream_->allocate(bytes, alignment);
+  }
+  void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override {
+    upstream_->deallocate(ptr, bytes, alignment);
+  }
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+
+  std::pmr::memory_resource* upstream_;
+  std::size_t allocation_count_ = 0;
+  std::size_t allocated_bytes_ = 0;
+};
+
+/*
+ * Owns every object constructed through Make(). Memory comes from a monotonic
+ * buffer and is released all at once, objects are destroyed when the arena is.
+ */
+class CloneArena {
+public:
+  explicit CloneArena(std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+    : buffer_{upstream}, destructors_{&buffer_} {}
+
+  CloneArena(const CloneArena&) = delete;
+  CloneArena& operator=(const CloneArena&) = delete;
+  CloneArena(CloneArena&&) = delete;
+  CloneArena& operator=(CloneArena&&) = delete;
+
+  ~CloneArena() {
+    for (auto it = destructors_.rbegin(); it != destructors_.rend(); ++it) {
+      it->destroy(it->object);
+    }
+  }
+
+  template<typename T, typename... Args>
+  T* Make(Args&&... args) {
+    void* mem = buffer_.allocate(sizeof(T), alignof(T));
+    T* object = new (mem) T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      destructors_.push_back({object, [](void* ptr) { static_cast<T*>(ptr)->~T(); }});
+    }
+    return object;
+  }
+
+  void Reserve(std::size_t object_count) {
+    destructors_.reserve(object_count);
+  }
+
+  std::pmr::memory_resource* GetResource() { return &buffer_; }
+
+private:
+  struct Destructor {
+    void* object;
+    void (*destroy)(void*);
+  };
+
+  std::pmr::monotonic_buffer_resource buffer_;
+  std::pmr::vector<Destructor> destructors_;
+};
+
+class Base {
+public:
+  Base() = default;
+  virtual ~Base() = default;
+  Base(Base&&) = default;
+  Base& operator=(Base&&) = default;
+  Base(const Base&) = default;
+  Base& operator=(const Base&) = default;
+
+  virtual std::unique_ptr<Base> Clone() const = 0;
+  // The copy belongs to `arena`, it must not be deleted by the caller
+  virtual Base* Clone(CloneArena& arena) const = 0;
+  virtual const char* GetName() const { return "Base"; }
+};
+
+class Derived : public Base {
+public:
+  std::unique_ptr<Base> Clone() const override {
+    return std::make_unique<Derived>(*this);
+  }
+  Base* Clone(CloneArena& arena) const override {
+    return arena.Make<Derived>(*this);
+  }
+  const char* GetName() const override { return "Derived"; }
+};
+
+class OtherDerived : public Base {
+public:
+  explicit OtherDerived(double hp) : hp_{hp} {}
+  std::unique_ptr<Base> Clone() const override {
+    return std::make_unique<OtherDerived>(*this);
+  }
+  Base* Clone(CloneArena& arena) const override {
+    return arena.Make<OtherDerived>(*this);
+  }
+  const char* GetName() const override { return "OtherDerived"; }
+private:
+  double hp_;
+};
+
+/*
+ * Clones a heterogeneous container in one pass. The returned vector of
+ * pointers lives in the arena as well.
+ */
+std::pmr::vector<Base*> CloneAll(const std::vector<std::unique_ptr<Base>>& sources, CloneArena& arena) {
+  std::pmr::vector<Base*> clones{arena.GetResource()};
+  clones.reserve(sources.size());
+  arena.Reserve(sources.size());
+  for (const auto& source : sources) {
+    clones.push_back(source->Clone(arena));
+  }
+  return clones;
+}
+
+void ShowArenaClone() {
+  Derived derived;
+  Base& base_ref = derived;
+
+  CloneArena arena;
+  Base* copy_ptr = base_ref.Clone(arena);
+  printf("%-*s => %s\n", 50, "Name of arena clone", copy_ptr->GetName());
+  printf("%-*s => %p\n\n", 50, "Address of arena clone", (void*)copy_ptr);
+  // copy_ptr is destroyed together with arena
+}
+
+void BenchmarkClone(std::size_t count) {
+  std::vector<std::unique_ptr<Base>> sources;
+  sources.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    if (idx % 2 == 0) {
+      sources.push_back(std::make_unique<Derived>());
+    } else {
+      sources.push_back(std::make_unique<OtherDerived>(static_cast<double>(idx)));
+    }
+  }
+
+  {
+    std::size_t news_before = allocation_count;
+    double ms = MeasureMs([&] {
+      std::vector<std::unique_ptr<Base>> clones;
+      clones.reserve(sources.size());
+      for (const auto& source : sources) {
+        clones.push_back(source->Clone());
+      }
+      DoNotOptimize(clones.data());
+    });
+    printf("%-*s => %zu\n", 50, "operator new calls with unique_ptr Clone()", allocation_count - news_before);
+    LOG_BENCH("clone + destroy with unique_ptr Clone()", ms, count);
+  }
+
+  {
+    CountingResource upstream{std::pmr::new_delete_resource()};
+    std::size_t news_before = allocation_count;
+    double ms = MeasureMs([&] {
+      CloneArena arena{&upstream};
+      std::pmr::vector<Base*> clones = CloneAll(sources, arena);
+      DoNotOptimize(clones.data());
+    });
+    printf("%-*s => %zu\n", 50, "upstream allocations with CloneArena", upstream.GetAllocationCount());
+    printf("%-*s => %zu\n", 50, "upstream bytes with CloneArena", upstream.GetAllocatedBytes());
+    printf("%-*s => %zu\n", 50, "operator new calls with CloneArena", allocation_count - news_before);
+    LOG_BENCH("clone + destroy with CloneArena", ms, count);
+  }
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+  ShowArenaClone();
+  BenchmarkClone(count);
+}
@@ -0,0 +1,295 @@
+/*
+ * Polymorphic value type with a small buffer
+ *
+ * ShowSlicingWhenCopy() in c21_67.cc shows `auto copy_ref = abs_ref;` slicing a
+ * DerivedPerson down to a BasePerson. Clone() fixes the slicing but always
+ * allocates on the heap.
+ *
+ * poly_value<Base, BufferSize> behaves like a value of the dynamic type:
+ *
+ *  - Copying it copies the derived object (no slicing).
+ *  - Derived objects that fit into BufferSize bytes and whose move constructor
+ *    is noexcept are stored inline, without a heap allocation.
+ *  - Bigger objects (or ones that may throw while moving) go to the heap, and
+ *    moving the poly_value then only steals the pointer.
+ *  - Move operations are noexcept, so std::vector<poly_value<Base>> relocates
+ *    its elements by moving when it grows.
+ *
+ * Operations for each derived type are kept in a static table of function
+ * pointers, the same way a vtable is laid out, so Base does not need a Clone().
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o poly_value.out poly_value.cc
+ *
+ */
+
+#include <stdio.h>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+template<typename Base, std::size_t BufferSize = 32>
+class poly_value {
+public:
+  /*
+   * Takes the object by its static type. Any reference to a class that can be
+   * derived from may refer to a more derived object, which copying it would
+   * slice, so only final classes are accepted here. Use Make<Derived>() for
+   * the others.
+   */
+  template<typename Derived, typename = std::enable_if_t<std::is_base_of_v<Base, std::decay_t<Derived>>>>
+  poly_value(Derived&& derived) {
+    static_assert(std::is_final_v<std::decay_t<Derived>>,
+                  "poly_value could slice a non-final class, use Make<Derived>()");
+    using Type = std::decay_t<Derived>;
+    if constexpr (FitsInline<Type>()) {
+      ptr_ = new (&buffer_) Type(std::forward<Derived>(derived));
+    } else {
+      ptr_ = new Type(std::forward<Derived>(derived));
+    }
+    ops_ = &kOps<Type>;
+  }
+
+  template<typename Derived, typename... Args>
+  static poly_value Make(Args&&... args) {
+    return poly_value{std::in_place_type<Derived>, std::forward<Args>(args)...};
+  }
+
+  ~poly_value() {
+    Reset();
+  }
+
+  poly_value(const poly_value& rhs) : ops_{rhs.ops_} {
+    ptr_ = ops_ ? ops_->copy(rhs.ptr_, &buffer_) : nullptr;
+  }
+
+  poly_value(poly_value&& rhs) noexcept : ops_{rhs.ops_} {
+    ptr_ = ops_ ? ops_->move(rhs.ptr_, &buffer_) : nullptr;
+    rhs.ops_ = nullptr;
+    rhs.ptr_ = nullptr;
+  }
+
+  // Copy-and-swap gives the strong guarantee if the derived copy throws
+  poly_value& operator=(const poly_value& rhs) {
+    if (this != &rhs) {
+      poly_value copy{rhs};
+      *this = std::move(copy);
+    }
+    return *this;
+  }
+
+  poly_value& operator=(poly_value&& rhs) noexcept {
+    if (this != &rhs) {
+      Reset();
+      ops_ = rhs.ops_;
+      ptr_ = ops_ ? ops_->move(rhs.ptr_, &buffer_) : nullptr;
+      rhs.ops_ = nullptr;
+      rhs.ptr_ = nullptr;
+    }
+    return *this;
+  }
+
+  Base* operator->() { return ptr_; }
+  const Base* operator->() const { return ptr_; }
+  Base& operator*() { return *ptr_; }
+  const Base& operator*() const { return *ptr_; }
+
+  // Moved-from poly_values are empty
+  bool HasValue() const { return ptr_ != nullptr; }
+  bool IsInline() const {
+    return ops_ != nullptr && ops_->is_inline;
+  }
+
+private:
+  using Buffer = std::aligned_storage_t<BufferSize, alignof(std::max_align_t)>;
+
+  struct Ops {
+    Base* (*copy)(const Base* src, Buffer* buffer);
+    // Inline objects are move constructed into `buffer`, heap ones hand over the pointer
+    Base* (*move)(Base* src, Buffer* buffer) noexcept;
+    void (*destroy)(Base* ptr) noexcept;
+    // ptr_ cannot tell, Base need not sit at the start of the derived object
+    bool is_inline;
+  };
+
+  template<typename Type>
+  static constexpr bool FitsInline() {
+    return sizeof(Type) <= BufferSize && alignof(Type) <= alignof(Buffer) &&
+           std::is_nothrow_move_constructible_v<Type>;
+  }
+
+  template<typename Type>
+  static Base* Copy(const Base* src, Buffer* buffer) {
+    const Type& typed = static_cast<const Type&>(*src);
+    if constexpr (FitsInline<Type>()) {
+      return new (buffer) Type(typed);
+    } else {
+      return new Type(typed);
+    }
+  }
+
+  template<typename Type>
+  static Base* Move(Base* src, Buffer* buffer) noexcept {
+    if constexpr (FitsInline<Type>()) {
+      Type& typed = static_cast<Type&>(*src);
+      Base* moved = new (buffer) Type(std::move(typed));
+      typed.~Type();
+      return moved;
+    } else {
+      return src;
+    }
+  }
+
+  template<typename Type>
+  static void Destroy(Base* ptr) noexcept {
+    if constexpr (FitsInline<Type>()) {
+      static_cast<Type*>(ptr)->~Type();
+    } else {
+      delete static_cast<Type*>(ptr);
+    }
+  }
+
+  template<typename Type>
+  static constexpr Ops kOps{&Copy<Type>, &Move<Type>, &Destroy<Type>, FitsInline<Type>()};
+
+  template<typename Derived, typename... Args>
+  explicit poly_value(std::in_place_type_t<Derived>, Args&&... args) {
+    if constexpr (FitsInline<Derived>()) {
+      ptr_ = new (&buffer_) Derived(std::forward<Args>(args)...);
+    } else {
+      ptr_ = new Derived(std::forward<Args>(args)...);
+    }
+    ops_ = &kOps<Derived>;
+  }
+
+  void Reset() noexcept {
+    if (ops_) {
+      ops_->destroy(ptr_);
+      ops_ = nullptr;
+      ptr_ = nullptr;
+    }
+  }
+
+  Buffer buffer_;
+  const Ops* ops_ = nullptr;
+  Base* ptr_ = nullptr;
+};
+
+class BasePerson {
+public:
+  BasePerson() = default;
+  virtual ~BasePerson() = default;
+  BasePerson(BasePerson&&) = default;
+  BasePerson& operator=(BasePerson&&) = default;
+  BasePerson(const BasePerson&) = default;
+  BasePerson& operator=(const BasePerson&) = default;
+  virtual const char* GetName() const { return "BasePerson"; }
+  virtual int GetId() const { return 0; }
+  // Only needed by the unique_ptr side of the benchmark
+  virtual std::unique_ptr<BasePerson> Clone() const = 0;
+};
+
+class DerivedPerson final : public BasePerson {
+public:
+  explicit DerivedPerson(int id) : id_{id} {}
+  const char* GetName() const override { return "DerivedPerson"; }
+  int GetId() const override { return id_; }
+  std::unique_ptr<BasePerson> Clone() const override {
+    return std::make_unique<DerivedPerson>(*this);
+  }
+private:
+  int id_;
+};
+
+// Too big for the default 32 byte buffer, lives on the heap
+class HeavyPerson final : public BasePerson {
+public:
+  explicit HeavyPerson(int id) : id_{id}, stats_{} {}
+  const char* GetName() const override { return "HeavyPerson"; }
+  int GetId() const override { return id_; }
+  std::unique_ptr<BasePerson> Clone() const override {
+    return std::make_unique<HeavyPerson>(*this);
+  }
+private:
+  int id_;
+  double stats_[16];
+};
+
+using PersonValue = poly_value<BasePerson>;
+
+static_assert(std::is_nothrow_move_constructible_v<PersonValue>);
+static_assert(std::is_nothrow_move_assignable_v<PersonValue>);
+
+void ShowNoSlicing() {
+  DerivedPerson person{1};
+  PersonValue value{person};
+  printf("%-*s => %s\n", 50, "Name of `value`", value->GetName());
+
+  // Copying the value copies the DerivedPerson, not the BasePerson part of it
+  PersonValue copy_value = value;
+  printf("%-*s => %s\n", 50, "Name of `copy_value`", copy_value->GetName());
+  printf("%-*s => %d\n", 50, "Is `copy_value` stored inline?", copy_value.IsInline());
+
+  PersonValue heavy_value = PersonValue::Make<HeavyPerson>(2);
+  printf("%-*s => %s\n", 50, "Name of `heavy_value`", heavy_value->GetName());
+  printf("%-*s => %d\n\n", 50, "Is `heavy_value` stored inline?", heavy_value.IsInline());
+}
+
+/*
+ * Builds a container, grows it, copies it as a whole and reads every element,
+ * which is what container-heavy code spends its time on.
+ */
+void BenchmarkContainers(std::size_t count) {
+  long long ptr_sum = 0;
+  double ptr_ms = MeasureBestMs(3, [&] {
+    ptr_sum = 0;
+    std::vector<std::unique_ptr<BasePerson>> persons;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      persons.push_back(std::make_unique<DerivedPerson>(static_cast<int>(idx)));
+    }
+    std::vector<std::unique_ptr<BasePerson>> copy_persons;
+    copy_persons.reserve(persons.size());
+    for (const auto& person : persons) {
+      copy_persons.push_back(person->Clone());
+    }
+    for (const auto& person : copy_persons) {
+      ptr_sum += person->GetId();
+    }
+  });
+
+  long long value_sum = 0;
+  double value_ms = MeasureBestMs(3, [&] {
+    value_sum = 0;
+    std::vector<PersonValue> persons;
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      persons.push_back(PersonValue::Make<DerivedPerson>(static_cast<int>(idx)));
+    }
+    std::vector<PersonValue> copy_persons = persons;
+    for (const auto& person : copy_persons) {
+      value_sum += person->GetId();
+    }
+  });
+
+  DoNotOptimize(ptr_sum);
+  DoNotOptimize(value_sum);
+  if (ptr_sum != value_sum) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("Build, grow, copy and scan %zu persons\n", count);
+  LOG_BENCH("std::vector<std::unique_ptr<BasePerson>> + Clone()", ptr_ms, count);
+  LOG_BENCH("std::vector<poly_value<BasePerson>>", value_ms, count);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+  ShowNoSlicing();
+  BenchmarkContainers(count);
+}
@@ -0,0 +1,286 @@
+/*
+ * Static dispatch for closed hierarchies
+ *
+ * c21_67.cc resolves GetName() and Clone() through a vtable. When the set of
+ * derived types is known up front (a closed hierarchy), the type switch can be
+ * resolved without virtual functions:
+ *
+ *  - Every object is stored by value in a std::variant, so there is no pointer
+ *    chase to reach it.
+ *  - Dispatch goes through a jump table generated at compile time, one entry per
+ *    alternative. Each entry is a direct call, so the callee can be inlined into
+ *    the entry.
+ *  - Runs of objects with the same dynamic type are dispatched once per run, and
+ *    the loop over the run is a plain, fully inlined loop over one concrete type.
+ *
+ * The benchmark compares call throughput of the virtual and static versions over
+ * the same sequence of objects (10M by default, first argument overrides it).
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o static_dispatch.out static_dispatch.cc
+ *
+ */
+
+#include <stdio.h>
+#include <array>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+#include "../common/timer.h"
+
+/*
+ * Virtual version, the same shape as BasePerson/DerivedPerson in c21_67.cc
+ */
+class BasePerson {
+public:
+  BasePerson() = default;
+  virtual ~BasePerson() = default;
+  BasePerson(BasePerson&&) = default;
+  BasePerson& operator=(BasePerson&&) = default;
+  BasePerson(const BasePerson&) = default;
+  BasePerson& operator=(const BasePerson&) = default;
+  virtual const char* GetName() const { return "BasePerson"; }
+  virtual int GetPower() const { return 0; }
+};
+
+class VirtualKnight : public BasePerson {
+public:
+  explicit VirtualKnight(int level) : level_{level} {}
+  const char* GetName() const override { return "Knight"; }
+  int GetPower() const override { return level_ * 3; }
+private:
+  int level_;
+};
+
+class VirtualWildling : public BasePerson {
+public:
+  explicit VirtualWildling(int level) : level_{level} {}
+  const char* GetName() const override { return "Wildling"; }
+  int GetPower() const override { return level_ + 7; }
+private:
+  int level_;
+};
+
+class VirtualMaester : public BasePerson {
+public:
+  explicit VirtualMaester(int level) : level_{level} {}
+  const char* GetName() const override { return "Maester"; }
+  int GetPower() const override { return level_ >> 1; }
+private:
+  int level_;
+};
+
+/*
+ * Closed version. No base class and no virtual functions, every type only
+ * provides the members that the dispatcher calls.
+ */
+class Knight {
+public:
+  explicit Knight(int level) : level_{level} {}
+  const char* GetName() const { return "Knight"; }
+  int GetPower() const { return level_ * 3; }
+private:
+  int level_;
+};
+
+class Wildling {
+public:
+  explicit Wildling(int level) : level_{level} {}
+  const char* GetName() const { return "Wildling"; }
+  int GetPower() const { return level_ + 7; }
+private:
+  int level_;
+};
+
+class Maester {
+public:
+  explicit Maester(int level) : level_{level} {}
+  const char* GetName() const { return "Maester"; }
+  int GetPower() const { return level_ >> 1; }
+private:
+  int level_;
+};
+
+using ClosedPerson = std::variant<Knight, Wildling, Maester>;
+
+/*
+ * Builds a table of function pointers, one per alternative, at compile time.
+ * Entry I casts the variant storage to its I'th alternative and calls `Func`
+ * on it directly, so calling through the table is a single indirect jump
+ * without a vtable load.
+ */
+template<typename Variant, typename Func>
+class JumpTable {
+public:
+  using Result = decltype(std::declval<Func&>()(std::get<0>(std::declval<const Variant&>())));
+  using Entry = Result (*)(Func&, const Variant&);
+
+  static Result Dispatch(Func& func, const Variant& value) {
+    return table_[value.index()](func, value);
+  }
+
+private:
+  template<std::size_t I>
+  static Result Invoke(Func& func, const Variant& value) {
+    return func(*std::get_if<I>(&value));
+  }
+
+  template<std::size_t... I>
+  static constexpr auto MakeTable(std::index_sequence<I...>) {
+    return std::array<Entry, sizeof...(I)>{&Invoke<I>...};
+  }
+
+  static constexpr auto table_ = MakeTable(std::make_index_sequence<std::variant_size_v<Variant>>{});
+};
+
+template<typename Variant, typename Func>
+decltype(auto) StaticVisit(Func&& func, const Variant& value) {
+  return JumpTable<Variant, std::remove_reference_t<Func>>::Dispatch(func, value);
+}
+
+/*
+ * Calls `func` once for every run of consecutive elements that share a dynamic
+ * type. `func` receives the alternative index as an integral_constant together with
+ * the run, so the loop over the run is written against that type only.
+ */
+template<typename Variant, typename Func, std::size_t... I>
+void ForEachRunImpl(const std::vector<Variant>& values, Func& func, std::index_sequence<I...>) {
+  using RunFunc = void (*)(Func&, const Variant*, const Variant*);
+  static constexpr RunFunc table[] = {
+    [](Func& f, const Variant* first, const Variant* last) {
+      f(std::integral_constant<std::size_t, I>{}, first, last);
+    }...
+  };
+
+  const Variant* first = values.data();
+  const Variant* end = first + values.size();
+  while (first != end) {
+    const std::size_t index = first->index();
+    const Variant* last = first + 1;
+    while (last != end && last->index() == index) {
+      ++last;
+    }
+    table[index](func, first, last);
+    first = last;
+  }
+}
+
+template<typename Variant, typename Func>
+void ForEachRun(const std::vector<Variant>& values, Func&& func) {
+  ForEachRunImpl(values, func, std::make_index_sequence<std::variant_size_v<Variant>>{});
+}
+
+void ShowStaticDispatch() {
+  std::vector<ClosedPerson> persons{Knight{10}, Wildling{4}, Maester{8}};
+  for (const auto& person : persons) {
+    printf("%-*s => %d\n", 50,
+      StaticVisit([](const auto& p) { return p.GetName(); }, person),
+      StaticVisit([](const auto& p) { return p.GetPower(); }, person));
+  }
+  printf("\n");
+}
+
+/*
+ * Objects are created in short homogeneous runs, which is what a batch of
+ * records read from the same source usually looks like.
+ */
+std::vector<int> MakeKinds(std::size_t count) {
+  std::mt19937 gen{42};
+  std::uniform_int_distribution<int> kind_dist{0, 2};
+  std::uniform_int_distribution<int> run_dist{1, 64};
+  std::vector<int> kinds;
+  kinds.reserve(count);
+  while (kinds.size() < count) {
+    int kind = kind_dist(gen);
+    for (int run = run_dist(gen); run > 0 && kinds.size() < count; --run) {
+      kinds.push_back(kind);
+    }
+  }
+  return kinds;
+}
+
+void BenchmarkDispatch(std::size_t count) {
+  std::vector<int> kinds = MakeKinds(count);
+
+  std::vector<std::unique_ptr<BasePerson>> virtual_persons;
+  std::vector<ClosedPerson> closed_persons;
+  virtual_persons.reserve(count);
+  closed_persons.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    int level = static_cast<int>(idx & 0xff);
+    switch (kinds[idx]) {
+      case 0:
+        virtual_persons.push_back(std::make_unique<VirtualKnight>(level));
+        closed_persons.emplace_back(Knight{level});
+        break;
+      case 1:
+        virtual_persons.push_back(std::make_unique<VirtualWildling>(level));
+        closed_persons.emplace_back(Wildling{level});
+        break;
+      default:
+        virtual_persons.push_back(std::make_unique<VirtualMaester>(level));
+        closed_persons.emplace_back(Maester{level});
+        break;
+    }
+  }
+
+  long long virtual_sum = 0;
+  double virtual_ms = MeasureMs([&] {
+    for (const auto& person : virtual_persons) {
+      virtual_sum += person->GetPower();
+    }
+  });
+
+  long long visit_sum = 0;
+  double visit_ms = MeasureMs([&] {
+    for (const auto& person : closed_persons) {
+      visit_sum += std::visit([](const auto& p) { return p.GetPower(); }, person);
+    }
+  });
+
+  long long table_sum = 0;
+  double table_ms = MeasureMs([&] {
+    for (const auto& person : closed_persons) {
+      table_sum += StaticVisit([](const auto& p) { return p.GetPower(); }, person);
+    }
+  });
+
+  long long run_sum = 0;
+  double run_ms = MeasureMs([&] {
+    ForEachRun(closed_persons, [&](auto tag, const ClosedPerson* first, const ClosedPerson* last) {
+      constexpr std::size_t index = decltype(tag)::value;
+      long long local = 0;
+      for (; first != last; ++first) {
+        // Alternative is known for the whole run, so this inlines to plain arithmetic
+        local += std::get_if<index>(first)->GetPower();
+      }
+      run_sum += local;
+    });
+  });
+
+  DoNotOptimize(virtual_sum);
+  DoNotOptimize(visit_sum);
+  DoNotOptimize(table_sum);
+  DoNotOptimize(run_sum);
+  if (virtual_sum != visit_sum || virtual_sum != table_sum || virtual_sum != run_sum) {
+    printf("Dispatch results differ!\n");
+    std::exit(1);
+  }
+
+  printf("Calling GetPower() on %zu objects\n", count);
+  LOG_BENCH("virtual call through unique_ptr<BasePerson>", virtual_ms, count);
+  LOG_BENCH("std::visit on variant", visit_ms, count);
+  LOG_BENCH("generated jump table on variant", table_ms, count);
+  LOG_BENCH("generated jump table per homogeneous run", run_ms, count);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+  ShowStaticDispatch();
+  BenchmarkDispatch(count);
+}
@@ -0,0 +1,314 @@
+/*
+ * Type-partitioned polymorphic container
+ *
+ * A std::vector<std::unique_ptr<Base>> of mixed Derived types (c21_67.cc) costs
+ * a pointer chase and an indirect call per element. The objects are scattered
+ * over the heap and the branch predictor sees the dynamic types in random order.
+ *
+ * poly_collection<Base> groups objects by their dynamic type. Every type gets its
+ * own segment, a std::vector of that exact type, so objects of one type are
+ * contiguous in memory. for_each<Derived...>(func) walks the segments one by one:
+ *
+ *  - Segments whose type is listed in Derived... are iterated as a plain loop
+ *    over Derived&, so the member function is called directly (and inlined when
+ *    the class or the function is final).
+ *  - Any other segment is still iterated contiguously, but through Base&.
+ *
+ * Iteration order is by type, not by insertion order. Hardware cache misses are
+ * read through perf_event_open when the kernel allows it.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o type_partitioned_container.out type_partitioned_container.cc
+ *
+ */
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <type_traits>
+#include <typeindex>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+template<typename Base>
+class poly_collection {
+public:
+  /*
+   * The segment is picked by the static type. A reference to a class that can
+   * be derived from may refer to a more derived object, which would be sliced
+   * into the wrong segment, so only final classes are accepted. Use
+   * emplace<Derived>() for the others.
+   */
+  template<typename Derived>
+  void insert(Derived&& derived) {
+    using Type = std::decay_t<Derived>;
+    static_assert(std::is_final_v<Type>, "insert() could slice a non-final class, use emplace<Derived>()");
+    GetSegment<Type>().items_.push_back(std::forward<Derived>(derived));
+  }
+
+  template<typename Derived, typename... Args>
+  Derived& emplace(Args&&... args) {
+    return GetSegment<Derived>().items_.emplace_back(std::forward<Args>(args)...);
+  }
+
+  std::size_t size() const {
+    std::size_t total = 0;
+    for (const auto& entry : segments_) {
+      total += entry.segment->Size();
+    }
+    return total;
+  }
+
+  // Restores the static type of the listed segments, others go through Base&
+  template<typename... Derived, typename Func>
+  void for_each(Func&& func) {
+    for (auto& entry : segments_) {
+      if (!(ForEachIf<Derived>(entry, func) || ...)) {
+        SegmentBase& segment = *entry.segment;
+        char* item = segment.Data();
+        const std::size_t stride = segment.Stride();
+        for (std::size_t idx = 0, size = segment.Size(); idx < size; ++idx, item += stride) {
+          func(*segment.AsBase(item));
+        }
+      }
+    }
+  }
+
+private:
+  class SegmentBase {
+  public:
+    virtual ~SegmentBase() = default;
+    virtual std::size_t Size() const = 0;
+    virtual char* Data() = 0;
+    virtual std::size_t Stride() const = 0;
+    virtual Base* AsBase(char* item) const = 0;
+  };
+
+  template<typename Derived>
+  class Segment final : public SegmentBase {
+  public:
+    std::size_t Size() const override { return items_.size(); }
+    char* Data() override { return reinterpret_cast<char*>(items_.data()); }
+    std::size_t Stride() const override { return sizeof(Derived); }
+    Base* AsBase(char* item) const override { return reinterpret_cast<Derived*>(item); }
+    std::vector<Derived> items_;
+  };
+
+  struct Entry {
+    std::type_index type;
+    std::unique_ptr<SegmentBase> segment;
+  };
+
+  template<typename Derived>
+  Segment<Derived>& GetSegment() {
+    static_assert(std::is_base_of_v<Base, Derived>);
+    const std::type_index type{typeid(Derived)};
+    for (auto& entry : segments_) {
+      if (entry.type == type) {
+        return static_cast<Segment<Derived>&>(*entry.segment);
+      }
+    }
+    segments_.push_back({type, std::make_unique<Segment<Derived>>()});
+    return static_cast<Segment<Derived>&>(*segments_.back().segment);
+  }
+
+  template<typename Derived, typename Func>
+  static bool ForEachIf(Entry& entry, Func& func) {
+    if (entry.type != typeid(Derived)) {
+      return false;
+    }
+    for (Derived& item : static_cast<Segment<Derived>&>(*entry.segment).items_) {
+      func(item);
+    }
+    return true;
+  }
+
+  // A handful of types at most, a linear search beats hashing here
+  std::vector<Entry> segments_;
+};
+
+/*
+ * Counts last level cache misses of the calling thread. Reports -1 if
+ * perf_event_open is not permitted (e.g. in containers).
+ */
+class CacheMissCounter {
+public:
+  CacheMissCounter() {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+  ~CacheMissCounter() {
+    if (fd_ != -1) {
+      close(fd_);
+    }
+  }
+  CacheMissCounter(const CacheMissCounter&) = delete;
+  CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+
+  void Start() {
+    if (fd_ != -1) {
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  long long Stop() {
+    long long count = -1;
+    if (fd_ != -1) {
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+        count = -1;
+      }
+    }
+    return count;
+  }
+
+private:
+  int fd_;
+};
+
+class Base {
+public:
+  Base() = default;
+  virtual ~Base() = default;
+  Base(Base&&) = default;
+  Base& operator=(Base&&) = default;
+  Base(const Base&) = default;
+  Base& operator=(const Base&) = default;
+
+  virtual const char* GetName() const { return "Base"; }
+  virtual int GetPower() const = 0;
+};
+
+class Derived final : public Base {
+public:
+  explicit Derived(int level) : level_{level} {}
+  const char* GetName() const override { return "Derived"; }
+  int GetPower() const override { return level_ * 3; }
+private:
+  int level_;
+};
+
+class OtherDerived final : public Base {
+public:
+  explicit OtherDerived(int level) : level_{level} {}
+  const char* GetName() const override { return "OtherDerived"; }
+  int GetPower() const override { return level_ + 7; }
+private:
+  int level_;
+  double hp_ = 100.0;
+};
+
+class ThirdDerived final : public Base {
+public:
+  explicit ThirdDerived(int level) : level_{level} {}
+  const char* GetName() const override { return "ThirdDerived"; }
+  int GetPower() const override { return level_ >> 1; }
+private:
+  int level_;
+};
+
+void ShowTypePartitioning() {
+  poly_collection<Base> persons;
+  persons.emplace<Derived>(1);
+  persons.emplace<OtherDerived>(2);
+  persons.emplace<Derived>(3);
+  persons.emplace<ThirdDerived>(4);
+
+  // Grouped by type: Derived, Derived, OtherDerived, ThirdDerived
+  persons.for_each([](const Base& person) {
+    printf("%-*s => %p\n", 50, person.GetName(), (const void*)&person);
+  });
+  printf("\n");
+}
+
+void BenchmarkIteration(std::size_t count) {
+  std::mt19937 gen{42};
+  std::uniform_int_distribution<int> kind_dist{0, 2};
+
+  std::vector<std::unique_ptr<Base>> pointer_persons;
+  poly_collection<Base> partitioned_persons;
+  pointer_persons.reserve(count);
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    int level = static_cast<int>(idx & 0xff);
+    switch (kind_dist(gen)) {
+      case 0:
+        pointer_persons.push_back(std::make_unique<Derived>(level));
+        partitioned_persons.emplace<Derived>(level);
+        break;
+      case 1:
+        pointer_persons.push_back(std::make_unique<OtherDerived>(level));
+        partitioned_persons.emplace<OtherDerived>(level);
+        break;
+      default:
+        pointer_persons.push_back(std::make_unique<ThirdDerived>(level));
+        partitioned_persons.emplace<ThirdDerived>(level);
+        break;
+    }
+  }
+  // Shuffled like a long-running process would leave the heap
+  std::shuffle(pointer_persons.begin(), pointer_persons.end(), gen);
+
+  CacheMissCounter counter;
+
+  long long pointer_sum = 0;
+  counter.Start();
+  double pointer_ms = MeasureMs([&] {
+    for (const auto& person : pointer_persons) {
+      pointer_sum += person->GetPower();
+    }
+  });
+  long long pointer_misses = counter.Stop();
+
+  long long base_sum = 0;
+  counter.Start();
+  double base_ms = MeasureMs([&] {
+    partitioned_persons.for_each([&](const Base& person) { base_sum += person.GetPower(); });
+  });
+  long long base_misses = counter.Stop();
+
+  long long typed_sum = 0;
+  counter.Start();
+  double typed_ms = MeasureMs([&] {
+    partitioned_persons.for_each<Derived, OtherDerived, ThirdDerived>(
+      [&](const auto& person) { typed_sum += person.GetPower(); });
+  });
+  long long typed_misses = counter.Stop();
+
+  DoNotOptimize(pointer_sum);
+  DoNotOptimize(base_sum);
+  DoNotOptimize(typed_sum);
+  if (pointer_sum != base_sum || pointer_sum != typed_sum) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("Calling GetPower() on %zu objects\n", partitioned_persons.size());
+  LOG_BENCH("std::vector<std::unique_ptr<Base>>", pointer_ms, count);
+  LOG_BENCH("poly_collection<Base>, through Base&", base_ms, count);
+  LOG_BENCH("poly_collection<Base>, concrete types", typed_ms, count);
+  printf("%-*s => %lld\n", 50, "cache misses, std::vector<std::unique_ptr<Base>>", pointer_misses);
+  printf("%-*s => %lld\n", 50, "cache misses, poly_collection through Base&", base_misses);
+  printf("%-*s => %lld\n", 50, "cache misses, poly_collection concrete types", typed_misses);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10'000'000;
+  ShowTypePartitioning();
+  BenchmarkIteration(count);
+}
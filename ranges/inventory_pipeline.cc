@@ -0,0 +1,346 @@
+/*
+ * Lazy pipelines over PersonInventory
+ *
+ * "Items worth more than 3.0, with upper case names" is usually written with
+ * intermediate vectors: copy the matching names and values out, then build the
+ * upper case names from the copies. Every stage allocates and the data is
+ * walked once per stage.
+ *
+ * Here a pipeline is written as
+ *
+ *   Items(inventory) | Filter(pred) | Transform(func) | ToVector()
+ *
+ * and nothing runs until the sink is attached:
+ *
+ *  - Items() yields InventoryItem, a string_view/float pair pointing into the
+ *    inventory. Nothing is copied.
+ *  - Filter and Transform only record their callables. When a sink is attached
+ *    the stages are nested into one function, so all of them run in a single
+ *    loop over the inventory without intermediate containers.
+ *  - UpperCase() turns the name into UpperName, a view that upper cases
+ *    characters when they are read. The only string allocations are the ones
+ *    ToVector() makes for its results, and Sum() or Count() make none at all.
+ *
+ * A pipeline keeps a reference to the inventory, so the inventory has to
+ * outlive it; Items() of a temporary inventory does not compile.
+ *
+ * The benchmark counts allocations through common/allocation_counter.h.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o inventory_pipeline.out inventory_pipeline.cc
+ *
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../common/allocation_counter.h"
+#include "../common/timer.h"
+
+/*
+ * PersonInventory of perfect_forwarding_constructor_better.cc, with read
+ * access to its items and without the prints.
+ */
+class PersonInventory {
+public:
+  PersonInventory(const std::vector<float> values, std::vector<std::string> items)
+    : values_{values}, items_{items} {}
+  const std::vector<float>& Values() const { return values_; }
+  const std::vector<std::string>& Items() const { return items_; }
+private:
+  std::vector<float> values_;
+  std::vector<std::string> items_;
+};
+
+struct InventoryItem {
+  std::string_view name;
+  float value;
+};
+
+// Upper cases on read, so building it costs nothing
+struct UpperName {
+  std::string_view name;
+};
+
+template<typename Name>
+struct NamedValue {
+  Name name;
+  float value;
+};
+
+inline std::string Materialize(std::string_view name) {
+  return std::string{name};
+}
+
+inline std::string Materialize(UpperName upper) {
+  std::string name(upper.name.size(), '\0');
+  for (std::size_t idx = 0; idx < upper.name.size(); ++idx) {
+    name[idx] = static_cast<char>(toupper(static_cast<unsigned char>(upper.name[idx])));
+  }
+  return name;
+}
+
+inline std::pair<std::string, float> Materialize(const InventoryItem& item) {
+  return {Materialize(item.name), item.value};
+}
+
+template<typename Name>
+std::pair<std::string, float> Materialize(const NamedValue<Name>& item) {
+  return {Materialize(item.name), item.value};
+}
+
+template<typename Pred>
+struct FilterStage {
+  Pred pred;
+
+  template<typename Next>
+  auto Wrap(Next next) const {
+    return [pred = pred, next](const auto& element) mutable {
+      if (pred(element)) {
+        next(element);
+      }
+    };
+  }
+};
+
+template<typename Func>
+struct TransformStage {
+  Func func;
+
+  template<typename Next>
+  auto Wrap(Next next) const {
+    return [func = func, next](const auto& element) mutable {
+      next(func(element));
+    };
+  }
+};
+
+template<typename Pred>
+FilterStage<Pred> Filter(Pred pred) { return {std::move(pred)}; }
+
+template<typename Func>
+TransformStage<Func> Transform(Func func) { return {std::move(func)}; }
+
+inline auto UpperCase() {
+  return Transform([](const auto& item) { return NamedValue<UpperName>{UpperName{item.name}, item.value}; });
+}
+
+struct ToVector {};
+struct Sum {};
+struct Count {};
+
+template<typename T> struct is_sink : std::false_type {};
+template<> struct is_sink<ToVector> : std::true_type {};
+template<> struct is_sink<Sum> : std::true_type {};
+template<> struct is_sink<Count> : std::true_type {};
+
+/*
+ * A source and the stages piped after it. Attaching a sink nests the stages
+ * from the last to the first around the sink and runs the source once.
+ */
+template<typename... Stages>
+class Pipeline {
+public:
+  Pipeline(const PersonInventory& inventory, std::tuple<Stages...> stages)
+    : inventory_{inventory}, stages_{std::move(stages)} {}
+
+  template<typename Next>
+  auto operator|(Next next) const {
+    if constexpr (is_sink<Next>::value) {
+      return Drain(next);
+    } else {
+      return Pipeline<Stages..., Next>{inventory_, std::tuple_cat(stages_, std::make_tuple(std::move(next)))};
+    }
+  }
+
+private:
+  template<typename Consumer>
+  void Run(Consumer consumer) const {
+    auto fused = FuseFrom<0>(consumer);
+    const auto& names = inventory_.Items();
+    const auto& values = inventory_.Values();
+    // The constructor does not check that both vectors have the same length
+    const std::size_t size = std::min(names.size(), values.size());
+    for (std::size_t idx = 0; idx < size; ++idx) {
+      fused(InventoryItem{names[idx], values[idx]});
+    }
+  }
+
+  template<std::size_t I, typename Consumer>
+  auto FuseFrom(Consumer consumer) const {
+    if constexpr (I == sizeof...(Stages)) {
+      return consumer;
+    } else {
+      return std::get<I>(stages_).Wrap(FuseFrom<I + 1>(consumer));
+    }
+  }
+
+  auto Drain(ToVector) const {
+    std::vector<std::pair<std::string, float>> result;
+    Run([&result](const auto& element) { result.push_back(Materialize(element)); });
+    return result;
+  }
+
+  float Drain(Sum) const {
+    float sum = 0.0f;
+    Run([&sum](const auto& element) { sum += element.value; });
+    return sum;
+  }
+
+  std::size_t Drain(Count) const {
+    std::size_t count = 0;
+    Run([&count](const auto&) { ++count; });
+    return count;
+  }
+
+  const PersonInventory& inventory_;
+  std::tuple<Stages...> stages_;
+};
+
+inline Pipeline<> Items(const PersonInventory& inventory) {
+  return Pipeline<>{inventory, std::tuple<>{}};
+}
+
+// The pipeline would outlive the temporary it refers to
+Pipeline<> Items(const PersonInventory&&) = delete;
+
+/*
+ * What the pipeline replaces: every stage copies into a new vector.
+ */
+std::vector<std::pair<std::string, float>> EagerValuableUpper(const PersonInventory& inventory, float threshold) {
+  std::vector<std::string> names;
+  std::vector<float> values;
+  const std::size_t size = std::min(inventory.Items().size(), inventory.Values().size());
+  for (std::size_t idx = 0; idx < size; ++idx) {
+    if (inventory.Values()[idx] > threshold) {
+      names.push_back(inventory.Items()[idx]);
+      values.push_back(inventory.Values()[idx]);
+    }
+  }
+  std::vector<std::string> upper_names;
+  for (const auto& name : names) {
+    std::string upper = name;
+    for (char& letter : upper) {
+      letter = static_cast<char>(toupper(static_cast<unsigned char>(letter)));
+    }
+    upper_names.push_back(upper);
+  }
+  std::vector<std::pair<std::string, float>> result;
+  for (std::size_t idx = 0; idx < upper_names.size(); ++idx) {
+    result.emplace_back(upper_names[idx], values[idx]);
+  }
+  return result;
+}
+
+float EagerValuableSum(const PersonInventory& inventory, float threshold) {
+  std::vector<float> values;
+  const std::size_t size = std::min(inventory.Items().size(), inventory.Values().size());
+  for (std::size_t idx = 0; idx < size; ++idx) {
+    if (inventory.Values()[idx] > threshold) {
+      values.push_back(inventory.Values()[idx]);
+    }
+  }
+  float sum = 0.0f;
+  for (float value : values) {
+    sum += value;
+  }
+  return sum;
+}
+
+auto IsValuable(float threshold) {
+  return [threshold](const auto& item) { return item.value > threshold; };
+}
+
+void ShowPipeline() {
+  PersonInventory inventory{{5.5, 3.5, 2.5, 1.0}, {"Longclaw", "Shield", "Dagger", "Sack"}};
+
+  auto valuable_upper = Items(inventory) | Filter(IsValuable(3.0f)) | UpperCase();
+  std::size_t before = allocation_count;
+  auto materialized = valuable_upper | ToVector();
+  std::size_t allocations = allocation_count - before;
+
+  for (const auto& [name, value] : materialized) {
+    printf("%-*s => %f\n", 50, name.c_str(), value);
+  }
+  printf("%-*s => %zu\n", 50, "Allocations made by ToVector()", allocations);
+
+  before = allocation_count;
+  float sum = Items(inventory) | Filter(IsValuable(3.0f)) | Sum();
+  printf("%-*s => %f\n", 50, "Sum of valuable items", sum);
+  printf("%-*s => %zu\n\n", 50, "Allocations made by Sum()", allocation_count - before);
+}
+
+PersonInventory MakeInventory(std::size_t count) {
+  const char* kinds[] = {"longsword of house", "shield of house", "dagger of house", "sack of house"};
+  std::mt19937 gen{42};
+  std::uniform_real_distribution<float> value_dist{0.0f, 6.0f};
+  std::vector<float> values;
+  std::vector<std::string> items;
+  for (std::size_t idx = 0; idx < count; ++idx) {
+    values.push_back(value_dist(gen));
+    items.push_back(std::string{kinds[idx % 4]} + " " + std::to_string(idx));
+  }
+  return PersonInventory{values, items};
+}
+
+void BenchmarkPipeline(std::size_t count) {
+  PersonInventory inventory = MakeInventory(count);
+  constexpr float kThreshold = 3.0f;
+
+  std::vector<std::pair<std::string, float>> eager_result;
+  std::vector<std::pair<std::string, float>> lazy_result;
+  float eager_sum = 0.0f;
+  float lazy_sum = 0.0f;
+
+  std::size_t before = allocation_count;
+  double eager_ms = MeasureMs([&] { eager_result = EagerValuableUpper(inventory, kThreshold); });
+  std::size_t eager_allocations = allocation_count - before;
+
+  before = allocation_count;
+  double lazy_ms = MeasureMs([&] {
+    lazy_result = Items(inventory) | Filter(IsValuable(kThreshold)) | UpperCase() | ToVector();
+  });
+  std::size_t lazy_allocations = allocation_count - before;
+
+  before = allocation_count;
+  double eager_sum_ms = MeasureMs([&] { eager_sum = EagerValuableSum(inventory, kThreshold); DoNotOptimize(eager_sum); });
+  std::size_t eager_sum_allocations = allocation_count - before;
+
+  before = allocation_count;
+  double lazy_sum_ms = MeasureMs([&] {
+    lazy_sum = Items(inventory) | Filter(IsValuable(kThreshold)) | Sum();
+    DoNotOptimize(lazy_sum);
+  });
+  std::size_t lazy_sum_allocations = allocation_count - before;
+
+  if (eager_result != lazy_result || eager_sum != lazy_sum) {
+    printf("Results differ!\n");
+    std::exit(1);
+  }
+
+  printf("%zu items, %zu valuable\n", count, lazy_result.size());
+  LOG_BENCH("upper case valuable items, eager vectors", eager_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", eager_allocations);
+  LOG_BENCH("upper case valuable items, fused pipeline", lazy_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", lazy_allocations);
+  LOG_BENCH("sum of valuable items, eager vectors", eager_sum_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", eager_sum_allocations);
+  LOG_BENCH("sum of valuable items, fused pipeline", lazy_sum_ms, count);
+  printf("%-*s => %zu\n", 50, "  allocations", lazy_sum_allocations);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1'000'000;
+  ShowPipeline();
+  BenchmarkPipeline(count);
+}
@@ -0,0 +1,309 @@
+/*
+ * Puts the classification from type_effects.cc to work.
+ *
+ * BulkCopy, BulkMove, BulkFill and BulkSerialize check the element type at
+ * compile time:
+ *
+ *  - Trivially copyable types can be copied byte by byte, so a whole range is
+ *    one memcpy (memmove for BulkMove) and serialization writes the range with
+ *    a single writev call.
+ *  - Every other type falls back to element-wise copy or move assignment and
+ *    to a per-element SerializeFields() overload that the type provides.
+ *
+ * Note that trivially copyable is weaker than trivial. NonTrivialPerson has a
+ * user-provided default constructor, so it is not trivial, but its copy
+ * operations are still the implicit ones and it takes the memcpy path.
+ * Serialization also requires standard layout, so that the bytes written do
+ * not depend on how the compiler arranges base classes and access sections.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o bulk_copy.o bulk_copy.cc
+ *
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "../common/timer.h"
+
+struct TrivialPerson {
+  int id_;
+  float weight_;
+  TrivialPerson() = default;
+};
+
+struct NonTrivialPerson {
+  int id_;
+  float weight_;
+  NonTrivialPerson() {}
+};
+
+class StandardLayoutPerson {
+private:
+  float weight_;
+  int id_;
+public:
+  StandardLayoutPerson(float weight, int id) : weight_{weight}, id_{id} {}
+  StandardLayoutPerson() {}
+};
+
+struct AggregatePerson {
+  int id_;
+  float weight_;
+  AggregatePerson() = default;
+};
+
+// Same members, but a user-provided copy makes it not trivially copyable
+struct CopyCountedPerson {
+  int id_;
+  float weight_;
+  CopyCountedPerson() = default;
+  CopyCountedPerson(const CopyCountedPerson& rhs) : id_{rhs.id_}, weight_{rhs.weight_} {
+    ++copy_count_;
+  }
+  CopyCountedPerson& operator=(const CopyCountedPerson& rhs) {
+    id_ = rhs.id_;
+    weight_ = rhs.weight_;
+    ++copy_count_;
+    return *this;
+  }
+  static inline std::size_t copy_count_ = 0;
+};
+
+struct NamedPerson {
+  int id_;
+  std::string name_;
+};
+
+static_assert(std::is_trivially_copyable_v<TrivialPerson>);
+static_assert(std::is_trivially_copyable_v<NonTrivialPerson>);
+static_assert(std::is_trivially_copyable_v<StandardLayoutPerson>);
+static_assert(std::is_trivially_copyable_v<AggregatePerson>);
+static_assert(!std::is_trivially_copyable_v<CopyCountedPerson>);
+static_assert(!std::is_trivially_copyable_v<NamedPerson>);
+
+template<typename T>
+constexpr bool is_memcpyable_v = std::is_trivially_copyable_v<T>;
+
+template<typename T>
+constexpr bool is_byte_serializable_v = std::is_trivially_copyable_v<T> && std::is_standard_layout_v<T>;
+
+/*
+ * Copies [first, last) into the already constructed range starting at `out`.
+ * Ranges must not overlap.
+ */
+template<typename T>
+T* BulkCopy(const T* first, const T* last, T* out) {
+  const std::size_t count = static_cast<std::size_t>(last - first);
+  if constexpr (is_memcpyable_v<T>) {
+    if (count != 0) {
+      memcpy(out, first, count * sizeof(T));
+    }
+    return out + count;
+  } else {
+    return std::copy(first, last, out);
+  }
+}
+
+/*
+ * Moves [first, last) into the already constructed range starting at `out`,
+ * leaving the source elements moved-from. Like std::move, `out` may overlap
+ * the source as long as it does not start inside it. For trivially copyable
+ * types moving is copying, and memmove allows any overlap.
+ */
+template<typename T>
+T* BulkMove(T* first, T* last, T* out) {
+  const std::size_t count = static_cast<std::size_t>(last - first);
+  if constexpr (is_memcpyable_v<T>) {
+    if (count != 0) {
+      memmove(out, first, count * sizeof(T));
+    }
+    return out + count;
+  } else {
+    return std::move(first, last, out);
+  }
+}
+
+/*
+ * Assigns `value` to every element of [first, last). The trivial path copies
+ * the first element and then doubles the filled prefix with memcpy, so the
+ * number of calls is logarithmic in the range size.
+ */
+template<typename T>
+void BulkFill(T* first, T* last, const T& value) {
+  const std::size_t count = static_cast<std::size_t>(last - first);
+  if constexpr (is_memcpyable_v<T>) {
+    if (count == 0) {
+      return;
+    }
+    memcpy(first, &value, sizeof(T));
+    std::size_t filled = 1;
+    while (filled < count) {
+      const std::size_t chunk = std::min(filled, count - filled);
+      memcpy(first + filled, first, chunk * sizeof(T));
+      filled += chunk;
+    }
+  } else {
+    std::fill(first, last, value);
+  }
+}
+
+/*
+ * Field-wise serialization hooks for the fallback path.
+ */
+template<typename T>
+void AppendBytes(std::string& buffer, const T& value) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void SerializeFields(std::string& buffer, const CopyCountedPerson& person) {
+  AppendBytes(buffer, person.id_);
+  AppendBytes(buffer, person.weight_);
+}
+
+void SerializeFields(std::string& buffer, const NamedPerson& person) {
+  AppendBytes(buffer, person.id_);
+  AppendBytes(buffer, static_cast<std::uint32_t>(person.name_.size()));
+  buffer.append(person.name_);
+}
+
+bool WriteAll(int fd, iovec* iov, int iov_count) {
+  while (iov_count > 0) {
+    ssize_t written = writev(fd, iov, iov_count);
+    if (written < 0) {
+      return false;
+    }
+    // Skip what has been written and retry the rest
+    while (iov_count > 0 && static_cast<std::size_t>(written) >= iov->iov_len) {
+      written -= static_cast<ssize_t>(iov->iov_len);
+      ++iov;
+      --iov_count;
+    }
+    if (iov_count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+      iov->iov_len -= static_cast<std::size_t>(written);
+    }
+  }
+  return true;
+}
+
+/*
+ * Writes an element count followed by the elements. Byte-serializable ranges
+ * go out with one writev of the header and the raw array, other ranges are
+ * encoded into a buffer first. The raw path writes the object representation
+ * as it is, padding bytes included, so callers that need reproducible output
+ * must zero their objects before filling them in.
+ */
+template<typename T>
+bool BulkSerialize(int fd, const T* first, const T* last) {
+  std::uint64_t count = static_cast<std::uint64_t>(last - first);
+  if constexpr (is_byte_serializable_v<T>) {
+    iovec iov[2] = {
+      {&count, sizeof(count)},
+      {const_cast<T*>(first), count * sizeof(T)}
+    };
+    return WriteAll(fd, iov, 2);
+  } else {
+    std::string buffer;
+    AppendBytes(buffer, count);
+    for (; first != last; ++first) {
+      SerializeFields(buffer, *first);
+    }
+    iovec iov[1] = {{buffer.data(), buffer.size()}};
+    return WriteAll(fd, iov, 1);
+  }
+}
+
+void ShowPathSelection() {
+  std::vector<CopyCountedPerson> source(4);
+  std::vector<CopyCountedPerson> target(4);
+  BulkCopy(source.data(), source.data() + source.size(), target.data());
+  // Fallback path, the user-provided copy assignment runs for every element
+  std::cout << "CopyCountedPerson copies: " << CopyCountedPerson::copy_count_ << std::endl;
+
+  std::vector<NamedPerson> named(2, NamedPerson{1, "Ser Barristan Selmy of the Kingsguard"});
+  std::vector<NamedPerson> moved(2);
+  // Fallback path, the strings are stolen instead of copied
+  BulkMove(named.data(), named.data() + named.size(), moved.data());
+  std::cout << "Moved name: " << moved[0].name_ << ", source name length: "
+            << named[0].name_.size() << std::endl;
+
+  std::vector<AggregatePerson> aggregates(8);
+  BulkFill(aggregates.data(), aggregates.data() + aggregates.size(), AggregatePerson{7, 1.5f});
+  std::cout << "Last aggregate after fill: " << aggregates.back().id_ << " - "
+            << aggregates.back().weight_ << std::endl << std::endl;
+}
+
+/*
+ * Element-wise reference loop for the same work, which is what the fallback
+ * path does and what the compiler has to see through for the trivial types.
+ */
+template<typename T>
+void ElementWiseCopy(const T* first, const T* last, T* out) {
+  for (; first != last; ++first, ++out) {
+    *out = *first;
+  }
+}
+
+template<typename T>
+void BenchmarkType(const char* type_name, std::size_t count, int fd) {
+  std::vector<T> source(count);
+  std::vector<T> target(count);
+  if constexpr (is_memcpyable_v<T>) {
+    // The user-provided default constructors leave members uninitialized
+    memset(static_cast<void*>(source.data()), 0, count * sizeof(T));
+  }
+  const T* first = source.data();
+  const T* last = first + count;
+
+  double copy_ms = MeasureBestMs(3, [&] { BulkCopy(first, last, target.data()); DoNotOptimize(target.data()); });
+  double loop_ms = MeasureBestMs(3, [&] { ElementWiseCopy(first, last, target.data()); DoNotOptimize(target.data()); });
+  // Moves there and back, so every round moves from valid elements
+  std::vector<T> moving = source;
+  double move_ms = MeasureBestMs(3, [&] {
+    BulkMove(moving.data(), moving.data() + count, target.data());
+    BulkMove(target.data(), target.data() + count, moving.data());
+    DoNotOptimize(moving.data());
+  });
+  double fill_ms = MeasureBestMs(3, [&] { BulkFill(target.data(), target.data() + count, source[0]); DoNotOptimize(target.data()); });
+  double serialize_ms = MeasureBestMs(3, [&] {
+    lseek(fd, 0, SEEK_SET);
+    BulkSerialize(fd, first, last);
+  });
+
+  std::cout << type_name << (is_memcpyable_v<T> ? " (memcpy path)" : " (element-wise path)") << std::endl;
+  LOG_BENCH("  BulkCopy", copy_ms, count);
+  LOG_BENCH("  element-wise copy loop", loop_ms, count);
+  LOG_BENCH("  BulkMove", move_ms, 2 * count);
+  LOG_BENCH("  BulkFill", fill_ms, count);
+  LOG_BENCH("  BulkSerialize to an in-memory file", serialize_ms, count);
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4'000'000;
+  ShowPathSelection();
+
+  // Writes land in the page cache, not on a disk, so only the copying is measured
+  int fd = memfd_create("bulk_copy", 0);
+  if (fd == -1) {
+    perror("memfd_create");
+    return 1;
+  }
+  BenchmarkType<TrivialPerson>("TrivialPerson", count, fd);
+  BenchmarkType<NonTrivialPerson>("NonTrivialPerson", count, fd);
+  BenchmarkType<StandardLayoutPerson>("StandardLayoutPerson", count, fd);
+  BenchmarkType<AggregatePerson>("AggregatePerson", count, fd);
+  BenchmarkType<CopyCountedPerson>("CopyCountedPerson", count, fd);
+  BenchmarkType<NamedPerson>("NamedPerson", count, fd);
+  close(fd);
+}
@@ -0,0 +1,675 @@
+/*
+ * noexcept move audit
+ *
+ * std::vector gives push_back the strong exception guarantee. When it grows,
+ * it relocates the old elements with std::move_if_noexcept, which only moves
+ * if the move constructor is noexcept (or there is no copy constructor to fall
+ * back to). Otherwise every element is silently copied on every reallocation.
+ *
+ * This file keeps a copy of every class of the repo's examples, each one in a
+ * namespace named after its example, and reports for every class:
+ *
+ *  - whether it is nothrow move constructible, copy constructible and
+ *    trivially copyable, all evaluated at compile time
+ *  - what std::vector does with it when it grows
+ *
+ * Then it measures what that choice costs. Every class is wrapped once with a
+ * noexcept move constructor and once with a potentially throwing one, and the
+ * same growth workload runs on both. For classes without a real move
+ * constructor both wrappers end up copying and the gap disappears.
+ *
+ * The copies declare their special members exactly as the examples do, minus
+ * the printing, so they have to follow when an example changes. Classes of
+ * overload_resolution.cc are left out, that example does not compile by design.
+ *
+ * Compile:
+ *
+ * g++ -std=c++17 -O2 -o noexcept_move_audit.o noexcept_move_audit.cc
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "../common/timer.h"
+
+/*
+ * Local copies of the classes under audit, each in a namespace named after
+ * the example it comes from. Special members are declared exactly as in the
+ * example, since that is what decides the result; the printing is dropped.
+ * Classes repeated verbatim across examples are declared once and aliased.
+ */
+namespace copy_ops_gen_rules {
+
+class CopyOpsGeneratedPerson {
+public:
+  CopyOpsGeneratedPerson(std::string name, int id) : name_{name}, id_{id} {}
+  ~CopyOpsGeneratedPerson() {}
+private:
+  std::string name_;
+  int id_;
+};
+
+class MemberPerson {
+public:
+  MemberPerson(int id) : id_{id} {}
+  MemberPerson(const MemberPerson&) = delete;
+private:
+  int id_;
+};
+
+class NoCopyCtorPerson {
+public:
+  NoCopyCtorPerson(std::string name, int id) : name_{name}, id_{id}, member_person_{id + 1} {}
+  ~NoCopyCtorPerson() {}
+private:
+  std::string name_;
+  int id_;
+  MemberPerson member_person_;
+};
+
+class NoCopyAssignPerson {
+public:
+  NoCopyAssignPerson(std::string name, int& id_ref) : name_{name}, id_ref_{id_ref} {}
+  ~NoCopyAssignPerson() {}
+private:
+  std::string name_;
+  int& id_ref_;
+};
+
+}  // namespace copy_ops_gen_rules
+
+namespace deep_copy {
+
+class Person {
+public:
+  Person(const char* name) : name_(new char[strlen(name) + 1]) {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+  ~Person() {
+    delete [] name_;
+  }
+  Person(const Person& rhs) : Person(rhs.name_) {}
+  Person& operator=(const Person& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = new char[name_size];
+    memcpy(new_name, rhs.name_, name_size);
+    delete [] name_;
+    name_ = new_name;
+    return *this;
+  }
+private:
+  char* name_;
+};
+
+}  // namespace deep_copy
+
+namespace shallow_copy {
+
+// Only audited, its copies share and double-delete name_
+class Person {
+public:
+  Person(const char* name) : name_(new char[strlen(name) + 1]) {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+  ~Person() {
+    delete [] name_;
+  }
+private:
+  char* name_;
+};
+
+}  // namespace shallow_copy
+
+namespace move_semantics {
+
+class Person {
+public:
+  Person(const char* name) : name_{new char[strlen(name) + 1]} {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+  ~Person() {
+    delete [] name_;
+  }
+  Person(const Person& rhs) : Person(rhs.name_) {}
+  Person& operator=(const Person& rhs) {
+    if (this == &rhs) {
+      return *this;
+    }
+    size_t name_size = strlen(rhs.name_) + 1;
+    char* new_name = new char[name_size];
+    memcpy(new_name, rhs.name_, name_size);
+    delete [] name_;
+    name_ = new_name;
+    return *this;
+  }
+  Person(Person&& rhs) noexcept : name_{rhs.name_} {
+    rhs.name_ = nullptr;
+  }
+  Person& operator=(Person&& rhs) noexcept {
+    if (this != &rhs) {
+      delete [] name_;
+      name_ = rhs.name_;
+      rhs.name_ = nullptr;
+    }
+    return *this;
+  }
+private:
+  char* name_;
+};
+
+}  // namespace move_semantics
+
+namespace using_swap {
+
+class Person {
+public:
+  Person(const char* name) : name_{new char[strlen(name) + 1]} {
+    memcpy(name_, name, strlen(name) + 1);
+  }
+  ~Person() {
+    delete [] name_;
+  }
+  Person(const Person& rhs) : Person(rhs.name_) {}
+  Person(Person&& rhs) noexcept : name_{rhs.name_} {
+    rhs.name_ = nullptr;
+  }
+  Person& operator=(Person rhs) {
+    swap(*this, rhs);
+    return *this;
+  }
+  friend void swap(Person& first, Person& second) {
+    using std::swap;
+    swap(first.name_, second.name_);
+  }
+private:
+  char* name_;
+};
+
+}  // namespace using_swap
+
+namespace when_not_to_move {
+using Person = move_semantics::Person;
+}
+
+namespace when_to_move {
+using Person = deep_copy::Person;
+}
+
+namespace forwarding {
+
+class Wrapped {
+public:
+  Wrapped() {}
+  Wrapped(const Wrapped&) {}
+  Wrapped(Wrapped&&) {}
+};
+
+class Wrapper {
+public:
+  Wrapper(const Wrapped& wrapped) : wrapped_{wrapped} {}
+private:
+  Wrapped wrapped_;
+};
+
+class Person {
+public:
+  Person(int id, const std::string& name) : id_{id}, name_{name} {}
+  Person(int id, std::string&& name) : id_{id}, name_{std::move(name)} {}
+private:
+  int id_;
+  std::string name_;
+};
+
+}  // namespace forwarding
+
+namespace overloading_forwarding_references {
+struct Base {};
+struct Derived : Base {};
+struct Other {};
+}
+
+namespace pass_by_value {
+
+class PersonTraits {
+public:
+  PersonTraits(int id, std::string name) : id_{id}, name_{name} {}
+  PersonTraits(const PersonTraits& rhs) : id_{rhs.id_}, name_{rhs.name_} {}
+  // Copies name_ like the original does
+  PersonTraits(PersonTraits&& rhs) noexcept : id_{rhs.id_}, name_{rhs.name_} {}
+private:
+  int id_;
+  std::string name_;
+};
+
+class MostPerfectPerson {
+public:
+  template<
+    typename T,
+    typename = std::enable_if_t<
+      !std::is_base_of_v<MostPerfectPerson, std::decay_t<T>>>
+  >
+  MostPerfectPerson(T&& trait) : trait_{std::forward<T>(trait)} {}
+private:
+  PersonTraits trait_;
+};
+
+class PassByValuePerson {
+public:
+  PassByValuePerson(PersonTraits trait) : trait_{std::move(trait)} {}
+private:
+  PersonTraits trait_;
+};
+
+}  // namespace pass_by_value
+
+namespace perfect_forwarding_constructor {
+
+using pass_by_value::PersonTraits;
+using pass_by_value::MostPerfectPerson;
+
+class InefficientPerson {
+public:
+  InefficientPerson(const PersonTraits& trait) : trait_{trait} {}
+private:
+  PersonTraits trait_;
+};
+
+class TediousPerson {
+public:
+  TediousPerson(const PersonTraits& trait) : trait_{trait} {}
+  TediousPerson(PersonTraits&& trait) : trait_{std::move(trait)} {}
+private:
+  PersonTraits trait_;
+};
+
+class PerfectPerson {
+public:
+  template<typename T>
+  PerfectPerson(T&& trait) : trait_{std::forward<T>(trait)} {}
+private:
+  PersonTraits trait_;
+};
+
+}  // namespace perfect_forwarding_constructor
+
+namespace perfect_forwarding_constructor_better {
+
+using pass_by_value::PersonTraits;
+
+class PersonInventory {
+public:
+  PersonInventory(const std::vector<float> values, std::vector<std::string> items)
+    : values_{values}, items_{items} {}
+  PersonInventory(const PersonInventory& rhs) : values_{rhs.values_}, items_{rhs.items_} {}
+  // Copies both vectors like the original does
+  PersonInventory(PersonInventory&& rhs) noexcept : values_{rhs.values_}, items_{rhs.items_} {}
+private:
+  std::vector<float> values_;
+  std::vector<std::string> items_;
+};
+
+class PerfectPerson {
+public:
+  template<typename T1, typename T2>
+  PerfectPerson(T1&& t1, T2&& t2)
+    : trait_{std::forward<T1>(t1)}, inventory_{std::forward<T2>(t2)} {}
+private:
+  PersonTraits trait_;
+  PersonInventory inventory_;
+};
+
+}  // namespace perfect_forwarding_constructor_better
+
+namespace sfinae {
+struct NoNameField { int id; };
+struct WithNameField { std::string name; };
+struct WithWrongNameField { std::string not_name; };
+struct NoNameFunc { int Id(); };
+struct WithNameFunc { std::string Name() const; };
+struct WithWrongNameFunc { std::string GetName(); };
+}
+
+namespace sfinae_modern {
+using sfinae::NoNameField;
+using sfinae::WithNameField;
+using sfinae::WithWrongNameField;
+}
+
+namespace c21_67 {
+
+class BasePerson {
+public:
+  BasePerson() = default;
+  virtual ~BasePerson() = default;
+  BasePerson(BasePerson&&) = default;
+  BasePerson& operator=(BasePerson&&) = default;
+  BasePerson(const BasePerson&) = default;
+  BasePerson& operator=(const BasePerson&) = default;
+  virtual const char* GetName() { return "BasePerson"; }
+};
+
+class DerivedPerson : public BasePerson {
+public:
+  DerivedPerson() = default;
+  const char* GetName() override { return "DerivedPerson"; }
+};
+
+class Base {
+public:
+  Base() = default;
+  virtual ~Base() = default;
+  Base(Base&&) = default;
+  Base& operator=(Base&&) = default;
+  Base(const Base&) = default;
+  Base& operator=(const Base&) = default;
+  virtual std::unique_ptr<Base> Clone() = 0;
+  virtual const char* GetName() const { return "Base"; }
+};
+
+class Derived : public Base {
+public:
+  std::unique_ptr<Base> Clone() override {
+    return std::make_unique<Derived>(*this);
+  }
+  const char* GetName() const override { return "Derived"; }
+};
+
+}  // namespace c21_67
+
+namespace special_member_generation {
+
+class CopyablePerson {
+private:
+  std::string name_;
+  int id_;
+public:
+  CopyablePerson(const std::string name, int id) : name_(name), id_(id) {}
+  CopyablePerson(const CopyablePerson& rhs) : name_{rhs.name_}, id_{rhs.id_} {}
+};
+
+class NotMovablePerson {
+private:
+  std::string name_;
+  int id_;
+public:
+  NotMovablePerson(const std::string name, int id) : name_(name), id_(id) {}
+  NotMovablePerson(const NotMovablePerson& rhs) : name_{rhs.name_}, id_{rhs.id_} {}
+  NotMovablePerson(NotMovablePerson&& rhs) = delete;
+  NotMovablePerson& operator=(NotMovablePerson&& rhs) = delete;
+};
+
+class MovablePerson {
+private:
+  std::string name_;
+  int id_;
+public:
+  MovablePerson(const std::string name, int id) : name_(name), id_(id) {}
+  MovablePerson(MovablePerson&& rhs) = default;
+  MovablePerson& operator=(MovablePerson&& rhs) = default;
+};
+
+}  // namespace special_member_generation
+
+namespace type_effects {
+
+struct TrivialPerson {
+  int id_;
+  float weight_;
+  TrivialPerson() = default;
+};
+
+struct NonTrivialPerson {
+  int id_;
+  float weight_;
+  NonTrivialPerson() {}
+};
+
+class StandardLayoutPerson {
+private:
+  float weight_;
+  int id_;
+public:
+  StandardLayoutPerson(float weight, int id) : weight_{weight}, id_{id} {}
+  StandardLayoutPerson() {}
+};
+
+class NonStandardLayoutPerson {
+private:
+  float weight_;
+  int id_;
+public:
+  float height_;
+  NonStandardLayoutPerson(float weight, int id, float height)
+    : weight_{weight}, id_{id}, height_{height} {}
+  NonStandardLayoutPerson() {}
+};
+
+class StandardLayoutDerived : public StandardLayoutPerson {};
+
+struct AggregatePerson {
+  int id_;
+  float weight_;
+  AggregatePerson() = default;
+};
+
+struct NonAggregatePerson {
+  int id_;
+  float weight_;
+  NonAggregatePerson() {}
+};
+
+}  // namespace type_effects
+
+namespace value_types {
+
+struct Inventory {};
+struct Skills {};
+
+struct Person {
+  Person(Inventory& inv_ref) : inv_ref_(inv_ref) {}
+  double hp_;
+  Inventory& inv_ref_;
+  Skills skills_;
+};
+
+}  // namespace value_types
+
+namespace value_types_more {
+using Person = move_semantics::Person;
+}
+
+template<typename T>
+constexpr const char* VectorGrowthPolicy() {
+  if constexpr (!std::is_move_constructible_v<T> && !std::is_copy_constructible_v<T>) {
+    return "cannot grow";
+  } else if constexpr (std::is_trivially_copyable_v<T>) {
+    return "memmove";
+  } else if constexpr (std::is_nothrow_move_constructible_v<T>) {
+    return "moves";
+  } else if constexpr (std::is_copy_constructible_v<T>) {
+    return "COPIES";
+  } else {
+    return "moves, no strong guarantee";
+  }
+}
+
+inline const char* YesNo(bool value) { return value ? "yes" : "no"; }
+
+template<typename T>
+void ReportClass(const char* name) {
+  printf("%-*s %-8s %-6s %-8s %s\n", 56, name,
+    YesNo(std::is_nothrow_move_constructible_v<T>),
+    YesNo(std::is_copy_constructible_v<T>),
+    YesNo(std::is_trivially_copyable_v<T>),
+    VectorGrowthPolicy<T>());
+}
+
+#define REPORT_CLASS(type) ReportClass<type>(#type)
+
+void ShowAudit() {
+  printf("%-*s %-8s %-6s %-8s %s\n", 56, "class", "nothrow", "copy", "trivial", "std::vector growth");
+  printf("%-*s %-8s %-6s %-8s\n", 56, "", "move", "", "copy");
+
+  REPORT_CLASS(copy_ops_gen_rules::CopyOpsGeneratedPerson);
+  REPORT_CLASS(copy_ops_gen_rules::MemberPerson);
+  REPORT_CLASS(copy_ops_gen_rules::NoCopyCtorPerson);
+  REPORT_CLASS(copy_ops_gen_rules::NoCopyAssignPerson);
+  REPORT_CLASS(deep_copy::Person);
+  REPORT_CLASS(shallow_copy::Person);
+  REPORT_CLASS(move_semantics::Person);
+  REPORT_CLASS(using_swap::Person);
+  REPORT_CLASS(when_not_to_move::Person);
+  REPORT_CLASS(when_to_move::Person);
+  REPORT_CLASS(forwarding::Wrapped);
+  REPORT_CLASS(forwarding::Wrapper);
+  REPORT_CLASS(forwarding::Person);
+  REPORT_CLASS(overloading_forwarding_references::Base);
+  REPORT_CLASS(overloading_forwarding_references::Derived);
+  REPORT_CLASS(overloading_forwarding_references::Other);
+  REPORT_CLASS(pass_by_value::PersonTraits);
+  REPORT_CLASS(pass_by_value::MostPerfectPerson);
+  REPORT_CLASS(pass_by_value::PassByValuePerson);
+  REPORT_CLASS(perfect_forwarding_constructor::PersonTraits);
+  REPORT_CLASS(perfect_forwarding_constructor::InefficientPerson);
+  REPORT_CLASS(perfect_forwarding_constructor::TediousPerson);
+  REPORT_CLASS(perfect_forwarding_constructor::PerfectPerson);
+  REPORT_CLASS(perfect_forwarding_constructor::MostPerfectPerson);
+  REPORT_CLASS(perfect_forwarding_constructor_better::PersonTraits);
+  REPORT_CLASS(perfect_forwarding_constructor_better::PersonInventory);
+  REPORT_CLASS(perfect_forwarding_constructor_better::PerfectPerson);
+  REPORT_CLASS(sfinae::NoNameField);
+  REPORT_CLASS(sfinae::WithNameField);
+  REPORT_CLASS(sfinae::WithWrongNameField);
+  REPORT_CLASS(sfinae::NoNameFunc);
+  REPORT_CLASS(sfinae::WithNameFunc);
+  REPORT_CLASS(sfinae::WithWrongNameFunc);
+  REPORT_CLASS(sfinae_modern::NoNameField);
+  REPORT_CLASS(sfinae_modern::WithNameField);
+  REPORT_CLASS(sfinae_modern::WithWrongNameField);
+  REPORT_CLASS(c21_67::BasePerson);
+  REPORT_CLASS(c21_67::DerivedPerson);
+  REPORT_CLASS(c21_67::Base);
+  REPORT_CLASS(c21_67::Derived);
+  REPORT_CLASS(special_member_generation::CopyablePerson);
+  REPORT_CLASS(special_member_generation::NotMovablePerson);
+  REPORT_CLASS(special_member_generation::MovablePerson);
+  REPORT_CLASS(type_effects::TrivialPerson);
+  REPORT_CLASS(type_effects::NonTrivialPerson);
+  REPORT_CLASS(type_effects::StandardLayoutPerson);
+  REPORT_CLASS(type_effects::NonStandardLayoutPerson);
+  REPORT_CLASS(type_effects::StandardLayoutDerived);
+  REPORT_CLASS(type_effects::AggregatePerson);
+  REPORT_CLASS(type_effects::NonAggregatePerson);
+  REPORT_CLASS(value_types::Inventory);
+  REPORT_CLASS(value_types::Skills);
+  REPORT_CLASS(value_types::Person);
+  REPORT_CLASS(value_types_more::Person);
+  printf("\n");
+}
+
+/*
+ * Holds a T and decides how noexcept its move constructor is, so that the
+ * same class can be relocated through both branches of move_if_noexcept.
+ */
+template<typename T, bool NoexceptMove>
+class Relocatable {
+public:
+  template<typename Factory>
+  Relocatable(std::in_place_t, Factory& make) : value_{make()} {}
+  Relocatable(const Relocatable&) = default;
+  // Defined as deleted, and ignored by overload resolution, if T cannot be moved
+  Relocatable(Relocatable&&) noexcept(NoexceptMove) = default;
+private:
+  T value_;
+};
+
+/*
+ * Fills a vector to its capacity and times only the next reallocation, which
+ * relocates every element either by move or by copy.
+ */
+template<typename Wrapped, typename Factory>
+double MeasureGrowth(Factory& make, std::size_t count) {
+  double best_ms = 0.0;
+  for (int run = 0; run < 3; ++run) {
+    std::vector<Wrapped> elements;
+    elements.reserve(count);
+    for (std::size_t idx = 0; idx < count; ++idx) {
+      elements.emplace_back(std::in_place, make);
+    }
+    double ms = MeasureMs([&] {
+      elements.emplace_back(std::in_place, make);
+      DoNotOptimize(elements.data());
+    });
+    best_ms = run == 0 ? ms : std::min(best_ms, ms);
+  }
+  return best_ms;
+}
+
+template<typename T, typename Factory>
+void BenchmarkClass(const char* name, Factory make, std::size_t count) {
+  printf("%s\n", name);
+  // A type that can neither move nor copy cannot grow a vector; only report it
+  if constexpr (!std::is_move_constructible_v<T> && !std::is_copy_constructible_v<T>) {
+    printf("%-*s => %s\n", 50, "  growth", VectorGrowthPolicy<T>());
+  } else {
+    // Without a move constructor both wrappers copy
+    double fallback_ms = MeasureGrowth<Relocatable<T, false>>(make, count);
+    double noexcept_ms = MeasureGrowth<Relocatable<T, true>>(make, count);
+    printf("%-*s => %10.2f ms (%s)\n", 50, "  growth, move may throw", fallback_ms,
+      VectorGrowthPolicy<Relocatable<T, false>>());
+    printf("%-*s => %10.2f ms (%s)\n", 50, "  growth, noexcept move", noexcept_ms,
+      VectorGrowthPolicy<Relocatable<T, true>>());
+  }
+}
+
+#define BENCHMARK_CLASS(type, ...) BenchmarkClass<type>(#type, [] { return type{__VA_ARGS__}; }, count)
+
+/*
+ * Classes that cannot be constructed on their own (abstract Base) or whose
+ * copies are unsafe (shallow_copy::Person double-deletes its name) are left out.
+ * For classes with only a copy constructor, such as CopyablePerson, the
+ * wrapper's move still copies the value, so only the dispatch cost differs.
+ */
+void BenchmarkGrowth(std::size_t count) {
+  static int id = 7;
+  static value_types::Inventory inventory;
+  printf("Reallocating a std::vector of %zu elements\n", count);
+  BENCHMARK_CLASS(copy_ops_gen_rules::CopyOpsGeneratedPerson, "Aerys II Targaryen", 15);
+  BENCHMARK_CLASS(copy_ops_gen_rules::NoCopyCtorPerson, "Jaqen H'ghar", 0);
+  BENCHMARK_CLASS(copy_ops_gen_rules::NoCopyAssignPerson, "Davos Seaworth", id);
+  BENCHMARK_CLASS(deep_copy::Person, "Ned Stark");
+  BENCHMARK_CLASS(move_semantics::Person, "Mance Rayder");
+  BENCHMARK_CLASS(using_swap::Person, "Mance Rayder");
+  BENCHMARK_CLASS(when_not_to_move::Person, "Mance Rayder");
+  BENCHMARK_CLASS(when_to_move::Person, "Mance Rayder");
+  BENCHMARK_CLASS(forwarding::Person, 62, "Rat Cook");
+  BENCHMARK_CLASS(pass_by_value::PersonTraits, 1, "trait_lvalue");
+  BENCHMARK_CLASS(perfect_forwarding_constructor_better::PersonTraits, 1, "trait_lvalue");
+  BENCHMARK_CLASS(perfect_forwarding_constructor_better::PersonInventory,
+    std::vector<float>{5.5, 3.5, 2.5}, std::vector<std::string>{"Sword", "Shield", "Dagger"});
+  BENCHMARK_CLASS(c21_67::DerivedPerson);
+  BENCHMARK_CLASS(c21_67::Derived);
+  BENCHMARK_CLASS(special_member_generation::CopyablePerson, "Stannis Baratheon", 1);
+  BENCHMARK_CLASS(special_member_generation::NotMovablePerson, "Rhaegar Targaryen", 55);
+  BENCHMARK_CLASS(special_member_generation::MovablePerson, "Jojen Reed", 74);
+  BENCHMARK_CLASS(type_effects::TrivialPerson);
+  BENCHMARK_CLASS(type_effects::AggregatePerson, 1, 2.5);
+  BENCHMARK_CLASS(value_types::Person, inventory);
+  BENCHMARK_CLASS(value_types_more::Person, "Robb Stark");
+}
+
+int main(int argc, char** argv) {
+  std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100'000;
+  ShowAudit();
+  BenchmarkGrowth(count);
+}